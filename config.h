@@ -8,6 +8,19 @@
 // How often the on-screen statistics is refreshed (in usecs)
 #define STATISTICS_REFRESH_INTERVAL 200000
 
+// If defined together with STATISTICS, the statistics (frame rate, SPI bus data rate, and the CPU time and context switches of each
+// pipeline thread) are written to this file in Prometheus text format at each statistics refresh, e.g. for node_exporter's textfile collector.
+// #define STATISTICS_METRICS_FILE "/tmp/fbcp-ili9341.prom"
+
+// If defined together with STATISTICS, a graph strip is drawn under the statistics overlay, with one column per display update over
+// the last few seconds: the time since the previous update as a bar (yellow if the update was interlaced), the SPI bus utilisation
+// during it as a cyan dot, and a red mark at the top if source frames were skipped. A grey line marks the target frame interval.
+// #define STATISTICS_GRAPH
+
+// Height of the graph strip in pixels, and the update interval in usecs that reaches the top of it
+#define STATISTICS_GRAPH_HEIGHT 16
+#define STATISTICS_GRAPH_MAX_INTERVAL 50000
+
 // How many usecs worth of past frame rate data do we preserve in the history buffer. Higher values
 // make the frame rate display counter smoother and respond to changes with a delay, whereas smaller
 // values can make the display fluctuate a bit erratically.
@@ -20,14 +33,28 @@
 // here to allow toggling to debug this assumption.
 // #define NO_THROTTLING
 
-// If defined, display updates are synced to the vsync signal provided by the VideoCore GPU. That seems
-// to occur quite precisely at 60 Hz. Testing on PAL NES games that run at 50Hz, this will not work well,
-// since they produce new frames at every 20msecs, and the VideoCore functions for snapshotting also will
-// output new frames at this vsync-detached interval, so there's a 50 Hz vs 60 Hz mismatch that results
-// in visible microstuttering. Still, providing this as an option, this might be good for content that
-// is known to run at native 60Hz.
+// If defined, the vsync signal of the VideoCore GPU, which occurs quite precisely at 60 Hz, is used as the time base for capturing.
+// The phase after vsync at which the content changes is learned, and while the content stays locked to it, snapshots are taken
+// right at that phase of the vsyncs that the content is expected to update on, instead of at times predicted from the frame
+// arrival histogram. Content that is not locked to vsync (e.g. PAL NES games that run at 50Hz, against the 60Hz vsync) is detected
+// from the phases of its frames scattering over the vsync period, and then capturing falls back to the histogram predictor.
 // #define USE_GPU_VSYNC
 
+// With USE_GPU_VSYNC, capturing locks to vsync once this many frames in a row have arrived at a coherent phase: the mean
+// resultant length of their phases on the vsync period, from 0 (uniformly scattered) to 1 (all at the same phase), reaches
+// VSYNC_LOCK_COHERENCE. The phases are those at which the polling finds the frames, and they drift while the polling cadence
+// settles after startup, so in the simulator the lock comes after about 50 frames. The lock is dropped if more than
+// VSYNC_UNLOCK_MISS_RATE of the snapshots taken at the learned phase miss the new frame.
+#define VSYNC_LOCK_MIN_FRAMES 16
+#define VSYNC_LOCK_COHERENCE 0.9
+#define VSYNC_UNLOCK_MISS_RATE 0.35
+
+// While locked, each snapshot that finds a new frame at the learned phase moves the phase this many usecs earlier, to track the
+// earliest time the content is ready. A snapshot that misses is retried after VSYNC_RETRY_USECS, and the phase at which the frame
+// was then found, halfway from the phase that missed, is taken as the new phase.
+#define VSYNC_PHASE_STEP_USECS 50
+#define VSYNC_RETRY_USECS 1000
+
 // If defined, progressive updating is always used (at the expense of slowing down refresh rate if it's
 // too much for the display to handle)
 // #define NO_INTERLACING
@@ -53,12 +80,219 @@
 // to detect if an application uses a non-60Hz update rate, and synchronizes to that instead.
 #define SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
 
+// If defined, a profile of the foreground application is learned while it runs: its frame cadence, content class, how much of the
+// screen it updates, how often its updates needed interlacing, and the SPI bus cost model fitted on its content. The profiles are
+// stored in APP_PROFILES_FILE, and when an application is seen again, e.g. after a restart, its profile is preloaded so that
+// frame arrival prediction (unless its content is static) and the interlacing decisions start out from what was learned instead
+// of from scratch. The foreground application is the busiest process, or if the FBCP_PROFILE environment variable is set, it names
+// the profile to use.
+// #define APP_PROFILES
+
+// State file that the application profiles are kept in.
+#define APP_PROFILES_FILE "/var/lib/fbcp-ili9341.profiles"
+
+// Maximum number of application profiles to keep, the least recently seen application is forgotten when more are seen.
+#define APP_PROFILES_MAX 32
+
+// How often the foreground application is redetected, in usecs.
+#define APP_PROFILES_DETECT_INTERVAL 1000000
+
+// How often the learned profiles are saved, in usecs, on top of saving them whenever the foreground application changes.
+#define APP_PROFILES_SAVE_INTERVAL 60000000
+
+// If defined, the input event devices (/dev/input/event*: keyboards, gamepads, touch) are watched, and any input event cuts the
+// low power polling of SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE short, and polls at the full frame rate for a while after. Otherwise
+// the first reaction on screen to a button press can wait for up to half a second for the next idle poll.
+// #define WAKE_ON_INPUT
+
+// How long to keep polling at the full frame rate after an input event, in usecs.
+#define WAKE_ON_INPUT_BOOST_USECS 2000000
+
+// Keys and buttons always count as input, but absolute axes (sticks, touch panels, accelerometers) only once they have moved by this
+// fraction of their range, so that stick jitter and sensor noise do not keep the polling at the full frame rate.
+#define WAKE_ON_INPUT_ABS_THRESHOLD 0.02
+
+// Likewise, mouse motion only counts as input once it adds up to this many counts. Scroll wheels count on every notch.
+#define WAKE_ON_INPUT_REL_THRESHOLD 4
+
+// If defined, the merged spans of recently seen dirty pixel masks are cached, so that content that dirties exactly the same
+// pixels frame after frame (e.g. a blinking cursor or an animating HUD element) skips the span merging passes on repeats.
+// #define USE_SPAN_PLAN_CACHE
+
+// If defined together with STATISTICS_METRICS_FILE, an alternative "shadow" span planner runs on the same frames as the production
+// planner on a thread of its own, and its plans are only measured, never sent. The bytes, SPI commands, modeled bus time and planning
+// CPU time of both planners are exported side by side, to evaluate a change to the planner on live content before adopting it.
+// #define SHADOW_PLANNER
+
+// Parameters of the shadow planner: the widest gap of unchanged pixels that it merges spans over (the production planner uses 4),
+// and the fraction of the frame time that a progressive update may take before it drops to interlacing (production uses 0.8).
+#define SHADOW_SPAN_MERGE_THRESHOLD 8
+#define SHADOW_INTERLACE_BUDGET 0.9
+
+// CPU core to pin the shadow planner thread to, ideally one that the pipeline threads leave idle, or -1 to not pin it.
+#define SHADOW_PLANNER_CPU 3
+
 // Specifies how fast to communicate the SPI bus at. Possible values are 4, 6, 8, 10, 12, ... Smaller
 // values are faster. On my PiTFT 2.8 display, divisor value of 4 does not work, and 6 is the fastest
 // possible. While developing, it was observed that a value of 12 or higher did not actually work, and
 // only 6, 8 and 10 were functioning properly.
 #define SPI_BUS_CLOCK_DIVISOR 6
 
+// If defined, the STMPE610 resistive touch controller of the PiTFT 2.8" (on SPI0 chip select CE1) is polled by the SPI thread in
+// between display updates, and touches are published as a uinput touchscreen device. The kernel stmpe-ts touch driver can not
+// share the bus with this program, so disable it (e.g. the touch part of the dtoverlay=pitft28-resistive line in /boot/config.txt).
+// #define TOUCH_CONTROLLER_STMPE610
+
+// How often to poll the touch controller, in usecs. Each poll keeps the SPI bus from sending display data for ~30-80 usecs.
+#define TOUCH_POLL_INTERVAL 10000
+
+// SPI clock divider to use when talking to the touch controller. The STMPE610 is rated at up to 1MHz SPI clock.
+#define TOUCH_SPI_CLOCK_DIVISOR 400
+
+// If defined, the SPI thread refills the SPI TX FIFO in batches instead of testing for room in it before each byte, which cuts the
+// status register reads to one per batch. The thread still spins for the whole transfer: the FIFO only holds 16 bytes, which drain
+// in a couple of usecs at the default clock divisor, and even at the slowest usable display clocks in far less time than it takes
+// to wake up from a sleep.
+// #define SPI_BATCHED_FEEDER
+
+// If defined, an event is published to a shared memory ring in /dev/shm for each update that is sent to the display, telling when
+// the frame was captured, when its last byte was sent, whether it was interlaced and how many source frames were skipped before it.
+// Applications can read these to pace their rendering to the actual bus throughput. See presentation.h for the ring layout.
+// #define PRESENTATION_FEEDBACK
+
+// Name of the POSIX shared memory object that presentation feedback events are published to.
+#define PRESENTATION_FEEDBACK_SHM_NAME "/fbcp-ili9341-presentation"
+
+// If defined, pixels that toggle between two close values on every frame, e.g. due to GPU temporal dithering, are detected per
+// 16x16 tile and held at the average of the two values, instead of being resent on every frame only for the eye to blend them.
+// #define OSCILLATION_FILTER
+
+// Largest difference per color channel between the two values of a toggling pixel for it to be held still, in 5-bit units (the
+// 6-bit green channel may differ by twice this). Raising this to 31 also blends e.g. 30Hz blinking effects that are rendered at 60Hz.
+#define OSCILLATION_MAX_AMPLITUDE 2
+
+// Number of frames in a row that a tile has to only toggle, without other changes, before its toggling pixels are held still.
+#define OSCILLATION_DETECT_FRAMES 4
+
+// If 0, toggling pixels are held at the average of their two values. Otherwise they keep their actual values, but are only
+// refreshed on every this many frames.
+#define OSCILLATION_REFRESH_DIVISOR 0
+
+// If defined, screen fades to and from black are detected as a global scaling of the brightness of what is already on the display,
+// and are emulated by dimming the backlight via the display controller (ILI9341 Write Display Brightness, LEDPWM pin) instead of
+// resending every pixel on every step of the fade. Pixels that do not follow the fade are still sent, precompensated for the dimmed
+// backlight. Only useful on boards that drive the backlight from the LEDPWM pin of the controller.
+// #define FADE_EMULATION
+
+// Largest difference per color channel between a pixel of the new frame and the dimmed pixel on the display for it to count as
+// following the fade, in 5-bit units (the 6-bit green channel may differ by twice this).
+#define FADE_MAX_ERROR 1
+
+// A frame is treated as a step of a fade only if at most this percentage of its pixels do not follow the fade.
+#define FADE_MAX_RESIDUAL_PERCENT 25
+
+// Gamma of the panel, used to convert the brightness scaling of the pixel values to a linear backlight level.
+#define FADE_PANEL_GAMMA 2.2
+
+// If defined, pixels are sent as 12-bit RGB444, two pixels packed in three bytes, for as long as the SPI bus is saturated, which cuts
+// the bus time of the pixel data by 25%. When the load drops, the display is switched back to 16 bits per pixel, and every pixel
+// that lost precision is resent. Needs a display controller that takes 12-bit pixels over SPI (DISPLAY_PIXEL_FORMAT_12BPP in the
+// display header, e.g. ST7789 and ST7735), the ILI9341 does not. Only the ILI9341 header exists in this tree, so the mode has only
+// been measured in the simulator, built with -DREDUCED_DEPTH_ON_OVERLOAD -DDISPLAY_PIXEL_FORMAT_12BPP=0x53 (the ST7789/ST7735 COLMOD
+// value for 12 bits per pixel): with full screen motion (FBCP_SIM_RECT=320) the average latency went from 19.5 ms to 14.3 ms.
+// #define REDUCED_DEPTH_ON_OVERLOAD
+
+// Number of new frames in a row whose progressive update would not fit in the frame time budget before switching to 12 bits.
+#define REDUCED_DEPTH_ENTER_FRAMES 8
+
+// Number of new frames in a row whose progressive update at 16 bits per pixel would take less than REDUCED_DEPTH_EXIT_LOAD of the
+// frame time budget before switching back to 16 bits.
+#define REDUCED_DEPTH_EXIT_FRAMES 30
+#define REDUCED_DEPTH_EXIT_LOAD 0.7
+
+// If defined, the refresh rate of the panel (ILI9341 Frame Rate Control) is reprogrammed to the setting whose refresh rate is
+// closest to a multiple of the detected source frame rate, so that the tearing band of the unsynchronized panel scan creeps over
+// the screen slowly instead of beating across it. New frames then start to go out at the same phase of the source frame cadence
+// each time, by holding back updates that are ready early in the cadence to the phase that the latest recent updates went out at.
+// #define PANEL_REFRESH_MATCHING
+
+// Lowest panel refresh rate to pick, in Hz.
+#define PANEL_REFRESH_MIN_HZ 50
+
+// Number of new frames in a row that the source frame rate estimate has to stay within 3% of the same value before the panel is
+// reprogrammed for it.
+#define PANEL_REFRESH_SETTLE_FRAMES 30
+
+// Longest that an update is held back to line it up with the phase of the source frame cadence, in usecs.
+#define PANEL_REFRESH_MAX_ALIGN_USECS 4000
+
+// If defined, a governor thread watches the SoC temperature, core clock and firmware throttling status. The SPI bus cost model is
+// rescaled right away when the core clock changes, and when the SoC gets hot or throttled, updates drop to interlacing at a smaller
+// workload and the GPU is polled at a lower rate, until the SoC has stayed cool for GOVERNOR_RESTORE_DELAY usecs.
+// #define PERFORMANCE_GOVERNOR
+
+// Temperature in degrees Celsius at which the governor switches to the cheaper modes. The firmware starts throttling at 80C.
+#define GOVERNOR_HOT_TEMPERATURE 75
+
+// How many degrees below GOVERNOR_HOT_TEMPERATURE the SoC has to cool down to before full quality is restored.
+#define GOVERNOR_HYSTERESIS 5
+
+// How long the SoC has to stay cool and unthrottled before full quality is restored, in usecs.
+#define GOVERNOR_RESTORE_DELAY 5000000
+
+// How often the governor samples the SoC sensors, in usecs. Each sample spawns vcgencmd, which takes a few msecs.
+#define GOVERNOR_POLL_INTERVAL 500000
+
+// Maximum number of GPU snapshots per second while the governor is constraining the pipeline.
+#define GOVERNOR_CONSTRAINED_POLL_RATE 30
+
+// While the governor is constraining the pipeline, updates are interlaced once they would take more than this fraction of the time
+// budget that applies otherwise.
+#define GOVERNOR_CONSTRAINED_INTERLACE_BUDGET 0.5
+
+// If defined, each new frame that the GPU polling thread captures is recorded, along with its capture time, to this file as a
+// compressed frame trace (see trace.h). Traces can be replayed offline as the frame source of the simulator (FBCP_SIM_TRACE=<file>)
+// to reproduce performance problems. Only the tiles that changed are stored, so a typical recording takes a few MB per minute.
+// #define FRAME_TRACE_FILE "/tmp/fbcp-ili9341.trace"
+
+// Every this many frames, the frame trace recorder stores a full frame instead of only the changed tiles, so that replay can seek
+// to any point in the trace by decoding at most this many frames.
+#define FRAME_TRACE_KEYFRAME_INTERVAL 120
+
+// Diagnostic messages are formatted and written out by a low priority logger thread (see log.h). Each thread that logs gets a ring
+// of this many records, and messages that do not fit are dropped and counted instead of blocking the thread.
+#define LOG_RING_SIZE 128
+
+// Maximum number of threads that can log. Messages from threads beyond this are dropped and counted.
+#define LOG_MAX_THREADS 16
+
+// How often the logger thread wakes up to write out the logged messages, in usecs.
+#define LOG_FLUSH_INTERVAL_USECS 100000
+
+// If defined, log messages are also appended to this file, with timestamps.
+// #define LOG_FILE "/var/log/fbcp-ili9341.log"
+
+#ifdef SIMULATOR
+#define PRESENTATION_FEEDBACK // The simulator traces displayed frames through the presentation events
+#endif
+
+// Parameters of the pipeline simulator, which is built with cmake -DSIMULATOR=ON (see sim.h). The values in parentheses are
+// environment variables that override these at run time.
+#define SIM_DURATION_USECS 10000000 // How much virtual time to simulate (FBCP_SIM_DURATION)
+#define SIM_SOURCE_FPS 60 // Frame rate of the simulated source (FBCP_SIM_FPS)
+#define SIM_SOURCE_JITTER_USECS 2000 // Maximum deviation of each source frame from the frame rate cadence (FBCP_SIM_JITTER)
+#define SIM_SOURCE_RECT_SIZE 96 // Width and height of the moving square that changes on each source frame (FBCP_SIM_RECT)
+#define SIM_SOURCE_DITHER 0 // If nonzero, the background is a temporally dithered gradient toggling by this much in 5-bit units (FBCP_SIM_DITHER)
+#define SIM_SOURCE_FADE 0 // If nonzero, the whole source frame fades to black and back over every this many frames, on a gradient background (FBCP_SIM_FADE)
+#define SIM_SOURCE_PATTERN 0 // Adversarial background for benchmarking the planner: 0 = none, 1 = noise that changes every pixel on every frame, 2 = single pixel dots that blink on and off, too far apart to merge (FBCP_SIM_PATTERN)
+#define SIM_SPI_CORE_CLOCK_MHZ 400 // Core clock that the SPI bus is driven from, lower this to simulate a throttled SoC (FBCP_SIM_CORE_CLOCK)
+#define SIM_SEED 1 // Seed for the source frame jitter (FBCP_SIM_SEED)
+#define SIM_SNAPSHOT_USECS 1000 // How long a vc_dispmanx_snapshot() of the GPU framebuffer takes
+#define SIM_VSYNC_HZ 60 // Rate of the simulated vsync callback with USE_GPU_VSYNC, 0 for no vsync callbacks (FBCP_SIM_VSYNC)
+#define SIM_SOURCE_PHASE_USECS 0 // How long after each vsync the source frames arrive, before jitter (FBCP_SIM_PHASE)
+#define SIM_TOUCH_TAPS_PER_SEC 2 // With TOUCH_CONTROLLER_STMPE610, how many times per second a simulated finger taps the touch screen (FBCP_SIM_TOUCH)
+#define SIM_SPI_TASK_OVERHEAD_BYTES 2 // Bus time lost to FIFO flushes around the command byte of each task, in bytes
+
 // If defined, rotates the display 180 degrees
 // #define DISPLAY_ROTATE_180_DEGREES
 
@@ -72,4 +306,55 @@
 // self-contained userland program.
 // #define KERNEL_MODULE_CLIENT
 
+// If defined, display window and cursor commands and small pixel spans of an update are packed together into compound command
+// list tasks in the SPI task queue, instead of each taking a task of its own. Fragmented updates then spend less time in task queue
+// bookkeeping on both the main thread and the SPI thread. Not available with KERNEL_MODULE_CLIENT, since the kernel module runs
+// each task as a single command.
+// #define SPI_COMMAND_LISTS
+
+// Pixel spans of at most this many bytes are packed into command lists, larger spans still get a task of their own.
+#define SPI_COMMAND_LIST_MAX_SPAN_BYTES 128
+
+// Capacity of a single command list task in bytes.
+#define SPI_COMMAND_LIST_SIZE 2048
+
+// If defined, the pixels of larger spans are not copied into the SPI task queue. Instead the task carries a descriptor of the
+// rectangle of pixels to send, and the SPI thread reads them straight from the captured frame, swapping them to big endian on the
+// fly. Captured frames are kept in a pool of buffers that are not written to again until the SPI thread has retired every task
+// that refers to them, so the task queue shrinks to a fraction of a frame, and the main thread no longer copies the pixels of each
+// update a second time. Not available with KERNEL_MODULE_CLIENT, since the kernel module cannot see the frame buffers.
+// #define SPI_PIXEL_DESCRIPTORS
+
+// Pixel spans of at least this many bytes are sent by descriptor, smaller ones are cheaper to copy than to describe.
+#define SPI_PIXEL_DESCRIPTOR_MIN_BYTES 64
+
+// Number of frame buffers in the pool. Up to two frames can be in the task queue while the next one is being captured, so at
+// least three are needed to not stall the capture.
+#define SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS 3
+
+// If defined, the SPI bus is fed by the DMA controller instead of by the SPI thread writing each byte to the FIFO. The SPI thread
+// then only copies new tasks to uncached memory allocated through the VideoCore mailbox, builds DMA control blocks that write them
+// to the SPI FIFO and toggle the D/C line, and splices those to the running chain, sleeping in between. Not available with
+// KERNEL_MODULE_CLIENT or TOUCH_CONTROLLER_STMPE610.
+// #define USE_DMA_TRANSFERS
+
+// DMA channels to use. Check that these are not in use by other drivers, e.g. with "cat /sys/class/dma/dma0chan*/in_use". The
+// TX channel only writes to the SPI FIFO and may be a lite channel, the sequencer channel runs the chain of transfers.
+#define DMA_TX_CHANNEL 7
+#define DMA_SEQUENCER_CHANNEL 1
+
+// Number of DMA control blocks, and bytes of task data that can be handed over to the DMA controller at a time. Each transfer of a
+// display command takes up to five control blocks of 32 bytes.
+#define DMA_CONTROL_BLOCKS 8192
+#define DMA_DATA_BUFFER_SIZE (256*1024)
+#define DMA_MAX_TASKS_IN_FLIGHT 4096
+
+// The longest time that the SPI thread sleeps for while the DMA controller is busy, in usecs. New tasks that come in meanwhile are
+// only appended to the chain when it wakes up, so longer sleeps save CPU time at the cost of idling the bus in between updates.
+#define DMA_MAX_SLEEP_USECS 1000
+
+// The shortest time that the SPI thread sleeps for while the DMA controller is busy, in usecs. Sleeps shorter than this tend to
+// overshoot badly due to scheduler latency anyway.
+#define DMA_MIN_SLEEP_USECS 100
+
 #endif
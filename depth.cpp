@@ -0,0 +1,131 @@
+#include <memory.h>
+
+#include "config.h"
+#include "depth.h"
+#include "display.h"
+#include "log.h"
+#include "spi.h"
+#include "util.h"
+
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+
+#ifndef DISPLAY_PIXEL_FORMAT_12BPP
+#error REDUCED_DEPTH_ON_OVERLOAD needs a display controller that takes 12-bit pixels over SPI (DISPLAY_PIXEL_FORMAT_12BPP)!
+#endif
+
+bool reducedDepthActive = false;
+static int overloadedFrames = 0; // New frames in a row whose update would not have fit in the budget at 16 bits per pixel
+static int relievedFrames = 0; // New frames in a row whose update would have fit comfortably in the budget at 16 bits per pixel
+static bool depthSwitchedOnThisFrame = false;
+
+void RecordReducedDepthLoad(double progressiveUsecs, double budgetUsecs)
+{
+  // The frame that switched back to 16 bits resends most of the screen to restore it to full quality, and does not tell about the
+  // load of the content
+  if (depthSwitchedOnThisFrame)
+  {
+    depthSwitchedOnThisFrame = false;
+    return;
+  }
+  // At 12 bits, estimate the cost at 16 bits by scaling all of it up as if it was pixel data, which errs on the side of staying
+  double usecsAt16Bpp = reducedDepthActive ? progressiveUsecs * 4 / 3 : progressiveUsecs;
+  overloadedFrames = (usecsAt16Bpp > budgetUsecs) ? overloadedFrames + 1 : 0;
+  relievedFrames = (usecsAt16Bpp < budgetUsecs * REDUCED_DEPTH_EXIT_LOAD) ? relievedFrames + 1 : 0;
+}
+
+bool SwitchReducedDepth()
+{
+  if (!reducedDepthActive && overloadedFrames >= REDUCED_DEPTH_ENTER_FRAMES)
+  {
+    LogMessage(LOG_INFO, "SPI bus saturated for %d frames, switching to 12 bits per pixel", overloadedFrames);
+    reducedDepthActive = true;
+  }
+  else if (reducedDepthActive && relievedFrames >= REDUCED_DEPTH_EXIT_FRAMES)
+  {
+    LogMessage(LOG_INFO, "SPI bus load dropped for %d frames, switching back to 16 bits per pixel", relievedFrames);
+    reducedDepthActive = false;
+  }
+  else return false;
+  overloadedFrames = relievedFrames = 0;
+  depthSwitchedOnThisFrame = true;
+  return true;
+}
+
+int QueuePixelFormat()
+{
+  char format = reducedDepthActive ? DISPLAY_PIXEL_FORMAT_12BPP : DISPLAY_PIXEL_FORMAT_16BPP;
+  QUEUE_SPI_TRANSFER(DISPLAY_SET_PIXEL_FORMAT, format);
+  return 2;
+}
+
+// Keeps the top 4 bits of each channel of four RGB565 pixels at a time, and fills in the low bits by replicating the high bits,
+// the same way that the display expands the 4-bit channels.
+static inline uint64_t QuantizeRGB444x4(uint64_t p)
+{
+  p &= 0xF79EF79EF79EF79Eull;
+  return p | ((p >> 4) & 0x0861086108610861ull);
+}
+
+void QuantizeRGB444(uint16_t *frame, const uint16_t *damageMinX, const uint16_t *damageEndX)
+{
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    uint16_t *p = frame + y*DISPLAY_WIDTH + damageMinX[y], *end = frame + y*DISPLAY_WIDTH + damageEndX[y];
+    for(; p + 4 <= end; p += 4)
+    {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      v = QuantizeRGB444x4(v);
+      memcpy(p, &v, 8);
+    }
+    for(; p < end; ++p) *p = (uint16_t)QuantizeRGB444x4(*p);
+  }
+}
+
+// The 12-bit RGB444 value of a RGB565 pixel, in the low 12 bits.
+static inline uint32_t RGB444(uint16_t p)
+{
+  return ((p >> 4) & 0xF00) | ((p >> 3) & 0xF0) | ((p >> 1) & 0xF);
+}
+
+static inline uint8_t *PutRGB444Pair(uint8_t *dst, uint32_t a, uint32_t b)
+{
+  dst[0] = (uint8_t)(a >> 4);
+  dst[1] = (uint8_t)((a << 4) | (b >> 8));
+  dst[2] = (uint8_t)b;
+  return dst + 3;
+}
+
+uint8_t *PackRGB444(uint8_t *dst, const uint16_t *src, int pixels, int &carry)
+{
+  const uint16_t *end = src + pixels;
+  if (carry >= 0 && src < end)
+  {
+    dst = PutRGB444Pair(dst, carry, RGB444(*src++));
+    carry = -1;
+  }
+
+  // Convert four pixels at a time to 12 bits in each 16-bit lane of a 64-bit word, and pack them into two 24-bit big endian pairs
+  for(; src + 4 <= end; src += 4, dst += 6)
+  {
+    uint64_t v;
+    memcpy(&v, src, 8);
+    v = ((v >> 4) & 0x0F000F000F000F00ull) | ((v >> 3) & 0x00F000F000F000F0ull) | ((v >> 1) & 0x000F000F000F000Full);
+    uint64_t pairs = ((v & 0xFFF) << 36) | (((v >> 16) & 0xFFF) << 24) | (((v >> 32) & 0xFFF) << 12) | (v >> 48);
+    pairs = __builtin_bswap64(pairs << 16); // The six bytes of the pairs, in bus order
+    memcpy(dst, &pairs, 6);
+  }
+  for(; src + 2 <= end; src += 2) dst = PutRGB444Pair(dst, RGB444(src[0]), RGB444(src[1]));
+  if (src < end) carry = RGB444(*src);
+  return dst;
+}
+
+uint8_t *FlushRGB444(uint8_t *dst, int carry)
+{
+  if (carry < 0) return dst;
+  dst[0] = (uint8_t)(carry >> 4);
+  dst[1] = (uint8_t)(carry << 4); // The controller drops the unfinished second pixel when the next command starts
+  return dst + 2;
+}
+
+#endif
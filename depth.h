@@ -0,0 +1,40 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+
+// When the SPI bus stays saturated, the display is switched to take 12-bit RGB444 pixels, packed two pixels in three bytes. While
+// in that mode, the damaged areas of each new frame are quantized to the colors that the display can show, so that the previous
+// frame buffer keeps holding what the display shows, and pixels that only change in the dropped low bits are not resent. When the
+// load drops, the display is switched back to 16 bits, and the whole frame is damaged, which resends every pixel that lost precision.
+
+// Number of bytes that the given number of pixels take up on the SPI bus at 12 bits per pixel. An odd last pixel is padded to a byte.
+#define RGB444_BYTES(pixels) (((pixels)*3+1)/2)
+
+extern bool reducedDepthActive; // True while pixels are sent as 12-bit RGB444
+
+// Called on the main thread after each new frame has been planned, with the modeled SPI bus time of sending its progressive update
+// at the current pixel depth (including the work already in the queue), and the frame time budget.
+void RecordReducedDepthLoad(double progressiveUsecs, double budgetUsecs);
+
+// Called on the main thread when a new frame comes in, before it is copied in. Switches the pixel depth if the recorded load asks
+// for it, and returns true if it did: the new pixel format must then be queued with QueuePixelFormat() before the pixels of the
+// frame, and when switching back to 16 bits, the whole frame must be damaged.
+bool SwitchReducedDepth(void);
+
+// Queues the command to set the pixel format of the display to the current depth. Returns the number of bytes queued.
+int QueuePixelFormat(void);
+
+// Rounds the damaged range of each scanline of the frame to the colors that the display shows for 12-bit pixels.
+void QuantizeRGB444(uint16_t *frame, const uint16_t *damageMinX, const uint16_t *damageEndX);
+
+// Packs the given RGB565 pixels as RGB444 to dst, and returns the end of the written data. The pixels of a span continue from one
+// scanline to the next, so an odd last pixel is held in carry (-1 if none) and paired with the first pixel of the next call. After
+// the last call for a span, FlushRGB444() writes out the pixel still held, if any.
+uint8_t *PackRGB444(uint8_t *dst, const uint16_t *src, int pixels, int &carry);
+uint8_t *FlushRGB444(uint8_t *dst, int carry);
+
+#endif
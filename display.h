@@ -12,3 +12,7 @@
 
 #define SCANLINE_SIZE (DISPLAY_WIDTH*DISPLAY_BYTESPERPIXEL)
 #define FRAMEBUFFER_SIZE (DISPLAY_WIDTH*DISPLAY_HEIGHT*DISPLAY_BYTESPERPIXEL)
+
+// Offset of the scaled source image inside the display, when the source aspect ratio does not match the display.
+extern int displayXOffset;
+extern int displayYOffset;
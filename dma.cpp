@@ -0,0 +1,588 @@
+#include "config.h"
+#include "dma.h"
+
+#ifdef USE_DMA_TRANSFERS
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <memory.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spi.h"
+#include "presentation.h"
+#include "statistics.h"
+#include "tick.h"
+#include "util.h"
+
+#define PERIPHERAL_BUS_ADDRESS(offset) (BCM2835_PERIPHERAL_BUS_BASE + (offset))
+#define DMA_CHANNEL_BUS_ADDRESS(channel) PERIPHERAL_BUS_ADDRESS(BCM2835_DMA_BASE + (channel)*0x100)
+#define SPI_FIFO_BUS_ADDRESS PERIPHERAL_BUS_ADDRESS(BCM2835_SPI0_BASE + 4)
+#define GPSET0_BUS_ADDRESS PERIPHERAL_BUS_ADDRESS(BCM2835_GPIO_BASE + 0x1C)
+#define GPCLR0_BUS_ADDRESS PERIPHERAL_BUS_ADDRESS(BCM2835_GPIO_BASE + 0x28)
+
+#define DMA_CHANNEL_CS_VALUE (BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END | BCM2835_DMA_CS_PRIORITY(8) | BCM2835_DMA_CS_PANIC_PRIORITY(8) | BCM2835_DMA_CS_WAIT_FOR_OUTSTANDING_WRITES)
+
+// Each SPI transfer takes at most a D/C line toggle, two register writes to start the TX channel, a RX drain, and the TX control
+// block itself
+#define DMA_CONTROL_BLOCKS_PER_TRANSFER 5
+
+// Words in uncached memory that the control blocks read from and write to
+typedef struct __attribute__((aligned(32))) DMAConstants
+{
+  uint32_t dcMask; // Bit of the D/C line in GPSET0/GPCLR0
+  uint32_t txChannelStart; // Value written to the CS register of the TX channel to start it
+  uint32_t rxSink; // Bytes drained from the RX FIFO are written here
+  volatile uint32_t progress; // Running number of the last task that the chain has finished
+} DMAConstants;
+
+typedef struct DMAMemory
+{
+  uint32_t handle; // VideoCore mailbox handle of the allocation
+  uint32_t busAddress;
+  uint8_t *virtualAddress;
+  uint32_t size;
+} DMAMemory;
+
+static DMAMemory dmaMemory;
+static DMAConstants *dmaConstants;
+static DMAControlBlock *controlBlocks; // Ring of DMA_CONTROL_BLOCKS control blocks
+static uint8_t *dmaData; // Ring of DMA_DATA_BUFFER_SIZE bytes for the copies of the task data
+static volatile DMAChannelRegisterFile *dmaTx = 0, *dmaSequencer = 0;
+
+#define BUS_ADDRESS(ptr) (dmaMemory.busAddress + (uint32_t)((uint8_t*)(ptr) - dmaMemory.virtualAddress))
+
+// Control block and data rings. The counters run freely, and are taken modulo the ring sizes.
+static uint32_t controlBlocksAllocated = 0, controlBlocksFreed = 0;
+static uint64_t dataAllocated = 0, dataFreed = 0;
+
+// A task that has been handed over to the DMA controller, but not yet retired from the task queue
+typedef struct DMATaskInFlight
+{
+  uint32_t sequence; // Running number that the chain writes to the progress word when the task is done
+  uint32_t controlBlocksEnd; // Value of controlBlocksAllocated after the task
+  uint64_t dataEnd; // Value of dataAllocated after the task
+  uint32_t busBytes;
+} DMATaskInFlight;
+
+static DMATaskInFlight tasksInFlight[DMA_MAX_TASKS_IN_FLIGHT];
+static uint32_t tasksInFlightHead = 0, numTasksInFlight = 0;
+static uint32_t busBytesInFlight = 0;
+static uint32_t lastQueuedSequence = 0, lastSplicedSequence = 0, lastRetiredSequence = 0;
+
+// The chain being built: control blocks that have been linked together, but not yet to the running chain
+static DMAControlBlock *batchFirst = 0, *batchLast = 0;
+static DMAControlBlock *chainLast = 0; // Last control block of the chain that has been handed to the DMA controller
+static int dcLineState = -1; // State of the D/C line at the end of the chain built so far, -1 if not known
+
+#ifdef SIMULATOR
+static void SimDMAKick(void);
+#endif
+
+static DMAControlBlock *AllocControlBlock()
+{
+  DMAControlBlock *cb = &controlBlocks[controlBlocksAllocated++ % DMA_CONTROL_BLOCKS];
+  cb->stride = 0;
+  cb->next = 0;
+  cb->value = cb->reserved = 0;
+  return cb;
+}
+
+// Allocates a control block, and links it to the end of the chain being built.
+static DMAControlBlock *NewControlBlock(uint32_t ti, uint32_t src, uint32_t dst, uint32_t len)
+{
+  DMAControlBlock *cb = AllocControlBlock();
+  cb->ti = ti;
+  cb->src = src;
+  cb->dst = dst;
+  cb->len = len;
+  if (batchLast) batchLast->next = BUS_ADDRESS(cb);
+  else batchFirst = cb;
+  batchLast = cb;
+  return cb;
+}
+
+// A control block that writes the given word to the given register or memory address.
+static DMAControlBlock *NewWriteWordControlBlock(uint32_t dst, uint32_t value)
+{
+  DMAControlBlock *cb = NewControlBlock(BCM2835_DMA_TI_WAIT_RESP, 0, dst, 4);
+  cb->value = value;
+  cb->src = BUS_ADDRESS(&cb->value);
+  return cb;
+}
+
+// Allocates contiguous bytes from the data ring, skipping over the end of the ring if they do not fit there.
+static uint8_t *AllocDMAData(uint32_t bytes)
+{
+  uint32_t pos = (uint32_t)(dataAllocated % DMA_DATA_BUFFER_SIZE);
+  if (pos + bytes > DMA_DATA_BUFFER_SIZE)
+  {
+    dataAllocated += DMA_DATA_BUFFER_SIZE - pos;
+    pos = 0;
+  }
+  dataAllocated += bytes;
+  return dmaData + pos;
+}
+
+// Queues a transfer of numBytes bytes, and returns where in the data ring the caller should write them to.
+static uint8_t *QueueTransferData(int dataLine, uint32_t numBytes)
+{
+  if (dcLineState != dataLine)
+  {
+    NewControlBlock(BCM2835_DMA_TI_WAIT_RESP, BUS_ADDRESS(&dmaConstants->dcMask), dataLine ? GPSET0_BUS_ADDRESS : GPCLR0_BUS_ADDRESS, 4);
+    dcLineState = dataLine;
+  }
+
+  // In DMA mode the first word written to the SPI FIFO sets DLEN and the low byte of CS, which starts the transfer
+  uint32_t paddedBytes = (numBytes + 3) & ~3u;
+  uint32_t *words = (uint32_t*)AllocDMAData(4 + paddedBytes);
+  words[0] = (numBytes << 16) | BCM2835_SPI0_CS_TA;
+
+  // The TX control block is run by the TX channel on its own, so it is not linked to the chain
+  DMAControlBlock *tx = AllocControlBlock();
+  tx->ti = BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_SPI_TX) | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+  tx->src = BUS_ADDRESS(words);
+  tx->dst = SPI_FIFO_BUS_ADDRESS;
+  tx->len = 4 + paddedBytes;
+
+  NewWriteWordControlBlock(DMA_CHANNEL_BUS_ADDRESS(DMA_TX_CHANNEL) + offsetof(DMAChannelRegisterFile, conblk_ad), BUS_ADDRESS(tx));
+  NewControlBlock(BCM2835_DMA_TI_WAIT_RESP, BUS_ADDRESS(&dmaConstants->txChannelStart), DMA_CHANNEL_BUS_ADDRESS(DMA_TX_CHANNEL) + offsetof(DMAChannelRegisterFile, cs), 4);
+  // Paced by the RX DREQ, so the chain only moves on once every byte has been clocked out on the bus
+  NewControlBlock(BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_SPI_RX) | BCM2835_DMA_TI_WAIT_RESP, SPI_FIFO_BUS_ADDRESS, BUS_ADDRESS(&dmaConstants->rxSink), paddedBytes);
+  return (uint8_t*)(words + 1);
+}
+
+static void QueueTransfer(int dataLine, const uint8_t *bytes, uint32_t numBytes)
+{
+  memcpy(QueueTransferData(dataLine, numBytes), bytes, numBytes);
+}
+
+static void QueueCommand(uint8_t cmd, const uint8_t *data, uint32_t size)
+{
+  QueueTransfer(0, &cmd, 1);
+  for(uint32_t i = 0; i < size; i += DMA_MAX_TRANSFER_BYTES)
+    QueueTransfer(1, data + i, MIN(size - i, DMA_MAX_TRANSFER_BYTES));
+}
+
+#ifdef SPI_PIXEL_DESCRIPTORS
+// Gathers the pixels of the described rectangle straight from the frame buffer into the data ring, byte swapping them on the way.
+static void QueuePixelDescriptorCommand(const SPIPixelDescriptor *d)
+{
+  uint32_t size = SPIPixelDescriptorBytes(d);
+  QueueTransfer(0, &d->cmd, 1);
+  for(uint32_t i = 0; i < size; i += DMA_MAX_TRANSFER_BYTES)
+  {
+    uint32_t n = MIN(size - i, DMA_MAX_TRANSFER_BYTES);
+    CopyPixelDescriptorBytes(d, i, n, QueueTransferData(1, n));
+  }
+}
+#endif
+
+static uint32_t NumTransfers(uint32_t size)
+{
+  return 1 + (size + DMA_MAX_TRANSFER_BYTES - 1) / DMA_MAX_TRANSFER_BYTES;
+}
+
+// Returns true if there is room in the control block and data rings for the chain of the given task.
+static bool HasRoomForTask(const SPITask *task)
+{
+  uint32_t transfers, dataBytes;
+#ifdef SPI_COMMAND_LISTS
+  if (task->cmd == SPI_COMMAND_LIST)
+  {
+    const SPICommandListHeader *header = (const SPICommandListHeader*)task->data;
+    transfers = 0;
+    dataBytes = 0;
+    const uint8_t *command = task->data + sizeof(SPICommandListHeader);
+    for(uint32_t i = 0; i < header->numCommands; ++i)
+    {
+      uint32_t size = command[1] | (command[2] << 8);
+      transfers += NumTransfers(size);
+      dataBytes += size;
+      command += SPI_COMMAND_LIST_COMMAND_HEADER_SIZE + size;
+    }
+  }
+  else
+#endif
+#ifdef SPI_PIXEL_DESCRIPTORS
+  if (task->cmd == SPI_PIXEL_DESCRIPTOR)
+  {
+    dataBytes = SPIPixelDescriptorBytes((const SPIPixelDescriptor*)task->data);
+    transfers = NumTransfers(dataBytes);
+  }
+  else
+#endif
+  {
+    transfers = NumTransfers(task->size);
+    dataBytes = task->size;
+  }
+  uint32_t controlBlocksNeeded = transfers * DMA_CONTROL_BLOCKS_PER_TRANSFER + 1;
+  uint64_t dataNeeded = dataBytes + transfers * 8 + DMA_MAX_TRANSFER_BYTES + 4; // Headers, padding, and the worst case skip at the end of the ring
+  if (controlBlocksNeeded > DMA_CONTROL_BLOCKS || dataNeeded > DMA_DATA_BUFFER_SIZE) FATAL_ERROR("SPI task is too large for the DMA rings, increase DMA_CONTROL_BLOCKS and DMA_DATA_BUFFER_SIZE!");
+  return numTasksInFlight < DMA_MAX_TASKS_IN_FLIGHT
+    && controlBlocksAllocated - controlBlocksFreed + controlBlocksNeeded <= DMA_CONTROL_BLOCKS
+    && dataAllocated - dataFreed + dataNeeded <= DMA_DATA_BUFFER_SIZE;
+}
+
+static void QueueTask(const SPITask *task)
+{
+#ifdef SPI_COMMAND_LISTS
+  if (task->cmd == SPI_COMMAND_LIST)
+  {
+    const SPICommandListHeader *header = (const SPICommandListHeader*)task->data;
+    const uint8_t *command = task->data + sizeof(SPICommandListHeader);
+    for(uint32_t i = 0; i < header->numCommands; ++i)
+    {
+      uint32_t size = command[1] | (command[2] << 8);
+      QueueCommand(command[0], command + SPI_COMMAND_LIST_COMMAND_HEADER_SIZE, size);
+      command += SPI_COMMAND_LIST_COMMAND_HEADER_SIZE + size;
+    }
+  }
+  else
+#endif
+#ifdef SPI_PIXEL_DESCRIPTORS
+  if (task->cmd == SPI_PIXEL_DESCRIPTOR) QueuePixelDescriptorCommand((const SPIPixelDescriptor*)task->data);
+  else
+#endif
+  QueueCommand(task->cmd, task->data, task->size);
+
+  NewWriteWordControlBlock(BUS_ADDRESS(&dmaConstants->progress), ++lastQueuedSequence);
+
+  DMATaskInFlight *t = &tasksInFlight[(tasksInFlightHead + numTasksInFlight++) % DMA_MAX_TASKS_IN_FLIGHT];
+  t->sequence = lastQueuedSequence;
+  t->controlBlocksEnd = controlBlocksAllocated;
+  t->dataEnd = dataAllocated;
+  t->busBytes = SPITaskBusBytes(task);
+  busBytesInFlight += t->busBytes;
+}
+
+static void StartSequencer(DMAControlBlock *first)
+{
+  dmaSequencer->conblk_ad = BUS_ADDRESS(first);
+  dmaSequencer->cs = DMA_CHANNEL_CS_VALUE;
+#ifdef SIMULATOR
+  SimDMAKick();
+#endif
+}
+
+// Hands the chain built since the previous call over to the DMA controller, by linking it to the end of the running chain, or by
+// starting the sequencer channel on it if the running chain has already stopped.
+static void SpliceChain()
+{
+  if (!batchFirst) return;
+  __sync_synchronize(); // The control blocks and data must have reached memory before the DMA controller can see them
+
+  if (lastRetiredSequence == lastSplicedSequence)
+  {
+    // Everything handed over before has been retired, so the control blocks of the old chain may have been reused already. The
+    // sequencer may still be finishing up the final progress write though.
+    while(dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE) SIM_YIELD();
+    StartSequencer(batchFirst);
+  }
+  else
+  {
+    chainLast->next = BUS_ADDRESS(batchFirst);
+    __sync_synchronize();
+    // The DMA controller loads the next pointer of a control block when it fetches it, so if the last control block of the old
+    // chain was fetched before the link above, the sequencer stops after it. Wait for that, and then restart it on the new chain.
+    if ((dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE) && dmaSequencer->conblk_ad == BUS_ADDRESS(chainLast) && dmaSequencer->nextconbk == 0)
+      while(dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE) SIM_YIELD();
+    if (!(dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE) && dmaConstants->progress == lastSplicedSequence)
+      StartSequencer(batchFirst);
+  }
+
+  chainLast = batchLast;
+  lastSplicedSequence = lastQueuedSequence;
+  batchFirst = batchLast = 0;
+}
+
+// Frees the tasks that the DMA controller has finished from the task queue and from the DMA rings.
+static void RetireFinishedTasks()
+{
+  uint32_t progress = dmaConstants->progress;
+  bool retired = false;
+  while(numTasksInFlight > 0 && (int32_t)(progress - tasksInFlight[tasksInFlightHead].sequence) >= 0)
+  {
+    DMATaskInFlight *t = &tasksInFlight[tasksInFlightHead];
+    DoneTask(GetTask());
+    controlBlocksFreed = t->controlBlocksEnd;
+    dataFreed = t->dataEnd;
+    lastRetiredSequence = t->sequence;
+    busBytesInFlight -= t->busBytes;
+    tasksInFlightHead = (tasksInFlightHead + 1) % DMA_MAX_TASKS_IN_FLIGHT;
+    --numTasksInFlight;
+    retired = true;
+  }
+#ifdef PRESENTATION_FEEDBACK
+  if (retired) PublishPresentedFrames();
+#else
+  (void)retired;
+#endif
+}
+
+// Returns the task at the given offset of the task queue, following the wrap marker, or 0 if the queue has no more tasks.
+static SPITask *PeekTask(uint32_t *offset)
+{
+  uint32_t tail = spiTaskMemory->queueTail;
+  if (*offset == tail) return 0;
+  SPITask *task = (SPITask*)(spiTaskMemory->buffer + *offset);
+  if (task->cmd == 0) // Wrapped around?
+  {
+    *offset = 0;
+    if (tail == 0) return 0;
+    task = (SPITask*)spiTaskMemory->buffer;
+  }
+  return task;
+}
+
+void *dma_spi_thread(void *unused)
+{
+  RegisterStatisticsThread("spi");
+  uint32_t queued = spiTaskMemory->queueHead; // Offset of the first task in the task queue that has not been handed over yet
+  while(!spiThreadQuit)
+  {
+    RetireFinishedTasks();
+
+    SPITask *task;
+    uint32_t offset = queued;
+    while((task = PeekTask(&offset)) && HasRoomForTask(task))
+    {
+      __sync_synchronize();
+      QueueTask(task);
+      offset += sizeof(SPITask) + task->size;
+      queued = offset;
+    }
+    SpliceChain();
+
+    uint32_t tail = spiTaskMemory->queueTail;
+    if (numTasksInFlight == 0)
+    {
+      if (queued != tail) continue;
+#ifdef STATISTICS
+      uint64_t t0 = tick();
+      spiThreadSleepStartTime = t0;
+      __atomic_store_n(&spiThreadSleeping, 1, __ATOMIC_RELAXED);
+#endif
+      syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, tail, 0, 0, 0); // Start sleeping until we get new tasks
+#ifdef STATISTICS
+      __atomic_store_n(&spiThreadSleeping, 0, __ATOMIC_RELAXED);
+      __sync_fetch_and_add(&spiThreadIdleUsecs, tick()-t0);
+#endif
+    }
+    else
+    {
+      // Sleep until the DMA controller should have sent out what it has been given, or until new tasks come in. New tasks only wake
+      // this thread up when the task queue was empty, so the sleep is capped to not let the bus run dry for long after the chain.
+      uint64_t usecs = (uint64_t)(busBytesInFlight * spiUsecsPerByte + numTasksInFlight * spiUsecsPerTask);
+      usecs = MIN((uint64_t)DMA_MAX_SLEEP_USECS, MAX((uint64_t)DMA_MIN_SLEEP_USECS, usecs));
+      struct timespec timeout = { (time_t)(usecs / 1000000), (long)(usecs % 1000000) * 1000 };
+      syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, tail, &timeout, 0, 0);
+    }
+  }
+  while(numTasksInFlight > 0)
+  {
+    usleep(DMA_MIN_SLEEP_USECS);
+    RetireFinishedTasks();
+  }
+  __atomic_store_n(&spiThreadExited, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+#ifdef SIMULATOR
+
+// A model of the two DMA channels and of the SPI and GPIO registers as the DMA controller sees them, run on a simulated thread of
+// its own. It runs the control blocks as the hardware would, and fails on anything that the hardware would not run as intended.
+
+static volatile int simDMAKicks = 0;
+static int simDCLine = -1;
+
+static void SimDMAKick()
+{
+  __atomic_fetch_add(&simDMAKicks, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &simDMAKicks, FUTEX_WAKE, 1, 0, 0, 0);
+}
+
+static void *SimBusToVirtual(uint32_t busAddress, uint32_t bytes)
+{
+  if (busAddress < dmaMemory.busAddress || busAddress + bytes > dmaMemory.busAddress + dmaMemory.size) return 0;
+  return dmaMemory.virtualAddress + (busAddress - dmaMemory.busAddress);
+}
+
+static const DMAControlBlock *SimFetchControlBlock(uint32_t busAddress)
+{
+  if (busAddress % 32) FATAL_ERROR("Simulated DMA: control block is not 32 byte aligned!");
+  const DMAControlBlock *cb = (const DMAControlBlock*)SimBusToVirtual(busAddress, sizeof(DMAControlBlock));
+  if (!cb) FATAL_ERROR("Simulated DMA: control block is outside of DMA memory!");
+  return cb;
+}
+
+static uint32_t SimReadWord(uint32_t busAddress)
+{
+  const uint32_t *word = (const uint32_t*)SimBusToVirtual(busAddress, 4);
+  if (!word) FATAL_ERROR("Simulated DMA: read from outside of DMA memory!");
+  return *word;
+}
+
+// Runs the TX channel on the transfer it was started on, as paced by the RX drain of the given length.
+static void SimRunSPITransfer(uint32_t rxBytes)
+{
+  if (!(dmaTx->cs & BCM2835_DMA_CS_ACTIVE)) FATAL_ERROR("Simulated DMA: RX FIFO drained with no transfer running!");
+  const DMAControlBlock *tx = SimFetchControlBlock(dmaTx->conblk_ad);
+  if (tx->dst != SPI_FIFO_BUS_ADDRESS || !(tx->ti & BCM2835_DMA_TI_DEST_DREQ) || !(tx->ti & BCM2835_DMA_TI_SRC_INC) || (tx->ti & BCM2835_DMA_TI_PERMAP(0x1F)) != BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_SPI_TX))
+    FATAL_ERROR("Simulated DMA: TX channel control block does not write to the SPI FIFO!");
+  if (tx->next != 0) FATAL_ERROR("Simulated DMA: TX channel control block does not stop after the transfer!");
+  uint32_t header = SimReadWord(tx->src);
+  uint32_t dlen = header >> 16;
+  if (!(header & BCM2835_SPI0_CS_TA) || dlen == 0) FATAL_ERROR("Simulated DMA: transfer does not start with a DLEN/CS header word!");
+  if (tx->len != 4 + ((dlen + 3) & ~3u) || rxBytes != ((dlen + 3) & ~3u)) FATAL_ERROR("Simulated DMA: TX or RX length does not match DLEN!");
+  if (!SimBusToVirtual(tx->src, tx->len)) FATAL_ERROR("Simulated DMA: transfer data is outside of DMA memory!");
+  if (simDCLine < 0 || (simDCLine == 0 && dlen != 1)) FATAL_ERROR("Simulated DMA: transfer sent with the D/C line in the wrong state!");
+  SimSPITransfer(dlen);
+  dmaTx->cs &= ~BCM2835_DMA_CS_ACTIVE;
+  dmaTx->conblk_ad = 0;
+}
+
+// Runs the control block that the sequencer channel is on, and moves the channel on to the next one.
+static void SimRunControlBlock()
+{
+  const DMAControlBlock *cb = SimFetchControlBlock(dmaSequencer->conblk_ad);
+  DMAControlBlock c = *cb;
+  dmaSequencer->nextconbk = c.next;
+  if (!c.next) SimUsleep(1); // Leave a window between fetching the last control block and stopping, for a splice to miss it
+
+  const uint32_t txRegisters = DMA_CHANNEL_BUS_ADDRESS(DMA_TX_CHANNEL);
+  if (c.ti & BCM2835_DMA_TI_SRC_DREQ)
+  {
+    if (c.src != SPI_FIFO_BUS_ADDRESS || (c.ti & BCM2835_DMA_TI_PERMAP(0x1F)) != BCM2835_DMA_TI_PERMAP(BCM2835_DMA_PERMAP_SPI_RX))
+      FATAL_ERROR("Simulated DMA: DREQ paced read is not from the SPI RX FIFO!");
+    SimRunSPITransfer(c.len);
+  }
+  else if (c.dst == txRegisters + offsetof(DMAChannelRegisterFile, conblk_ad))
+  {
+    if (dmaTx->cs & BCM2835_DMA_CS_ACTIVE) FATAL_ERROR("Simulated DMA: TX channel control block changed while it is running!");
+    dmaTx->conblk_ad = SimReadWord(c.src);
+  }
+  else if (c.dst == txRegisters + offsetof(DMAChannelRegisterFile, cs))
+  {
+    dmaTx->cs = SimReadWord(c.src);
+    if (!(dmaTx->cs & BCM2835_DMA_CS_ACTIVE)) FATAL_ERROR("Simulated DMA: TX channel was not started!");
+  }
+  else if (c.dst == GPSET0_BUS_ADDRESS || c.dst == GPCLR0_BUS_ADDRESS)
+  {
+    if (SimReadWord(c.src) != 1u << GPIO_TFT_DATA_CONTROL) FATAL_ERROR("Simulated DMA: GPIO write touches other pins than D/C!");
+    simDCLine = (c.dst == GPSET0_BUS_ADDRESS);
+  }
+  else
+  {
+    void *dst = SimBusToVirtual(c.dst, c.len);
+    const void *src = SimBusToVirtual(c.src, c.len);
+    if (!dst || !src) FATAL_ERROR("Simulated DMA: control block accesses an unknown address!");
+    memcpy(dst, src, c.len);
+  }
+
+  dmaSequencer->conblk_ad = c.next;
+  if (!c.next) dmaSequencer->cs &= ~BCM2835_DMA_CS_ACTIVE;
+}
+
+static void *sim_dma_thread(void *unused)
+{
+  for(;;)
+  {
+    int kicks = simDMAKicks;
+    if (dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE) SimRunControlBlock();
+    else syscall(SYS_futex, &simDMAKicks, FUTEX_WAIT, kicks, 0, 0, 0);
+  }
+  return 0;
+}
+
+#else
+
+// VideoCore mailbox property interface, see https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+#define MAILBOX_IOCTL _IOWR(100, 0, char *)
+#define MAILBOX_TAG_ALLOCATE_MEMORY 0x3000C
+#define MAILBOX_TAG_LOCK_MEMORY 0x3000D
+#define MAILBOX_TAG_UNLOCK_MEMORY 0x3000E
+#define MAILBOX_TAG_RELEASE_MEMORY 0x3000F
+#define MAILBOX_MEM_FLAG_L1_NONALLOCATING 0xC // Uncached, so that the DMA controller and the CPU see the same memory contents
+
+static uint32_t MailboxProperty(uint32_t tag, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+  int fd = open("/dev/vcio", 0);
+  if (fd < 0) FATAL_ERROR("Failed to open /dev/vcio for the VideoCore mailbox!");
+  uint32_t message[9] = { sizeof(message), 0/*process request*/, tag, 12/*value buffer size*/, 12/*request size*/, arg0, arg1, arg2, 0/*end tag*/ };
+  int rc = ioctl(fd, MAILBOX_IOCTL, message);
+  close(fd);
+  if (rc < 0 || message[1] != 0x80000000) FATAL_ERROR("VideoCore mailbox request failed!");
+  return message[5];
+}
+
+#endif
+
+void InitDMA()
+{
+  dmaMemory.size = sizeof(DMAConstants) + DMA_CONTROL_BLOCKS*sizeof(DMAControlBlock) + DMA_DATA_BUFFER_SIZE;
+  dmaMemory.size = (dmaMemory.size + 4095) & ~4095u;
+#ifdef SIMULATOR
+  if (posix_memalign((void**)&dmaMemory.virtualAddress, 4096, dmaMemory.size)) FATAL_ERROR("Failed to allocate DMA memory!");
+  dmaMemory.busAddress = 0xC0000000; // Any page aligned address will do, the simulated DMA controller translates it back
+  dmaTx = (volatile DMAChannelRegisterFile*)calloc(1, sizeof(DMAChannelRegisterFile));
+  dmaSequencer = (volatile DMAChannelRegisterFile*)calloc(1, sizeof(DMAChannelRegisterFile));
+#else
+  dmaMemory.handle = MailboxProperty(MAILBOX_TAG_ALLOCATE_MEMORY, dmaMemory.size, 4096, MAILBOX_MEM_FLAG_L1_NONALLOCATING);
+  if (!dmaMemory.handle) FATAL_ERROR("Failed to allocate DMA memory from the VideoCore!");
+  dmaMemory.busAddress = MailboxProperty(MAILBOX_TAG_LOCK_MEMORY, dmaMemory.handle, 0, 0);
+  int mem = open("/dev/mem", O_RDWR|O_SYNC);
+  if (mem < 0) FATAL_ERROR("can't open /dev/mem (run as sudo)");
+  void *virt = mmap(NULL, dmaMemory.size, PROT_READ|PROT_WRITE, MAP_SHARED, mem, dmaMemory.busAddress & ~0xC0000000);
+  close(mem);
+  if (virt == MAP_FAILED) FATAL_ERROR("Mapping DMA memory failed!");
+  dmaMemory.virtualAddress = (uint8_t*)virt;
+
+  // The DMA controller sits next to the GPIO and SPI register files that InitSPI() already mapped
+  uint8_t *peripherals = (uint8_t*)gpio - BCM2835_GPIO_BASE;
+  dmaTx = (volatile DMAChannelRegisterFile*)(peripherals + BCM2835_DMA_BASE + DMA_TX_CHANNEL*0x100);
+  dmaSequencer = (volatile DMAChannelRegisterFile*)(peripherals + BCM2835_DMA_BASE + DMA_SEQUENCER_CHANNEL*0x100);
+  volatile uint32_t *dmaEnable = (volatile uint32_t*)(peripherals + BCM2835_DMA_BASE + BCM2835_DMA_ENABLE);
+  *dmaEnable |= (1 << DMA_TX_CHANNEL) | (1 << DMA_SEQUENCER_CHANNEL);
+  dmaTx->cs = BCM2835_DMA_CS_RESET;
+  dmaSequencer->cs = BCM2835_DMA_CS_RESET;
+  usleep(100);
+#endif
+  memset(dmaMemory.virtualAddress, 0, dmaMemory.size);
+  dmaConstants = (DMAConstants*)dmaMemory.virtualAddress;
+  controlBlocks = (DMAControlBlock*)(dmaMemory.virtualAddress + sizeof(DMAConstants));
+  dmaData = (uint8_t*)(controlBlocks + DMA_CONTROL_BLOCKS);
+  dmaConstants->dcMask = 1 << GPIO_TFT_DATA_CONTROL;
+  dmaConstants->txChannelStart = DMA_CHANNEL_CS_VALUE;
+
+  // From here on the SPI FIFO is only accessed by the DMA controller
+  spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_CLEAR;
+
+#ifdef SIMULATOR
+  pthread_t thread;
+  pthread_create(&thread, NULL, sim_dma_thread, NULL);
+#endif
+}
+
+void DeinitDMA()
+{
+#ifndef SIMULATOR
+  dmaTx->cs = BCM2835_DMA_CS_RESET;
+  dmaSequencer->cs = BCM2835_DMA_CS_RESET;
+  spi->cs = BCM2835_SPI0_CS_CLEAR;
+  munmap(dmaMemory.virtualAddress, dmaMemory.size);
+  MailboxProperty(MAILBOX_TAG_UNLOCK_MEMORY, dmaMemory.handle, 0, 0);
+  MailboxProperty(MAILBOX_TAG_RELEASE_MEMORY, dmaMemory.handle, 0, 0);
+  dmaMemory.virtualAddress = 0;
+#endif
+}
+
+#endif
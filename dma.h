@@ -0,0 +1,82 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef USE_DMA_TRANSFERS
+
+#ifdef KERNEL_MODULE_CLIENT
+#error USE_DMA_TRANSFERS is not supported with KERNEL_MODULE_CLIENT, the kernel module feeds the SPI bus itself
+#endif
+#ifdef TOUCH_CONTROLLER_STMPE610
+#error USE_DMA_TRANSFERS is not supported with TOUCH_CONTROLLER_STMPE610, touch polls would need to pause the running DMA chain
+#endif
+
+// Feeding the SPI bus with DMA: the SPI thread copies each task from the task queue to uncached memory allocated through the
+// VideoCore mailbox, and builds a chain of DMA control blocks for it. Two DMA channels are used: the TX channel writes the bytes of
+// one transfer to the SPI FIFO and stops, and the sequencer channel runs the actual chain, which for each transfer sets the D/C
+// line, starts the TX channel on the transfer, and then drains the RX FIFO of as many bytes as the transfer sends. Since the RX side
+// sees the last byte only when it has been clocked out on the bus, the D/C line can be toggled for the next transfer right after.
+// At the end of each task, the chain writes the running number of the task to a progress word in memory, so that the SPI thread
+// knows which tasks are done. New chains are spliced to the end of the running one, so the CPU only wakes up to append new tasks
+// and to retire finished ones, instead of pushing every byte into the FIFO itself.
+
+#define BCM2835_DMA_BASE 0x7000 // Address to DMA channel 0 register file, channel N is at BCM2835_DMA_BASE + N*0x100
+#define BCM2835_DMA_ENABLE 0xFF0 // Offset of the global DMA channel enable register from BCM2835_DMA_BASE
+#define BCM2835_PERIPHERAL_BUS_BASE 0x7E000000 // Address of the peripherals as seen from the DMA controller
+
+#define BCM2835_DMA_CS_ACTIVE (1 << 0)
+#define BCM2835_DMA_CS_END (1 << 1)
+#define BCM2835_DMA_CS_INT (1 << 2)
+#define BCM2835_DMA_CS_ERROR (1 << 8)
+#define BCM2835_DMA_CS_PRIORITY(x) ((x) << 16)
+#define BCM2835_DMA_CS_PANIC_PRIORITY(x) ((x) << 20)
+#define BCM2835_DMA_CS_WAIT_FOR_OUTSTANDING_WRITES (1 << 28)
+#define BCM2835_DMA_CS_ABORT (1 << 30)
+#define BCM2835_DMA_CS_RESET (1u << 31)
+
+#define BCM2835_DMA_TI_WAIT_RESP (1 << 3)
+#define BCM2835_DMA_TI_DEST_INC (1 << 4)
+#define BCM2835_DMA_TI_DEST_DREQ (1 << 6)
+#define BCM2835_DMA_TI_SRC_INC (1 << 8)
+#define BCM2835_DMA_TI_SRC_DREQ (1 << 10)
+#define BCM2835_DMA_TI_PERMAP(x) ((x) << 16)
+#define BCM2835_DMA_TI_NO_WIDE_BURSTS (1 << 26)
+
+#define BCM2835_DMA_PERMAP_SPI_TX 6
+#define BCM2835_DMA_PERMAP_SPI_RX 7
+
+#define BCM2835_SPI0_CS_DMAEN 0x00000100 // DMA Enable: the FIFO is accessed 32 bits at a time, and the first write of each transfer sets DLEN and CS
+#define BCM2835_SPI0_CS_ADCS 0x00000800 // Automatically deassert chip select and end the transfer once DLEN bytes have been sent
+
+// Largest number of bytes in a single SPI transfer: DLEN is 16 bits, and the lite DMA channels (7-14) can move at most 65535 bytes
+// per control block, which includes the 4-byte DLEN/CS header word.
+#define DMA_MAX_TRANSFER_BYTES 65528
+
+typedef struct DMAChannelRegisterFile
+{
+  uint32_t cs; // Control and Status
+  uint32_t conblk_ad; // Bus address of the control block being run, or 0 when the channel is idle
+  uint32_t ti, source_ad, dest_ad, txfr_len, stride; // Read only copies of the fields of the current control block
+  uint32_t nextconbk; // Bus address of the next control block, loaded from the current one when it was fetched
+  uint32_t debug;
+} DMAChannelRegisterFile;
+
+// A control block must be 32 byte aligned. The two reserved words are not read by the DMA controller, the chain builder stores the
+// value that a control block writes out in them.
+typedef struct __attribute__((aligned(32))) DMAControlBlock
+{
+  uint32_t ti; // Transfer Information
+  uint32_t src, dst; // Bus addresses
+  uint32_t len; // Bytes
+  uint32_t stride;
+  uint32_t next; // Bus address of the next control block, or 0 to stop after this one
+  uint32_t value, reserved;
+} DMAControlBlock;
+
+void InitDMA(void);
+void DeinitDMA(void);
+void *dma_spi_thread(void *unused); // Replaces spi_thread() to feed the task queue to the DMA controller
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <memory.h>
+#include <math.h>
+
+#include "config.h"
+#include "fade.h"
+#include "display.h"
+#include "spi.h"
+#include "statistics.h"
+#include "util.h"
+
+#ifdef FADE_EMULATION
+
+#define FADE_SAMPLE_STEP 8 // Detection first looks at every 8th pixel of every 8th scanline, and only goes through the full frame if that looks like a fade
+#define FADE_MIN_STEP 8 // Levels this close to full brightness are not worth starting a fade for
+#define FADE_MIN_LUMA 16 // Pixels darker than this on the display are too quantized to tell the level from
+
+#ifdef STATISTICS
+#define FADE_FIRST_SCANLINE STATISTICS_OVERLAY_HEIGHT // The overlay is drawn over the frame afterwards, and does not take part in fades
+#else
+#define FADE_FIRST_SCANLINE 0
+#endif
+
+int fadeLevel = 255;
+
+bool FadeEmulationActive()
+{
+  return fadeLevel < 255;
+}
+
+// Brightness of a RGB565 pixel, with the channels weighted equally: 0-186
+static inline int Luma(uint16_t p)
+{
+  return ((p >> 11) << 1) + ((p >> 5) & 0x3F) + ((p & 0x1F) << 1);
+}
+
+// What the given pixel of the display memory looks like at the given brightness level.
+static inline uint16_t DimPixel(uint16_t p, int level)
+{
+  int r = ((p >> 11) * level + 127) / 255, g = (((p >> 5) & 0x3F) * level + 127) / 255, b = ((p & 0x1F) * level + 127) / 255;
+  return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+// The pixel to write to the display memory for it to look like p at the given brightness level, as closely as possible.
+static inline uint16_t PrecompensatePixel(uint16_t p, int level)
+{
+  level = MAX(level, 1);
+  int r = MIN(31, ((p >> 11) * 255 + level/2) / level), g = MIN(63, (((p >> 5) & 0x3F) * 255 + level/2) / level), b = MIN(31, ((p & 0x1F) * 255 + level/2) / level);
+  return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static inline bool FollowsFade(uint16_t p, uint16_t displayed, int level)
+{
+  uint16_t d = DimPixel(displayed, level);
+  return abs((p >> 11) - (d >> 11)) <= FADE_MAX_ERROR && abs(((p >> 5) & 0x3F) - ((d >> 5) & 0x3F)) <= 2*FADE_MAX_ERROR && abs((p & 0x1F) - (d & 0x1F)) <= FADE_MAX_ERROR;
+}
+
+// Estimates the level that the display memory would need to be dimmed to for it to look like the new frame, as the most common
+// ratio of pixel brightnesses among the sampled pixels, so that content that does not fade (e.g. a sprite moving around) does not
+// skew it. Returns -1 if too little of the display is bright enough to tell, or if the frame is brighter than the display memory.
+static int EstimateFadeLevel(const uint16_t *frame, const uint16_t *displayed)
+{
+  int histogram[64] = {}; // Ratios in 255ths, in buckets of 8
+  int numSamples = 0;
+  for(int y = FADE_FIRST_SCANLINE; y < DISPLAY_HEIGHT; y += FADE_SAMPLE_STEP)
+    for(int x = 0, i = y*DISPLAY_WIDTH; x < DISPLAY_WIDTH; x += FADE_SAMPLE_STEP, i += FADE_SAMPLE_STEP)
+    {
+      int d = Luma(displayed[i]);
+      if (d < FADE_MIN_LUMA) continue;
+      ++histogram[MIN(63, Luma(frame[i]) * 255 / d / 8)];
+      ++numSamples;
+    }
+  const int totalSamples = ((DISPLAY_HEIGHT - FADE_FIRST_SCANLINE + FADE_SAMPLE_STEP - 1) / FADE_SAMPLE_STEP) * ((DISPLAY_WIDTH + FADE_SAMPLE_STEP - 1) / FADE_SAMPLE_STEP);
+  if (numSamples * 4 < totalSamples) return -1;
+
+  int mode = 0, modeCount = -1;
+  for(int i = 0; i < 64; ++i)
+  {
+    int c = (i > 0 ? histogram[i-1] : 0) + histogram[i] + (i < 63 ? histogram[i+1] : 0);
+    if (c > modeCount) mode = i, modeCount = c;
+  }
+
+  // Refine to the average ratio of the samples around the most common one
+  int sum = 0, count = 0;
+  for(int y = FADE_FIRST_SCANLINE; y < DISPLAY_HEIGHT; y += FADE_SAMPLE_STEP)
+    for(int x = 0, i = y*DISPLAY_WIDTH; x < DISPLAY_WIDTH; x += FADE_SAMPLE_STEP, i += FADE_SAMPLE_STEP)
+    {
+      int d = Luma(displayed[i]);
+      if (d < FADE_MIN_LUMA) continue;
+      int ratio = Luma(frame[i]) * 255 / d;
+      if (ratio >= (mode-1)*8 && ratio < (mode+2)*8) sum += ratio, ++count;
+    }
+  if (!count) return -1;
+  int level = (sum + count/2) / count;
+  return (level > 255 + FADE_MIN_STEP) ? -1 : MIN(level, 255);
+}
+
+int EmulateFade(uint16_t *frame, const uint16_t *displayed, const uint16_t *damageMinX, const uint16_t *damageEndX)
+{
+  // A fade changes the whole frame, so only full frame updates can be steps of one
+  bool fullFrame = true;
+  for(int y = FADE_FIRST_SCANLINE; y < DISPLAY_HEIGHT && fullFrame; ++y)
+    fullFrame = (damageMinX[y] == 0 && damageEndX[y] == DISPLAY_WIDTH);
+
+  int level = fullFrame ? EstimateFadeLevel(frame, displayed) : -1;
+  bool isFade = (level >= 0 && (FadeEmulationActive() || level < 255 - FADE_MIN_STEP));
+  if (isFade)
+  {
+    int numSamples = 0, numResiduals = 0;
+    for(int y = FADE_FIRST_SCANLINE; y < DISPLAY_HEIGHT; y += FADE_SAMPLE_STEP)
+      for(int x = 0, i = y*DISPLAY_WIDTH; x < DISPLAY_WIDTH; x += FADE_SAMPLE_STEP, i += FADE_SAMPLE_STEP, ++numSamples)
+        if (!FollowsFade(frame[i], displayed[i], level)) ++numResiduals;
+    isFade = numResiduals * 100 <= numSamples * FADE_MAX_RESIDUAL_PERCENT;
+  }
+
+  if (!isFade)
+  {
+    if (!FadeEmulationActive()) return FADE_UNCHANGED;
+    // Sent as a regular update, after which the display memory is all up to date, and the backlight can be restored
+    fadeLevel = 255;
+    return FADE_ENDED;
+  }
+
+  for(int y = FADE_FIRST_SCANLINE; y < DISPLAY_HEIGHT; ++y)
+    for(int x = 0, i = y*DISPLAY_WIDTH; x < DISPLAY_WIDTH; ++x, ++i)
+      frame[i] = FollowsFade(frame[i], displayed[i], level) ? displayed[i] : PrecompensatePixel(frame[i], level);
+
+  if (level == fadeLevel) return FADE_UNCHANGED;
+  fadeLevel = level;
+  return FADE_LEVEL_CHANGED;
+}
+
+int QueueFadeLevel()
+{
+  // The fade scales the gamma encoded pixel values, but the backlight scales the light output linearly
+  char brightness = (char)(255.0 * pow(fadeLevel / 255.0, FADE_PANEL_GAMMA) + 0.5);
+  QUEUE_SPI_TRANSFER(DISPLAY_WRITE_BRIGHTNESS, brightness);
+  return 2;
+}
+
+#endif
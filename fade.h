@@ -0,0 +1,31 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef FADE_EMULATION
+
+// Fades to and from black change every pixel on every frame, which forces the update to interlace and stutter. Instead, when a new
+// frame is the pixels already on the display scaled by a global brightness level, the pixels are left as they are on the display,
+// and the backlight is dimmed to that level. The display memory then keeps the undimmed image, which is what new frames are compared
+// against for as long as the fade lasts.
+
+// Values returned by EmulateFade()
+#define FADE_UNCHANGED 0 // The frame is not a step of a fade, update it as usual
+#define FADE_LEVEL_CHANGED 1 // The frame is a step of a fade: queue the new level with QueueFadeLevel() before the update
+#define FADE_ENDED 2 // The frame broke off the fade: update it as usual, and queue the restored level with QueueFadeLevel() after the update
+
+extern int fadeLevel; // Current brightness level of the display, 255 when no fade is being emulated
+
+// True while a fade is being emulated. New frames must then be damaged in full, since the display memory does not hold what is shown.
+bool FadeEmulationActive(void);
+
+// Given a new full frame and the display memory contents, detects whether the frame is a step of a fade. If so, replaces the pixels
+// that follow the fade with the display memory contents, and precompensates the rest for the new brightness level.
+int EmulateFade(uint16_t *frame, const uint16_t *displayed, const uint16_t *damageMinX, const uint16_t *damageEndX);
+
+// Queues the command to set the display brightness to fadeLevel. Returns the number of bytes queued.
+int QueueFadeLevel(void);
+
+#endif
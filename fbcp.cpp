@@ -0,0 +1,1207 @@
+#include <linux/futex.h>
+#include <memory.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "fbcp.h"
+#include "text.h"
+#include "spi.h"
+#include "framerate.h"
+#include "presentation.h"
+#include "governor.h"
+#include "oscillation.h"
+#include "fade.h"
+#include "depth.h"
+#include "refresh.h"
+#include "profile.h"
+#include "trace.h"
+#include "input.h"
+#include "log.h"
+#include "statistics.h"
+#include "tick.h"
+#include "display.h"
+#include "util.h"
+
+int displayXOffset = 0;
+int displayYOffset = 0;
+
+// Spans track dirty rectangular areas on screen
+struct Span
+{
+  uint16_t x, endX, y, endY, lastScanEndX, size; // Specifies a box of width [x, endX[ * [y, endY[, where scanline endY-1 can be partial, and ends in lastScanEndX.
+  Span *next; // Maintain a linked skip list inside the array for fast seek to next active element when pruning
+};
+Span spans[DISPLAY_WIDTH*DISPLAY_HEIGHT/2];
+Span fieldSpans[DISPLAY_WIDTH*DISPLAY_HEIGHT/4]; // Interlaced updates only visit every second scanline, so need only half the spans
+
+// A candidate update to the display: the merged spans to send, and how much it will cost to send them over the SPI bus.
+struct SpanPlan
+{
+  Span *head;
+  int numSpans;
+  uint64_t signature; // Hash of the collected spans before merging, i.e. of the exact dirty pixel mask of the frame
+  uint32_t bytes; // Number of bytes the plan puts on the SPI bus, including the cursor and window commands
+  uint32_t tasks; // Number of SPI tasks the plan generates, each of which costs a FIFO flush and a D/C line toggle
+  double usecs; // Modeled SPI bus time to send the plan, using the measured per-byte and per-task costs
+};
+
+// Tracks current SPI display controller write X and Y cursors.
+struct DisplayCursor
+{
+  int x, y, endX;
+};
+
+// For each scanline, the range of pixels [damageMinX, damageEndX[ that may differ from what the display is currently showing. This is the union
+// of the damage rectangles of all frames submitted since the scanline was last sent, so pixels outside of it do not need to be diffed.
+static uint16_t damageMinX[DISPLAY_HEIGHT];
+static uint16_t damageEndX[DISPLAY_HEIGHT];
+
+#ifdef SPI_PIXEL_DESCRIPTORS
+// Index of the buffer of the pool that holds the current frame. For each other buffer in the pool, the range of pixels of each
+// scanline that has changed in the frames captured since that buffer last held the current frame, and so must be refreshed from
+// the current frame before the buffer can hold the next one.
+static int currentPixelFramebuffer = 0;
+static uint16_t pixelFramebufferStaleMinX[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS][DISPLAY_HEIGHT];
+static uint16_t pixelFramebufferStaleEndX[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS][DISPLAY_HEIGHT];
+#endif
+
+// Collects all dirty spans in the image, either on all scanlines, or if interlaced, only on every second scanline starting from y.
+// Only the pixels in the damaged range [minX[y], endX[y][ of each scanline are diffed.
+static void CollectSpans(SpanPlan &plan, Span *spans, uint16_t *framebuffer, uint16_t *prevFramebuffer, const uint16_t *minX, const uint16_t *endX, int y, bool interlaced)
+{
+  uint16_t *scanline = framebuffer + y*DISPLAY_WIDTH;
+  uint16_t *prevScanline = prevFramebuffer + y*DISPLAY_WIDTH;
+  int numSpans = 0;
+  Span *head = 0;
+  uint64_t signature = 14695981039346656037ull; // FNV-1a offset basis
+  for(;y < DISPLAY_HEIGHT; ++y, scanline += DISPLAY_WIDTH, prevScanline += DISPLAY_WIDTH)
+  {
+    const int rowEndX = endX[y]; // Pixels outside the damaged range of the scanline are known to match what the display shows
+    for(int x = minX[y]; x < rowEndX; ++x)
+    {
+      if (scanline[x] == prevScanline[x]) continue;
+      int endX = x+1;
+      while(endX < rowEndX && scanline[endX] != prevScanline[endX]) ++endX; // Find where this span ends
+      spans[numSpans].x = x;
+      spans[numSpans].endX = spans[numSpans].lastScanEndX = endX;
+      spans[numSpans].y = y;
+      spans[numSpans].endY = y+1;
+      spans[numSpans].size = endX - x;
+      if (numSpans > 0) spans[numSpans-1].next = &spans[numSpans];
+      else head = &spans[0];
+      spans[numSpans++].next = 0;
+      signature = (signature ^ ((uint64_t)y << 32 | x << 16 | endX)) * 1099511628211ull; // FNV-1a prime
+      x = endX;
+    }
+
+    // If doing an interlaced update, skip over every second scanline.
+    if (interlaced) ++y, scanline += DISPLAY_WIDTH, prevScanline += DISPLAY_WIDTH;
+  }
+  plan.head = head;
+  plan.numSpans = numSpans;
+  plan.signature = signature;
+}
+
+// Merge spans together on the same scanline
+static void MergeScanlineSpans(Span *head, int mergeThreshold)
+{
+  for(Span *i = head; i; i = i->next)
+    for(Span *j = i->next; j; j = j->next)
+    {
+      if (j->y != i->y) break; // On the next scanline?
+
+      int newSize = j->endX-i->x;
+      int wastedPixels = newSize - i->size - j->size;
+
+      // Looking at SPI communication in a logic analyzer, it is observed that waiting for the finish of an SPI command FIFO causes pretty exactly one byte of delay to the command stream.
+      // Therefore the time/bandwidth cost of ending the current span and starting a new span is as follows:
+      // 1 byte to wait for the current SPI FIFO batch to finish,
+      // +1 byte to send the cursor X coordinate change command,
+      // +1 byte to wait for that FIFO to flush,
+      // +2 bytes to send the new X coordinate,
+      // +1 byte to wait for the FIFO to flush again,
+      // +1 byte to send the data_write command,
+      // +1 byte to wait for that FIFO to flush,
+      // after which the communication is ready to start pushing pixels. This totals to 8 bytes, or 4 pixels, meaning that if there are 4 unchanged pixels or less between two adjacent dirty
+      // spans, it is all the same to just update through those pixels as well to not have to wait to flush the FIFO.
+#define SPAN_MERGE_THRESHOLD 4
+
+      if (wastedPixels > mergeThreshold) break; // Too far away?
+
+      i->endX = j->endX;
+      i->lastScanEndX = j->endX;
+      i->size = newSize;
+      i->next = j->next;
+    }
+}
+
+// Merge spans together on adjacent scanlines - works only if doing a progressive update. Merging a span with anything but a span on
+// the scanline right below it, no more than mergeThreshold pixels past its left or right edge, would waste more pixels than
+// that, so candidates are looked up from per-scanline buckets instead of walking the span list. This keeps the pass linear in the
+// number of spans also for frames that are dirty all over in small fragments, e.g. noise, dithering or checkerboard patterns.
+// mergeCandidates needs room for as many pointers as there are spans, and scanlineCandidates for DISPLAY_HEIGHT+1 indices.
+static Span *spanMergeCandidates[DISPLAY_WIDTH*DISPLAY_HEIGHT/2];
+static int spanScanlineCandidates[DISPLAY_HEIGHT+1];
+
+static void MergeAdjacentScanlineSpans(Span *head, int mergeThreshold, Span **mergeCandidates, int *scanlineCandidates)
+{
+  if (!head) return;
+
+  // At this point each span is on a single scanline, and the list is ordered by y, then by x, so each bucket is ordered by x too
+  int numSpans = 0, y = 0; // scanlineCandidates[y] is the index of the first span of scanline y in mergeCandidates
+  for(Span *s = head; s; s = s->next)
+  {
+    while(y <= s->y) scanlineCandidates[y++] = numSpans;
+    mergeCandidates[numSpans++] = s;
+  }
+  while(y <= DISPLAY_HEIGHT) scanlineCandidates[y++] = numSpans;
+
+  for(int k = 0; k < numSpans; ++k)
+  {
+    Span *i = mergeCandidates[k];
+    if (!i->size) continue; // Already merged to a span above it
+
+    // Grow the span downwards one scanline at a time, for as long as it merges with a span on the scanline below
+    for(bool merged = true; merged && i->endY < DISPLAY_HEIGHT;)
+    {
+      merged = false;
+      int c = scanlineCandidates[i->endY], end = scanlineCandidates[i->endY+1];
+      for(int hi = end; c < hi;) // Binary search the first span that does not end too far left of span i to merge
+      {
+        int mid = (c + hi) / 2;
+        if (mergeCandidates[mid]->endX + mergeThreshold < i->x) c = mid + 1;
+        else hi = mid;
+      }
+      for(; c < end; ++c)
+      {
+        Span *j = mergeCandidates[c];
+        if (j->x > i->endX + mergeThreshold) break; // This and the rest of the spans on the scanline start too far right to merge
+        if (!j->size) continue;
+
+        // Merge the spans i and j, and figure out the wastage of doing so
+        int x = MIN(i->x, j->x);
+        int endX = MAX(i->endX, j->endX);
+        int newSize = (endX-x)*(j->y-i->y) + (j->lastScanEndX - x);
+        int wastedPixels = newSize - i->size - j->size;
+        if (wastedPixels <= mergeThreshold && newSize*DISPLAY_BYTESPERPIXEL <= MAX_SPI_TASK_SIZE)
+        {
+          i->x = x;
+          i->endX = endX;
+          i->endY = j->endY;
+          i->lastScanEndX = j->lastScanEndX;
+          i->size = newSize;
+          j->size = 0; // Marks j as merged, it is unlinked below
+          merged = true;
+          break; // The rest of the spans on that scanline are too far apart from j to merge
+        }
+      }
+    }
+  }
+
+  Span *prev = head;
+  for(int k = 1; k < numSpans; ++k)
+    if (mergeCandidates[k]->size)
+    {
+      prev->next = mergeCandidates[k];
+      prev = mergeCandidates[k];
+    }
+  prev->next = 0;
+}
+
+#ifdef SPI_COMMAND_LISTS
+// Command list that the small commands of the current update are being packed into, or 0 if none is open.
+static SPITask *commandList = 0;
+
+static void FlushCommandList()
+{
+  if (!commandList) return;
+  CommitTask(commandList);
+  commandList = 0;
+}
+
+// Appends a command to the open command list, opening a new one if there is none or it is full, and returns where to write its data.
+static uint8_t *AppendCommand(uint8_t cmd, uint32_t bytes)
+{
+  if (commandList && !CommandListHasRoom(commandList, bytes)) FlushCommandList();
+  if (!commandList) commandList = AllocCommandList();
+  return AppendToCommandList(commandList, cmd, bytes);
+}
+
+#define QUEUE_SPAN_MOVE_CURSOR_TASK(cursor, pos) do { \
+    uint8_t *data = AppendCommand((cursor), 2); \
+    data[0] = (pos) >> 8; \
+    data[1] = (pos) & 0xFF; \
+    bytesTransferred += 3; \
+  } while(0)
+
+#define QUEUE_SPAN_SET_X_WINDOW_TASK(x, endX) do { \
+    uint8_t *data = AppendCommand(DISPLAY_SET_CURSOR_X, 4); \
+    data[0] = (x) >> 8; \
+    data[1] = (x) & 0xFF; \
+    data[2] = (endX) >> 8; \
+    data[3] = (endX) & 0xFF; \
+    bytesTransferred += 5; \
+  } while(0)
+#else
+#define QUEUE_SPAN_MOVE_CURSOR_TASK QUEUE_MOVE_CURSOR_TASK
+#define QUEUE_SPAN_SET_X_WINDOW_TASK QUEUE_SET_X_WINDOW_TASK
+#endif
+
+// Number of bytes that the given number of pixels take up on the SPI bus at the current pixel depth.
+static inline uint32_t SpanPixelBytes(int pixels)
+{
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+  if (reducedDepthActive) return RGB444_BYTES(pixels);
+#endif
+  return pixels*DISPLAY_BYTESPERPIXEL;
+}
+
+// Walks through the spans of the given plan and generates the SPI commands needed to draw them, keeping track of the display
+// controller write cursor. If queueTasks is false, nothing is submitted, and only the number of bytes and tasks that the commands
+// would take up is recorded in the plan. Returns the number of bytes put on the SPI bus.
+static int GenerateSpanTasks(SpanPlan &plan, DisplayCursor &cursor, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool queueTasks)
+{
+  int bytesTransferred = 0;
+  uint32_t tasks = 0;
+  Span *nextMultilineSpan = 0; // The first multiline span after the span being generated, as last found by the peek ahead below
+  bool noMoreMultilineSpans = false;
+  for(Span *i = plan.head; i; i = i->next)
+  {
+    // Update the write cursor if needed
+    if (cursor.y != i->y)
+    {
+      if (queueTasks) QUEUE_SPAN_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y);
+      else bytesTransferred += 3;
+      ++tasks;
+      cursor.y = i->y;
+    }
+
+    if (i->endY > i->y + 1 && (cursor.x != i->x || cursor.endX != i->endX)) // Multiline span?
+    {
+      if (queueTasks) QUEUE_SPAN_SET_X_WINDOW_TASK(i->x, displayXOffset + i->endX - 1);
+      else bytesTransferred += 5;
+      ++tasks;
+      cursor.x = i->x;
+      cursor.endX = i->endX;
+    }
+    else // Singleline span
+    {
+      if (cursor.endX < i->endX) // Need to push the X end window?
+      {
+        // We are doing a single line span and need to increase the X window. If possible,
+        // peek ahead to cater to the next multiline span update if that will be compatible.
+        // (The spans are in the order of the span array, so the peek is resumed where it left off, instead of rescanning the same
+        // single line spans on each push)
+        if (!noMoreMultilineSpans && (!nextMultilineSpan || nextMultilineSpan <= i))
+        {
+          for(nextMultilineSpan = i->next; nextMultilineSpan && nextMultilineSpan->endY == nextMultilineSpan->y+1; nextMultilineSpan = nextMultilineSpan->next) {}
+          noMoreMultilineSpans = !nextMultilineSpan;
+        }
+        int nextEndX = (nextMultilineSpan && nextMultilineSpan->endX >= i->endX) ? nextMultilineSpan->endX : DISPLAY_WIDTH;
+        if (queueTasks) QUEUE_SPAN_SET_X_WINDOW_TASK(i->x, displayXOffset + nextEndX - 1);
+        else bytesTransferred += 5;
+        ++tasks;
+        cursor.x = i->x;
+        cursor.endX = nextEndX;
+      }
+      else if (cursor.x != i->x)
+      {
+        if (queueTasks) QUEUE_SPAN_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + i->x);
+        else bytesTransferred += 3;
+        ++tasks;
+        cursor.x = i->x;
+      }
+    }
+
+    ++tasks;
+    if (!queueTasks)
+    {
+      bytesTransferred += SpanPixelBytes(i->size)+1;
+      continue;
+    }
+
+    // Submit the span pixels
+    uint32_t spanBytes = SpanPixelBytes(i->size);
+    bytesTransferred += spanBytes+1;
+    uint16_t *scanline = framebuffer + i->y * DISPLAY_WIDTH;
+    uint16_t *prevScanline = prevFramebuffer + i->y * DISPLAY_WIDTH;
+#ifdef SPI_PIXEL_DESCRIPTORS
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+    if (spanBytes >= SPI_PIXEL_DESCRIPTOR_MIN_BYTES && !reducedDepthActive) // The SPI thread only byte swaps, it cannot pack 12-bit pixels
+#else
+    if (spanBytes >= SPI_PIXEL_DESCRIPTOR_MIN_BYTES)
+#endif
+    {
+#ifdef SPI_COMMAND_LISTS
+      FlushCommandList();
+#endif
+      // The SPI thread reads the pixels straight from the frame buffer, which stays untouched until the task is done
+      QueuePixelDescriptor(DISPLAY_WRITE_PIXELS, currentPixelFramebuffer, i->x, i->y, i->endX - i->x, i->endY - i->y, i->lastScanEndX - i->x);
+      for(int y = i->y; y < i->endY; ++y, scanline += DISPLAY_WIDTH, prevScanline += DISPLAY_WIDTH)
+      {
+        int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+        memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*DISPLAY_BYTESPERPIXEL);
+      }
+      continue;
+    }
+#endif
+    SPITask *task = 0;
+    uint16_t *data;
+#ifdef SPI_COMMAND_LISTS
+    if (spanBytes <= SPI_COMMAND_LIST_MAX_SPAN_BYTES) data = (uint16_t*)AppendCommand(DISPLAY_WRITE_PIXELS, spanBytes);
+    else
+#endif
+    {
+#ifdef SPI_COMMAND_LISTS
+      FlushCommandList(); // The commands packed so far must go out before this span, and no other task can be allocated while a list is open
+#endif
+      task = AllocTask(spanBytes);
+      task->cmd = DISPLAY_WRITE_PIXELS;
+      data = (uint16_t*)task->data;
+    }
+
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+    if (reducedDepthActive)
+    {
+      uint8_t *packed = (uint8_t*)data;
+      int carry = -1;
+      for(int y = i->y; y < i->endY; ++y, scanline += DISPLAY_WIDTH, prevScanline += DISPLAY_WIDTH)
+      {
+        int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+        packed = PackRGB444(packed, scanline+i->x, endX - i->x, carry);
+        memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*DISPLAY_BYTESPERPIXEL);
+      }
+      FlushRGB444(packed, carry);
+      if (task) CommitTask(task);
+      continue;
+    }
+#endif
+    for(int y = i->y; y < i->endY; ++y, scanline += DISPLAY_WIDTH, prevScanline += DISPLAY_WIDTH)
+    {
+      int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+      for(int x = i->x; x < endX; ++x) *data++ = __builtin_bswap16(scanline[x]); // Write out the RGB565 data, swapping to big endian byte order for the SPI bus
+      memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*DISPLAY_BYTESPERPIXEL);
+    }
+    if (task) CommitTask(task);
+  }
+#ifdef SPI_COMMAND_LISTS
+  if (queueTasks) FlushCommandList();
+#endif
+  plan.bytes = bytesTransferred;
+  plan.tasks = tasks;
+  return bytesTransferred;
+}
+
+#ifdef USE_SPAN_PLAN_CACHE
+// Games and UIs often dirty exactly the same pixels frame after frame (a HUD counter, a blinking cursor, a sprite that animates in
+// place), so remember the merged spans of recently seen dirty masks, and on a repeat skip the merge passes and reuse the old result.
+#define PLAN_CACHE_SIZE 8
+#define PLAN_CACHE_MAX_SPANS 256 // Frames with more merged spans than this are not cached, they are not recurring UI elements
+struct CachedPlan
+{
+  uint64_t signature;
+  int numSpans; // Number of collected spans before merging, double checks the signature against hash collisions
+  int numMergedSpans;
+  bool interlaced;
+  uint64_t lastUsed;
+  Span mergedSpans[PLAN_CACHE_MAX_SPANS];
+};
+CachedPlan planCache[PLAN_CACHE_SIZE] = {};
+uint64_t planCacheCounter = 0;
+double planCacheMissUsecs = 0; // Running average of how long the merge passes take on cacheable frames when they miss the cache
+
+static CachedPlan *FindCachedPlan(const SpanPlan &plan, bool interlaced)
+{
+  for(int i = 0; i < PLAN_CACHE_SIZE; ++i)
+    if (planCache[i].signature == plan.signature && planCache[i].numSpans == plan.numSpans && planCache[i].interlaced == interlaced && planCache[i].lastUsed)
+      return &planCache[i];
+  return 0;
+}
+
+// Stores the merged spans of the given plan in place of the least recently used cache entry.
+static void AddCachedPlan(const SpanPlan &plan, int numCollectedSpans, bool interlaced)
+{
+  int numMergedSpans = 0;
+  for(Span *i = plan.head; i; i = i->next)
+    if (++numMergedSpans > PLAN_CACHE_MAX_SPANS) return;
+
+  CachedPlan *entry = &planCache[0];
+  for(int i = 1; i < PLAN_CACHE_SIZE; ++i)
+    if (planCache[i].lastUsed < entry->lastUsed) entry = &planCache[i];
+
+  entry->signature = plan.signature;
+  entry->numSpans = numCollectedSpans;
+  entry->numMergedSpans = numMergedSpans;
+  entry->interlaced = interlaced;
+  entry->lastUsed = ++planCacheCounter;
+  Span *dst = entry->mergedSpans;
+  for(Span *i = plan.head; i; i = i->next) *dst++ = *i;
+}
+#endif
+
+// Computes the full list of merged spans for a progressive update, or for a single interlaced field, and the exact number of
+// bytes and tasks it would take to send it when starting from the given write cursor position.
+static void PlanUpdate(SpanPlan &plan, Span *spans, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlaced, int parity, DisplayCursor cursor)
+{
+  CollectSpans(plan, spans, framebuffer, prevFramebuffer, damageMinX, damageEndX, interlaced ? parity : 0, interlaced);
+#ifdef USE_SPAN_PLAN_CACHE
+  CachedPlan *cached = plan.head ? FindCachedPlan(plan, interlaced) : 0;
+  if (cached)
+  {
+    // The dirty mask is the same as before, so the merged spans will be too. Relink them into the span array, only the pixel
+    // payload will be read fresh from the new frame when the tasks are generated.
+    for(int i = 0; i < cached->numMergedSpans; ++i)
+    {
+      spans[i] = cached->mergedSpans[i];
+      spans[i].next = (i + 1 < cached->numMergedSpans) ? &spans[i+1] : 0;
+    }
+    plan.head = &spans[0];
+    cached->lastUsed = ++planCacheCounter;
+#ifdef STATISTICS
+    ++statsPlanCacheHits;
+    statsPlanningUsecsSaved += planCacheMissUsecs;
+#endif
+  }
+  else
+  {
+    int numCollectedSpans = plan.numSpans;
+    uint64_t t0 = tick();
+#endif
+  MergeScanlineSpans(plan.head, SPAN_MERGE_THRESHOLD);
+  if (!interlaced) MergeAdjacentScanlineSpans(plan.head, SPAN_MERGE_THRESHOLD, spanMergeCandidates, spanScanlineCandidates);
+#ifdef USE_SPAN_PLAN_CACHE
+    if (plan.head)
+    {
+      planCacheMissUsecs = planCacheMissUsecs * 0.9 + (tick() - t0) * 0.1;
+      AddCachedPlan(plan, numCollectedSpans, interlaced);
+#ifdef STATISTICS
+      ++statsPlanCacheMisses;
+#endif
+    }
+  }
+#endif
+  GenerateSpanTasks(plan, cursor, framebuffer, prevFramebuffer, false);
+  plan.usecs = plan.bytes * spiUsecsPerByte + plan.tasks * spiUsecsPerTask;
+}
+
+static uint16_t *framebuffer[2] = {}; // First buffer contains the current source frame, second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
+static DisplayCursor cursor = { 0, 0, DISPLAY_WIDTH }; // Track current SPI display controller write X and Y cursors.
+static uint32_t curFrameEnd = 0;
+static uint32_t prevFrameEnd = 0;
+static bool interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
+static int frameParity = 0; // For interlaced frame updates, this is either 0 or 1 to denote evens or odds.
+#ifdef STATISTICS
+static uint64_t mainThreadSpiWaitUsecs = 0; // Time spent waiting for the SPI queue to drain since the most recent new frame came in
+static uint64_t mainThreadBusyUsecs = 0; // Time spent copying, planning and queueing updates since the most recent new frame came in
+static uint64_t predictedFrameDoneTime = 0; // The time at which the cost model predicted that the SPI bus would have finished sending the most recently submitted frame
+#endif
+
+// Frame completion is tracked by counting bytes: a frame is done once the SPI thread has consumed all bytes that were queued up to
+// and including the last task of that frame.
+#define FRAME_ID_HISTORY 16
+static uint64_t bytesSubmitted = 0; // Total bytes ever put into the SPI task queue, biased so that bytesSubmitted - spiBytesQueued = bytes sent
+static uint64_t frameEndBytes[FRAME_ID_HISTORY] = {};
+static uint32_t nextFrameId = 1;
+static uint64_t lastCaptureTime = 0; // Capture time of the most recently submitted frame, reported also for the interlaced fields sent after it
+
+static void AddDamage(int x, int y, int endX, int endY)
+{
+  x = MAX(x, 0);
+  y = MAX(y, 0);
+  endX = MIN(endX, DISPLAY_WIDTH);
+  endY = MIN(endY, DISPLAY_HEIGHT);
+  for(; y < endY; ++y)
+  {
+    if (x < damageMinX[y]) damageMinX[y] = x;
+    if (endX > damageEndX[y]) damageEndX[y] = endX;
+  }
+}
+
+#ifdef SPI_PIXEL_DESCRIPTORS
+// Makes framebuffer[0] a buffer of the pool that no queued SPI task refers to, so that the next frame can be captured into it.
+// Outside of the damaged area, the next frame is the same as the current one, so only the pixels that have changed in the current
+// frame since the buffer last held a frame are refreshed from it, and the damaged area is then captured from the source.
+static void AcquirePixelFramebuffer()
+{
+  int next = -1;
+  for(;;)
+  {
+    uint32_t releases = __atomic_load_n(&pixelFramebufferReleases, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS && next < 0; ++i)
+      if (i != currentPixelFramebuffer && __atomic_load_n(&pixelFramebufferUsers[i], __ATOMIC_ACQUIRE) == 0) next = i;
+    if (next >= 0) break;
+    syscall(SYS_futex, &pixelFramebufferReleases, FUTEX_WAIT, releases, 0, 0, 0); // All other buffers are still being sent, sleep until the SPI thread is done with one
+  }
+
+  uint16_t *cur = pixelFramebuffers[currentPixelFramebuffer], *dst = pixelFramebuffers[next];
+  uint16_t *staleMinX = pixelFramebufferStaleMinX[next], *staleEndX = pixelFramebufferStaleEndX[next];
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    if (staleEndX[y] <= staleMinX[y]) continue;
+    int offset = y*DISPLAY_WIDTH;
+    // The damaged range [damageMinX, damageEndX[ will be captured from the source, so only refresh the parts on either side of it
+    int leftEndX = (damageEndX[y] > damageMinX[y]) ? MIN(staleEndX[y], damageMinX[y]) : staleEndX[y];
+    if (leftEndX > staleMinX[y]) memcpy(dst + offset + staleMinX[y], cur + offset + staleMinX[y], (leftEndX - staleMinX[y])*DISPLAY_BYTESPERPIXEL);
+    int rightX = MAX(staleMinX[y], damageEndX[y]);
+    if (damageEndX[y] > damageMinX[y] && staleEndX[y] > rightX) memcpy(dst + offset + rightX, cur + offset + rightX, (staleEndX[y] - rightX)*DISPLAY_BYTESPERPIXEL);
+  }
+
+  for(int i = 0; i < SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS; ++i)
+    for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+      if (i == next)
+      {
+        pixelFramebufferStaleMinX[i][y] = DISPLAY_WIDTH;
+        pixelFramebufferStaleEndX[i][y] = 0;
+      }
+      else if (damageEndX[y] > damageMinX[y])
+      {
+        pixelFramebufferStaleMinX[i][y] = MIN(pixelFramebufferStaleMinX[i][y], damageMinX[y]);
+        pixelFramebufferStaleEndX[i][y] = MAX(pixelFramebufferStaleEndX[i][y], damageEndX[y]);
+      }
+
+  ++pixelFramebufferVersions[next];
+  currentPixelFramebuffer = next;
+  framebuffer[0] = dst;
+}
+#endif
+
+// Marks the scanlines that the given update sent to the display as matching the current frame.
+static void ClearDamage(bool interlaced, int parity)
+{
+  for(int y = interlaced ? parity : 0; y < DISPLAY_HEIGHT; y += interlaced ? 2 : 1)
+  {
+    damageMinX[y] = DISPLAY_WIDTH;
+    damageEndX[y] = 0;
+  }
+}
+
+#ifdef SHADOW_PLANNER
+#if !defined(STATISTICS) || !defined(STATISTICS_METRICS_FILE)
+#error SHADOW_PLANNER needs STATISTICS and STATISTICS_METRICS_FILE, the comparison of the planners is only reported in the metrics export
+#endif
+
+// The shadow planner plans the same frames as the production planner, but with the alternative SHADOW_* parameters, on a thread of
+// its own so that it does not add to the latency of the frames. Its plans are only measured, never sent. The main thread hands it
+// a frame only when it is idle, and otherwise skips the frame for the comparison, so the shadow thread can never fall behind.
+struct ShadowFrame
+{
+  uint16_t damageMinX[DISPLAY_HEIGHT], damageEndX[DISPLAY_HEIGHT];
+  DisplayCursor cursor;
+  int parity; // Field that an interlaced update of this frame would send
+  double queuedUsecs, frameUsecs; // SPI queue backlog and target frame time that the production planner saw
+  double usecsPerByte, usecsPerTask; // SPI cost model that the production plan was priced with
+  SpanPlan plan; // Result: the chosen plan of the shadow planner
+  bool interlaced;
+  uint64_t cpuUsecs;
+};
+static ShadowFrame shadowFrame = {};
+static uint16_t *shadowFramebuffer[2] = {};
+static Span *shadowSpans = 0, *shadowFieldSpans = 0, **shadowMergeCandidates = 0;
+static int shadowScanlineCandidates[DISPLAY_HEIGHT+1];
+static volatile int shadowFramePending = 0; // Futex: 1 while the shadow thread owns shadowFrame and is planning it
+static volatile int shadowPlannerQuit = 0;
+static volatile int shadowPlannerExited = 0;
+static pthread_t shadowPlannerThread;
+static bool shadowPlannerRunning = false;
+
+// The production plan of the frame that the shadow thread is planning, accounted together with the shadow result once it is done
+static SpanPlan productionPlan = {};
+static bool productionInterlaced = false;
+static uint64_t productionCpuUsecs = 0;
+static bool shadowResultPending = false;
+
+static uint64_t ThreadCpuUsecs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ShadowPlanUpdate(SpanPlan &plan, Span *spans, bool interlaced, int parity)
+{
+  CollectSpans(plan, spans, shadowFramebuffer[0], shadowFramebuffer[1], shadowFrame.damageMinX, shadowFrame.damageEndX, interlaced ? parity : 0, interlaced);
+  MergeScanlineSpans(plan.head, SHADOW_SPAN_MERGE_THRESHOLD);
+  if (!interlaced) MergeAdjacentScanlineSpans(plan.head, SHADOW_SPAN_MERGE_THRESHOLD, shadowMergeCandidates, shadowScanlineCandidates);
+  DisplayCursor cursor = shadowFrame.cursor;
+  GenerateSpanTasks(plan, cursor, shadowFramebuffer[0], shadowFramebuffer[1], false);
+  plan.usecs = plan.bytes * shadowFrame.usecsPerByte + plan.tasks * shadowFrame.usecsPerTask;
+}
+
+static void *shadow_planner_thread(void *unused)
+{
+  RegisterStatisticsThread("shadow");
+#if SHADOW_PLANNER_CPU >= 0 && !defined(SIMULATOR)
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(SHADOW_PLANNER_CPU, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) LogMessage(LOG_WARNING, "Failed to pin the shadow planner to CPU %d", SHADOW_PLANNER_CPU);
+#endif
+  for(;;)
+  {
+    while(!__atomic_load_n(&shadowFramePending, __ATOMIC_ACQUIRE))
+    {
+      if (__atomic_load_n(&shadowPlannerQuit, __ATOMIC_ACQUIRE))
+      {
+        __atomic_store_n(&shadowPlannerExited, 1, __ATOMIC_SEQ_CST);
+        return 0;
+      }
+      syscall(SYS_futex, &shadowFramePending, FUTEX_WAIT, 0, 0, 0, 0);
+    }
+
+    // Plan first, then decide, like the production planner, but with SHADOW_INTERLACE_BUDGET in place of its 4/5ths heuristic
+    uint64_t cpu0 = ThreadCpuUsecs();
+    SpanPlan progressivePlan = {}, fieldPlan = {};
+    ShadowPlanUpdate(progressivePlan, shadowSpans, false, 0);
+    shadowFrame.interlaced = false;
+    if (shadowFrame.queuedUsecs + progressivePlan.usecs > shadowFrame.frameUsecs * SHADOW_INTERLACE_BUDGET)
+    {
+      ShadowPlanUpdate(fieldPlan, shadowFieldSpans, true, shadowFrame.parity);
+      shadowFrame.interlaced = (fieldPlan.usecs < progressivePlan.usecs);
+    }
+    shadowFrame.plan = shadowFrame.interlaced ? fieldPlan : progressivePlan;
+    shadowFrame.cpuUsecs = ThreadCpuUsecs() - cpu0;
+
+    __atomic_store_n(&shadowFramePending, 0, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+static void AccountPlan(PlannerStatistics &stats, const SpanPlan &plan, bool interlaced, uint64_t cpuUsecs)
+{
+  ++stats.frames;
+  if (interlaced) ++stats.interlacedFrames;
+  stats.bytes += plan.bytes;
+  stats.commands += plan.tasks;
+  stats.busUsecs += plan.usecs;
+  stats.cpuUsecs += cpuUsecs;
+}
+
+// Hands the frame that the production planner just planned to the shadow planner, if it is done with the previous one. Must be
+// called before the production plan is submitted, since submitting it brings framebuffer[1] up to date with the frame.
+static void SubmitShadowFrame(uint16_t *framebuffer, uint16_t *prevFramebuffer, const SpanPlan &plan, bool interlaced, uint64_t cpuUsecs,
+  const DisplayCursor &cursor, int parity, double queuedUsecs, double frameUsecs)
+{
+  if (__atomic_load_n(&shadowFramePending, __ATOMIC_ACQUIRE))
+  {
+    ++statsShadowFramesSkipped;
+    return;
+  }
+
+  // Both results of the previous frame are in, so account them together, to have the totals of the two planners cover the same frames
+  if (shadowResultPending)
+  {
+    AccountPlan(statsProductionPlanner, productionPlan, productionInterlaced, productionCpuUsecs);
+    AccountPlan(statsShadowPlanner, shadowFrame.plan, shadowFrame.interlaced, shadowFrame.cpuUsecs);
+  }
+  productionPlan = plan;
+  productionInterlaced = interlaced;
+  productionCpuUsecs = cpuUsecs;
+  shadowResultPending = true;
+
+  // The planners only ever read the pixels inside the damaged ranges, so only those need to be copied over
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    shadowFrame.damageMinX[y] = damageMinX[y];
+    shadowFrame.damageEndX[y] = damageEndX[y];
+    if (damageEndX[y] > damageMinX[y])
+    {
+      int offset = y*DISPLAY_WIDTH + damageMinX[y], bytes = (damageEndX[y] - damageMinX[y])*DISPLAY_BYTESPERPIXEL;
+      memcpy(shadowFramebuffer[0] + offset, framebuffer + offset, bytes);
+      memcpy(shadowFramebuffer[1] + offset, prevFramebuffer + offset, bytes);
+    }
+  }
+  shadowFrame.cursor = cursor;
+  shadowFrame.parity = parity;
+  shadowFrame.queuedUsecs = queuedUsecs;
+  shadowFrame.frameUsecs = frameUsecs;
+  shadowFrame.usecsPerByte = spiUsecsPerByte;
+  shadowFrame.usecsPerTask = spiUsecsPerTask;
+  __atomic_store_n(&shadowFramePending, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &shadowFramePending, FUTEX_WAKE, 1, 0, 0, 0);
+}
+
+static void InitShadowPlanner()
+{
+  shadowFramebuffer[0] = (uint16_t *)malloc(FRAMEBUFFER_SIZE);
+  shadowFramebuffer[1] = (uint16_t *)malloc(FRAMEBUFFER_SIZE);
+  shadowSpans = (Span *)malloc(sizeof(spans));
+  shadowFieldSpans = (Span *)malloc(sizeof(fieldSpans));
+  shadowMergeCandidates = (Span **)malloc(sizeof(spanMergeCandidates));
+  if (!shadowFramebuffer[0] || !shadowFramebuffer[1] || !shadowSpans || !shadowFieldSpans || !shadowMergeCandidates) FATAL_ERROR("Failed to allocate shadow planner buffers!");
+
+  shadowPlannerQuit = shadowPlannerExited = 0;
+  int rc = pthread_create(&shadowPlannerThread, NULL, shadow_planner_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create shadow planner thread!");
+  shadowPlannerRunning = true;
+}
+
+static void DeinitShadowPlanner()
+{
+  if (!shadowPlannerRunning) return;
+  // The thread finishes the frame it is planning first, if any. It checks the quit flag before it sleeps on shadowFramePending, so
+  // a single wake can land in between and be lost: keep waking it until it has exited, like DeinitSPI() does.
+  __atomic_store_n(&shadowPlannerQuit, 1, __ATOMIC_SEQ_CST);
+  while(!__atomic_load_n(&shadowPlannerExited, __ATOMIC_SEQ_CST))
+  {
+    syscall(SYS_futex, &shadowFramePending, FUTEX_WAKE, 1, 0, 0, 0);
+    usleep(1000);
+  }
+  pthread_join(shadowPlannerThread, 0);
+  shadowPlannerRunning = false;
+  shadowResultPending = false;
+  free(shadowFramebuffer[0]);
+  free(shadowFramebuffer[1]);
+  free(shadowSpans);
+  free(shadowFieldSpans);
+  free(shadowMergeCandidates);
+  shadowFramebuffer[0] = shadowFramebuffer[1] = 0;
+  shadowSpans = shadowFieldSpans = 0;
+  shadowMergeCandidates = 0;
+}
+#endif
+
+#ifdef STATISTICS
+// Source frames were captured and replaced by newer ones before they were submitted. Blames whatever kept the main thread from
+// submitting them since the frame before, or if that was not much, the frame before being captured late, right before these.
+static void AttributeSkippedFrames(int skippedFrames)
+{
+  uint32_t interval = (uint32_t)EstimateFrameRateInterval();
+  if (mainThreadSpiWaitUsecs >= interval/2 && mainThreadSpiWaitUsecs >= mainThreadBusyUsecs)
+    RecordFrameDrop(DROP_SPI_QUEUE_FULL, false, skippedFrames, (uint32_t)mainThreadSpiWaitUsecs, interval);
+  else if (mainThreadBusyUsecs >= interval/2)
+    RecordFrameDrop(DROP_PLANNER_OVER_BUDGET, false, skippedFrames, (uint32_t)mainThreadBusyUsecs, interval);
+  else
+    RecordFrameDrop(DROP_CAPTURE_LATE, false, skippedFrames, (uint32_t)(mainThreadSpiWaitUsecs + mainThreadBusyUsecs), interval);
+}
+#endif
+
+int fbcp_init()
+{
+  InitLog();
+  InitSPI();
+  bytesSubmitted = spiTaskMemory->spiBytesQueued; // The display initialization commands are already in the queue
+  curFrameEnd = prevFrameEnd = spiTaskMemory->queueTail;
+
+#ifdef SPI_PIXEL_DESCRIPTORS
+  for(int i = 0; i < SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS; ++i)
+  {
+    pixelFramebuffers[i] = (uint16_t *)malloc(FRAMEBUFFER_SIZE);
+    if (!pixelFramebuffers[i]) FATAL_ERROR("Failed to allocate framebuffers!");
+    memset(pixelFramebuffers[i], 0, FRAMEBUFFER_SIZE);
+    for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+    {
+      pixelFramebufferStaleMinX[i][y] = DISPLAY_WIDTH;
+      pixelFramebufferStaleEndX[i][y] = 0;
+    }
+  }
+  framebuffer[0] = pixelFramebuffers[currentPixelFramebuffer];
+#else
+  framebuffer[0] = (uint16_t *)malloc(FRAMEBUFFER_SIZE);
+#endif
+  framebuffer[1] = (uint16_t *)malloc(FRAMEBUFFER_SIZE);
+  if (!framebuffer[0] || !framebuffer[1]) FATAL_ERROR("Failed to allocate framebuffers!");
+  memset(framebuffer[0], 0, FRAMEBUFFER_SIZE);
+  memset(framebuffer[1], 0, FRAMEBUFFER_SIZE);
+  ClearDamage(false, 0);
+
+#ifdef PRESENTATION_FEEDBACK
+  InitPresentationFeedback();
+#endif
+#ifdef OSCILLATION_FILTER
+  InitOscillationFilter();
+#endif
+#ifdef PERFORMANCE_GOVERNOR
+  InitGovernor();
+#endif
+  InitStatistics();
+#ifdef SHADOW_PLANNER
+  InitShadowPlanner();
+#endif
+#ifdef APP_PROFILES
+  InitAppProfiles();
+#endif
+#ifdef FRAME_TRACE_FILE
+  InitFrameTraceRecorder();
+#endif
+#ifdef WAKE_ON_INPUT
+  InitInputWake();
+#endif
+  return 0;
+}
+
+// At all times keep at most two rendered frames in the SPI task queue pending to be displayed. Only proceed to submit a new frame
+// once the older of those has been displayed.
+static void WaitForSpiQueueRoom()
+{
+#ifdef STATISTICS
+  uint64_t waitStartTime = tick();
+  bool once = true;
+#endif
+  while ((spiTaskMemory->queueTail + SPI_QUEUE_SIZE - spiTaskMemory->queueHead) % SPI_QUEUE_SIZE > (spiTaskMemory->queueTail + SPI_QUEUE_SIZE - prevFrameEnd) % SPI_QUEUE_SIZE)
+  {
+    // Peek at the SPI thread's workload and throttle a bit if it has got a lot of work still to do.
+    double usecsUntilSpiQueueEmpty = spiTaskMemory->spiBytesQueued*spiUsecsPerByte;
+    if (usecsUntilSpiQueueEmpty > 0)
+    {
+      uint32_t sleepUsecs = (uint32_t)(usecsUntilSpiQueueEmpty*0.4);
+#ifdef STATISTICS
+      uint32_t bytesInQueueBefore = spiTaskMemory->spiBytesQueued;
+      uint64_t t0 = tick();
+#endif
+      if (sleepUsecs > 1000) usleep(500);
+
+#ifdef STATISTICS
+      uint64_t t1 = tick();
+      uint32_t bytesInQueueAfter = spiTaskMemory->spiBytesQueued;
+      bool starved = (spiTaskMemory->queueHead == spiTaskMemory->queueTail);
+
+      if (once && starved)
+      {
+        LogMessage(LOG_DEBUG, "Had %u bytes in queue, asked to sleep for %u usecs, got %u usecs sleep, afterwards %u bytes in queue. (got %.2f%% work done)%s",
+          bytesInQueueBefore, sleepUsecs, (uint32_t)(t1 - t0), bytesInQueueAfter, (bytesInQueueBefore-bytesInQueueAfter)*100.0/bytesInQueueBefore,
+          starved ? "  SLEPT TOO LONG, SPI THREAD STARVED" : "");
+        once = false;
+      }
+#endif
+    }
+    SIM_YIELD();
+  }
+#ifdef STATISTICS
+  mainThreadSpiWaitUsecs += tick() - waitStartTime;
+#endif
+}
+
+void fbcp_wait_for_queue()
+{
+  WaitForSpiQueueRoom();
+}
+
+uint32_t fbcp_submit_frame(const uint16_t *frame, int stride, const fbcp_rect *damage, int numDamageRects)
+{
+  return fbcp_submit_captured_frame(frame, stride, damage, numDamageRects, tick(), 0);
+}
+
+uint32_t fbcp_submit_captured_frame(const uint16_t *frame, int stride, const fbcp_rect *damage, int numDamageRects, uint64_t captureTime, int skippedFrames)
+{
+#ifdef STATISTICS
+  if (skippedFrames > 0) AttributeSkippedFrames(skippedFrames);
+  if (frame) mainThreadSpiWaitUsecs = mainThreadBusyUsecs = 0;
+#endif
+  WaitForSpiQueueRoom();
+#ifdef STATISTICS
+  uint64_t processingStartTime = tick();
+#endif
+
+  int expiredFrames = 0;
+  uint64_t now = tick();
+  while(expiredFrames < frameTimeHistorySize && now - frameTimeHistory[expiredFrames].time >= FRAMERATE_HISTORY_LENGTH) ++expiredFrames;
+  if (expiredFrames > 0)
+  {
+    frameTimeHistorySize -= expiredFrames;
+    for(int i = 0; i < frameTimeHistorySize; ++i) frameTimeHistory[i] = frameTimeHistory[i+expiredFrames];
+  }
+
+#ifdef STATISTICS
+  int expiredSkippedFrames = 0;
+  while(expiredSkippedFrames < frameSkipTimeHistorySize && now - frameSkipTimeHistory[expiredSkippedFrames] >= FRAMERATE_HISTORY_LENGTH) ++expiredSkippedFrames;
+  if (expiredSkippedFrames > 0)
+  {
+    frameSkipTimeHistorySize -= expiredSkippedFrames;
+    for(int i = 0; i < frameSkipTimeHistorySize; ++i) frameSkipTimeHistory[i] = frameSkipTimeHistory[i+expiredSkippedFrames];
+  }
+#endif
+
+#ifdef STATISTICS
+  bool prevFrameWasInterlacedUpdate = interlacedUpdate;
+#endif
+  bool gotNewFramebuffer = (frame != 0);
+#ifdef FADE_EMULATION
+  int fadeUpdate = FADE_UNCHANGED;
+#endif
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+  bool depthSwitched = false;
+#endif
+#ifdef PANEL_REFRESH_MATCHING
+  bool refreshRateChanged = false;
+#endif
+  if (gotNewFramebuffer)
+  {
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+    depthSwitched = SwitchReducedDepth();
+    if (depthSwitched && !reducedDepthActive) AddDamage(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT); // Resend every pixel that lost precision
+#endif
+    // Copy in only the damaged areas of the new frame, the rest of the previous frame is still valid.
+    if (!damage) AddDamage(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+#ifdef FADE_EMULATION
+    else if (FadeEmulationActive()) AddDamage(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT); // The previous frame was rewritten to match the display memory
+#endif
+    else for(int i = 0; i < numDamageRects; ++i) AddDamage(damage[i].x, damage[i].y, damage[i].x + damage[i].width, damage[i].y + damage[i].height);
+#ifdef STATISTICS
+    AddDamage(0, 0, DISPLAY_WIDTH, STATISTICS_OVERLAY_HEIGHT); // The overlay is redrawn on each frame, so refresh the pixels under it from the source
+#endif
+#ifdef SIMULATOR
+    SimBeginCopying();
+#endif
+#ifdef SPI_PIXEL_DESCRIPTORS
+    AcquirePixelFramebuffer();
+#endif
+    const uint8_t *src = (const uint8_t *)frame;
+    for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+      if (damageEndX[y] > damageMinX[y])
+        memcpy(framebuffer[0] + y*DISPLAY_WIDTH + damageMinX[y], src + y*stride + damageMinX[y]*DISPLAY_BYTESPERPIXEL, (damageEndX[y] - damageMinX[y])*DISPLAY_BYTESPERPIXEL);
+#ifdef SIMULATOR
+    SimEndCopying();
+#endif
+#ifdef OSCILLATION_FILTER
+    FilterOscillatingPixels(framebuffer[0], framebuffer[1], damageMinX, damageEndX);
+#endif
+#ifdef FADE_EMULATION
+    fadeUpdate = EmulateFade(framebuffer[0], framebuffer[1], damageMinX, damageEndX);
+#endif
+#ifdef STATISTICS
+    // If the SPI thread is still busy with the previous frame after the time the plan estimated it would take, the cost model mispredicted.
+    if (predictedFrameDoneTime && now > predictedFrameDoneTime && spiTaskMemory->spiBytesQueued > 0) ++statsMispredictedFrames;
+#endif
+    RefreshStatisticsOverlayText();
+    DrawStatisticsOverlay(framebuffer[0]);
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+    if (reducedDepthActive) QuantizeRGB444(framebuffer[0], damageMinX, damageEndX);
+#endif
+    AddHistogramSample();
+#ifdef PANEL_REFRESH_MATCHING
+    refreshRateChanged = UpdatePanelRefreshRate(captureTime);
+#endif
+    lastCaptureTime = captureTime;
+  }
+
+  // Plan first, then decide: compute the exact cost of sending the progressive update, and if that would not fit in the frame
+  // time budget, the cost of sending only the next interlaced field, and pick the option that meets the frame deadline.
+  double inputDataFps = 1000000.0 / EstimateFrameRateInterval();
+  double desiredTargetFps = MAX(1, MIN(inputDataFps, TARGET_FRAME_RATE));
+  const double tooMuchToUpdateUsecs = 1000000 / desiredTargetFps * 4 / 5; // Use a rather arbitrary 4/5ths heuristic as an estimate of too much workload.
+#ifdef STATISTICS
+  if (gotNewFramebuffer) prevFrameWasInterlacedUpdate = false; // If we receive a new frame, forget that previous frame was interlaced to count this frame as fully progressive in statistics.
+#endif
+#ifdef PERFORMANCE_GOVERNOR
+  ApplyGovernor();
+#endif
+  UpdateSPICostModel();
+  double queuedUsecs = spiTaskMemory->spiBytesQueued * spiUsecsPerByte;
+#ifdef SIMULATOR
+  SimBeginPlanning();
+#endif
+#ifdef SHADOW_PLANNER
+  uint64_t planningCpu0 = ThreadCpuUsecs();
+#endif
+  SpanPlan progressivePlan = {}, fieldPlan = {};
+#ifdef NO_INTERLACING
+  PlanUpdate(progressivePlan, spans, framebuffer[0], framebuffer[1], false, 0, cursor);
+  interlacedUpdate = false;
+#elif defined(ALWAYS_INTERLACING)
+  PlanUpdate(fieldPlan, fieldSpans, framebuffer[0], framebuffer[1], true, 1-frameParity, cursor);
+  interlacedUpdate = (fieldPlan.head || memcmp(framebuffer[0], framebuffer[1], FRAMEBUFFER_SIZE)); // Even if this field has no changes, flip over to the other field if that one does.
+#else
+  double interlaceBudgetUsecs = tooMuchToUpdateUsecs;
+#ifdef PERFORMANCE_GOVERNOR
+  // The SoC is hot or throttled, so drop to interlacing already at a fraction of the budget, to cut the bus and CPU work of the larger
+  // updates. Small updates still go out progressively.
+  if (governorLevel == GOVERNOR_CONSTRAINED) interlaceBudgetUsecs *= GOVERNOR_CONSTRAINED_INTERLACE_BUDGET;
+#endif
+  PlanUpdate(progressivePlan, spans, framebuffer[0], framebuffer[1], false, 0, cursor);
+  interlacedUpdate = false;
+  if (queuedUsecs + progressivePlan.usecs > interlaceBudgetUsecs)
+  {
+    // Progressive update will not make it in time, so drop adaptively to interlaced updating to keep up the frame rate,
+    // unless the field would cost as much anyway (e.g. when the changes are all on the scanlines of that one field)
+    PlanUpdate(fieldPlan, fieldSpans, framebuffer[0], framebuffer[1], true, 1-frameParity, cursor);
+    interlacedUpdate = (fieldPlan.usecs < progressivePlan.usecs);
+  }
+#endif
+
+#ifdef FADE_EMULATION
+  if (fadeUpdate == FADE_ENDED && interlacedUpdate)
+  {
+    // Restoring the backlight reveals the whole display memory at once, so bring all of it up to date before that
+    PlanUpdate(progressivePlan, spans, framebuffer[0], framebuffer[1], false, 0, cursor);
+    interlacedUpdate = false;
+  }
+#endif
+#if defined(STATISTICS) && !defined(ALWAYS_INTERLACING)
+  if (gotNewFramebuffer && interlacedUpdate)
+  {
+#ifdef PERFORMANCE_GOVERNOR
+    if (queuedUsecs + progressivePlan.usecs <= tooMuchToUpdateUsecs) RecordFrameDrop(DROP_GOVERNOR, true, 1, (uint32_t)(queuedUsecs + progressivePlan.usecs), (uint32_t)tooMuchToUpdateUsecs); // Only the governor's tighter budget interlaced it
+    else
+#endif
+    // Queued work and the progressive update together went over the budget: blame whichever of the two was the larger share
+    if (queuedUsecs > progressivePlan.usecs) RecordFrameDrop(DROP_SPI_QUEUE_FULL, true, 1, (uint32_t)queuedUsecs, (uint32_t)tooMuchToUpdateUsecs);
+    else RecordFrameDrop(DROP_SPI_BANDWIDTH, true, 1, (uint32_t)progressivePlan.usecs, (uint32_t)tooMuchToUpdateUsecs);
+  }
+#endif
+  if (interlacedUpdate) frameParity = 1-frameParity; // Swap even-odd fields every second time we do an interlaced update (progressive updates ignore field order)
+  SpanPlan &plan = interlacedUpdate ? fieldPlan : progressivePlan;
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+  if (gotNewFramebuffer) RecordReducedDepthLoad(queuedUsecs + (progressivePlan.head ? progressivePlan.usecs : fieldPlan.usecs * 2), tooMuchToUpdateUsecs);
+#endif
+#ifdef SIMULATOR
+  SimEndPlanning();
+#endif
+#ifdef SHADOW_PLANNER
+  // The shadow planner decides the field to send the same way as the production planner did, before it flipped frameParity above
+  if (progressivePlan.head || fieldPlan.head)
+    SubmitShadowFrame(framebuffer[0], framebuffer[1], plan, interlacedUpdate, ThreadCpuUsecs() - planningCpu0, cursor,
+      interlacedUpdate ? frameParity : 1-frameParity, queuedUsecs, 1000000 / desiredTargetFps);
+#endif
+
+#ifdef PANEL_REFRESH_MATCHING
+  if (gotNewFramebuffer && plan.head)
+  {
+#ifdef STATISTICS
+    uint64_t holdStartTime = tick();
+#endif
+    WaitForPanelRefreshPhase();
+#ifdef STATISTICS
+    processingStartTime += tick() - holdStartTime; // Holding the update back is not work that keeps the main thread from new frames
+#endif
+  }
+#endif
+
+  int fadeBytes = 0;
+#ifdef FADE_EMULATION
+  if (fadeUpdate != FADE_UNCHANGED) fadeBytes = 2; // Command byte and brightness level
+#endif
+  int commandBytes = 0; // Display settings that go out before the pixels
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+  if (depthSwitched) commandBytes += 2; // Command byte and pixel format
+#endif
+#ifdef PANEL_REFRESH_MATCHING
+  if (refreshRateChanged) commandBytes += 3; // Command byte, DIVA and RTNA
+#endif
+
+  uint32_t frameId = 0;
+  if (plan.head || fadeBytes > 0 || commandBytes > 0)
+  {
+    frameId = nextFrameId++;
+    if (nextFrameId == 0) nextFrameId = 1; // 0 is reserved for "no frame"
+#ifdef PRESENTATION_FEEDBACK
+    // Queue the presentation event before the tasks, so that the SPI thread is guaranteed to see it when it finishes the last task.
+    // The bytes of the plan were counted by its dry run, from the same cursor position, so they match what is about to be submitted.
+    QueuePresentedFrame(frameId, spiBytesCommitted + plan.bytes + fadeBytes + commandBytes, plan.bytes + fadeBytes + commandBytes, lastCaptureTime, interlacedUpdate, skippedFrames);
+#endif
+  }
+
+  // Submit spans. A new fade level goes out before the pixels that were precompensated for it, but when a fade ends, the backlight
+  // is restored only after the display memory has been brought up to date, so that the stale undimmed image does not flash up.
+  int bytesTransferred = 0;
+#ifdef REDUCED_DEPTH_ON_OVERLOAD
+  if (depthSwitched) bytesTransferred += QueuePixelFormat();
+#endif
+#ifdef PANEL_REFRESH_MATCHING
+  if (refreshRateChanged) bytesTransferred += QueuePanelRefreshRate();
+#endif
+#ifdef FADE_EMULATION
+  if (fadeUpdate == FADE_LEVEL_CHANGED) bytesTransferred += QueueFadeLevel();
+#endif
+#ifdef SIMULATOR
+  SimBeginCopying();
+#endif
+  bytesTransferred += GenerateSpanTasks(plan, cursor, framebuffer[0], framebuffer[1], true);
+#ifdef SIMULATOR
+  SimEndCopying();
+#endif
+#ifdef FADE_EMULATION
+  if (fadeUpdate == FADE_ENDED) bytesTransferred += QueueFadeLevel();
+#endif
+  ClearDamage(interlacedUpdate, frameParity);
+#ifdef APP_PROFILES
+  UpdateAppProfile(gotNewFramebuffer, plan.bytes, interlacedUpdate);
+#endif
+
+#ifdef KERNEL_MODULE_CLIENT
+  // Wake the kernel module up to run tasks. TODO: This might not be best placed here, we could pre-empt
+  // to start running tasks already half-way during task submission above.
+  if (spiTaskMemory->queueHead != spiTaskMemory->queueTail && !(spi->cs & BCM2835_SPI0_CS_TA))
+    spi->cs |= BCM2835_SPI0_CS_TA;
+#endif
+
+  // Remember where in the command queue this frame ends, to keep track of the SPI thread's progress over it
+  if (bytesTransferred > 0)
+  {
+    prevFrameEnd = curFrameEnd;
+    curFrameEnd = spiTaskMemory->queueTail;
+  }
+
+#ifdef STATISTICS
+  mainThreadBusyUsecs += tick() - processingStartTime;
+  if (bytesTransferred > 0) predictedFrameDoneTime = tick() + (uint64_t)(queuedUsecs + plan.usecs);
+#ifdef STATISTICS_GRAPH
+  if (bytesTransferred > 0) AddStatisticsGraphSample(interlacedUpdate, skippedFrames, bytesTransferred);
+#endif
+  if (bytesTransferred > 0 && frameTimeHistorySize < FRAME_HISTORY_MAX_SIZE)
+  {
+    frameTimeHistory[frameTimeHistorySize].interlaced = interlacedUpdate || prevFrameWasInterlacedUpdate;
+    frameTimeHistory[frameTimeHistorySize++].time = tick();
+  }
+  statsBytesTransferred += bytesTransferred;
+  if (bytesTransferred > 0) ++statsFramesDisplayed;
+#endif
+
+  if (bytesTransferred == 0) return 0;
+  bytesSubmitted += bytesTransferred;
+  frameEndBytes[frameId % FRAME_ID_HISTORY] = bytesSubmitted;
+  return frameId;
+}
+
+int fbcp_frame_done(uint32_t frameId)
+{
+  if (frameId == 0) return 1;
+  if (nextFrameId - frameId > FRAME_ID_HISTORY) return 1; // At most two frames are ever in flight, so anything this old has long since been sent
+  uint64_t bytesSent = bytesSubmitted - __atomic_load_n(&spiTaskMemory->spiBytesQueued, __ATOMIC_RELAXED);
+  return bytesSent >= frameEndBytes[frameId % FRAME_ID_HISTORY];
+}
+
+int fbcp_has_pending_field()
+{
+  return interlacedUpdate;
+}
+
+void fbcp_shutdown()
+{
+  while(spiTaskMemory->queueHead != spiTaskMemory->queueTail) usleep(1000);
+#ifdef SHADOW_PLANNER
+  DeinitShadowPlanner();
+#endif
+#ifdef APP_PROFILES
+  DeinitAppProfiles();
+#endif
+#ifdef PERFORMANCE_GOVERNOR
+  DeinitGovernor();
+#endif
+#ifdef FRAME_TRACE_FILE
+  DeinitFrameTraceRecorder();
+#endif
+#ifdef WAKE_ON_INPUT
+  DeinitInputWake();
+#endif
+  DeinitSPI();
+#ifdef SPI_PIXEL_DESCRIPTORS
+  for(int i = 0; i < SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS; ++i)
+  {
+    free(pixelFramebuffers[i]);
+    pixelFramebuffers[i] = 0;
+  }
+#else
+  free(framebuffer[0]);
+#endif
+  free(framebuffer[1]);
+  framebuffer[0] = framebuffer[1] = 0;
+  DeinitStatistics();
+  DeinitLog();
+}
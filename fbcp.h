@@ -0,0 +1,51 @@
+#pragma once
+
+#include <inttypes.h>
+
+// libfbcp: the diff, span planner, SPI task ring and SPI feeder as an in-process library. Applications that already have each
+// finished frame in memory (e.g. emulators) can link to this directly and push frames to the display as soon as they are done,
+// instead of routing them through HDMI and having fbcp-ili9341 poll for them with vc_dispmanx_snapshot().
+// All functions are to be called from a single application thread.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A dirty rectangle of a submitted frame, in display pixel coordinates: [x, x+width[ * [y, y+height[.
+typedef struct fbcp_rect
+{
+  int x, y, width, height;
+} fbcp_rect;
+
+// Initializes the SPI bus and the display, and starts the SPI feeder thread. Returns 0 on success.
+int fbcp_init(void);
+
+// Submits a new RGB565 frame of DISPLAY_WIDTH x DISPLAY_HEIGHT pixels to be shown on the display. stride is the distance between
+// scanlines in bytes. If damage is non-null, only the numDamageRects given rectangles are assumed to have changed since the
+// previously submitted frame, otherwise the whole frame is diffed. If the SPI bus cannot keep up, the update may be sent as
+// only one interlaced field; call fbcp_submit_frame() with frame=0 to send the remaining field of the previous frame.
+// Blocks if the SPI task queue already holds two frames. Returns an id for the frame, or 0 if there was nothing to send.
+uint32_t fbcp_submit_frame(const uint16_t *frame, int stride, const fbcp_rect *damage, int numDamageRects);
+
+// Like fbcp_submit_frame(), but additionally specifies the time the frame was captured or rendered, in usecs in the time base of
+// CLOCK_REALTIME, and the number of source frames that were dropped since the previous submitted frame. These are reported back
+// in the presentation feedback events when built with PRESENTATION_FEEDBACK (see presentation.h).
+uint32_t fbcp_submit_captured_frame(const uint16_t *frame, int stride, const fbcp_rect *damage, int numDamageRects, uint64_t captureTime, int skippedFrames);
+
+// Blocks until the SPI task queue has room for a new frame, which fbcp_submit_frame() also does first. Applications that pick the
+// frame to submit from a stream of frames can call this before picking, so that they submit the newest one.
+void fbcp_wait_for_queue(void);
+
+// Returns nonzero if the frame with the given id has been fully sent over the SPI bus to the display.
+int fbcp_frame_done(uint32_t frameId);
+
+// Returns nonzero if the most recent update was an interlaced field, and the other field is still pending to be sent.
+int fbcp_has_pending_field(void);
+
+// Waits for all submitted frames to finish, stops the SPI feeder thread and all other background threads that fbcp_init() started,
+// and releases the SPI bus. fbcp_init() can be called again afterwards.
+void fbcp_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
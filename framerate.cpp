@@ -0,0 +1,104 @@
+#include <stdlib.h>
+
+#include "config.h"
+#include "framerate.h"
+#include "display.h"
+#include "tick.h"
+#include "util.h"
+#include "input.h"
+
+int frameTimeHistorySize = 0;
+
+FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
+
+// Since we are polling for received GPU frames, run a histogram to predict when the next frame will arrive.
+// The histogram needs to be sufficiently small as to not cause a lag when frame rate suddenly changes on e.g.
+// main menu <-> ingame transitions
+#define HISTOGRAM_SIZE 30
+uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
+uint64_t frameArrivalTimesTail = 0;
+uint64_t lastFramePollTime = 0;
+int histogramSize = 0;
+
+// Returns Nth most recent entry in the frame times histogram, 0 = most recent, (histogramSize-1) = oldest
+#define GET_HISTOGRAM(idx) frameArrivalTimes[(frameArrivalTimesTail - 1 - (idx) + HISTOGRAM_SIZE) % HISTOGRAM_SIZE]
+
+void AddHistogramSample()
+{
+  frameArrivalTimes[frameArrivalTimesTail] = tick();
+  frameArrivalTimesTail = (frameArrivalTimesTail + 1) % HISTOGRAM_SIZE;
+  if (histogramSize < HISTOGRAM_SIZE) ++histogramSize;
+}
+
+void SeedFrameRateHistogram(uint64_t interval)
+{
+  uint64_t now = tick();
+  for(int i = 0; i < HISTOGRAM_SIZE; ++i) frameArrivalTimes[i] = now - (HISTOGRAM_SIZE - 1 - i) * interval;
+  frameArrivalTimesTail = 0;
+  histogramSize = HISTOGRAM_SIZE;
+}
+
+bool FrameRateHistogramFull()
+{
+  return histogramSize == HISTOGRAM_SIZE;
+}
+
+int cmp(const void *e1, const void *e2) { return *(uint64_t*)e1 > *(uint64_t*)e2; }
+
+uint64_t EstimateFrameRateInterval()
+{
+  if (histogramSize == 0) return 1000000/TARGET_FRAME_RATE;
+  uint64_t mostRecentFrame = GET_HISTOGRAM(0);
+
+  // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
+  uint64_t timeNow = tick();
+#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
+  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
+  if (timeNow - mostRecentFrame > 100000) return 100000; // if it's been more than 100ms since last seen update, assume interval of 100ms.
+  if (histogramSize < HISTOGRAM_SIZE) return 1000000/TARGET_FRAME_RATE; // Too few frames seen yet to tell the frame rate of the content
+#ifndef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
+  return 1000000/TARGET_FRAME_RATE;
+#endif
+#endif
+
+  // Look at the intervals of all previous arrived frames, and take their 40% percentile as our expected current frame rate
+  uint64_t intervals[HISTOGRAM_SIZE-1];
+  for(int i = 0; i < histogramSize-1; ++i)
+    intervals[i] = GET_HISTOGRAM(i) - GET_HISTOGRAM(i+1);
+  qsort(intervals, histogramSize-1, sizeof(uint64_t), cmp);
+  uint64_t interval = intervals[(histogramSize-1)*2/5];
+
+  // With bad luck, we may actually have synchronized to observing every second update, so halve the computed interval if it looks like a long period of time
+  if (interval >= 2000000/TARGET_FRAME_RATE) interval /= 2;
+  if (interval > 100000) interval = 100000;
+  return MAX(interval, 1000000/TARGET_FRAME_RATE);
+
+}
+
+uint64_t PredictNextFrameArrivalTime()
+{
+  uint64_t mostRecentFrame = histogramSize > 0 ? GET_HISTOGRAM(0) : tick();
+
+  // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
+  uint64_t timeNow = tick();
+#ifdef WAKE_ON_INPUT
+  // Right after user input, poll at the full frame rate, so that the first reaction to it on screen is not held back by idle polling
+  if (InputBoostActive()) return lastFramePollTime + 1000000/TARGET_FRAME_RATE;
+#endif
+#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
+  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
+  if (timeNow - mostRecentFrame > 100000) return lastFramePollTime + 100000; // if it's been more than 100ms since last seen update, assume interval of 100ms.
+#endif
+  uint64_t interval = EstimateFrameRateInterval();
+
+  // Assume that frames are arriving at times mostRecentFrame + k * interval.
+  // Find integer k such that mostRecentFrame + k * interval >= timeNow
+  // i.e. k = ceil((timeNow - mostRecentFrame) / interval)
+  uint64_t k = (timeNow - mostRecentFrame + interval - 1) / interval;
+  uint64_t nextFrameArrivalTime = mostRecentFrame + k * interval;
+  uint64_t timeOfPreviousMissedFrame = nextFrameArrivalTime - interval;
+
+  // If there should have been a frame just 1/3rd of our interval window ago, assume it was just missed and report back "the next frame is right now"
+  if (timeNow - timeOfPreviousMissedFrame < interval/3 && timeOfPreviousMissedFrame > mostRecentFrame) return timeNow;
+  else return nextFrameArrivalTime;
+}
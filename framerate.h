@@ -0,0 +1,27 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Tracks the arrival times of source frames to estimate the frame rate of the content being displayed,
+// and the times that frames were submitted to the display to compute the displayed frame rate.
+void AddHistogramSample();
+uint64_t EstimateFrameRateInterval();
+uint64_t PredictNextFrameArrivalTime();
+
+extern uint64_t lastFramePollTime;
+
+// Fills the frame arrival histogram with frames at the given interval, as if they had been arriving so until now, so that the
+// prediction starts out from a known cadence instead of waiting for the histogram to fill up.
+void SeedFrameRateHistogram(uint64_t interval);
+bool FrameRateHistogramFull(void); // True once the histogram has enough frames for the frame rate estimate to follow the content
+
+#define FRAME_HISTORY_MAX_SIZE 240
+extern int frameTimeHistorySize;
+
+struct FrameHistory
+{
+  uint64_t time;
+  bool interlaced;
+};
+
+extern FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE];
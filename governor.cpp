@@ -0,0 +1,139 @@
+#include "config.h"
+#include "governor.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "spi.h"
+#include "statistics.h"
+#include "log.h"
+#include "thread.h"
+#include "tick.h"
+#include "util.h"
+
+static int ReadIntFromFile(const char *filename)
+{
+  FILE *handle = fopen(filename, "r");
+  if (!handle) return 0;
+  char t[32] = {};
+  int n = fread(t, 1, sizeof(t)-1, handle);
+  fclose(handle);
+  return n > 0 ? atoi(t) : 0;
+}
+
+void ReadSoCSensors(SoCSensors *sensors)
+{
+  memset(sensors, 0, sizeof(SoCSensors));
+#ifdef SIMULATOR
+  sensors->temperature = 50.0;
+  sensors->coreClock = SimCoreClock();
+  return;
+#endif
+  sensors->temperature = ReadIntFromFile("/sys/class/thermal/thermal_zone0/temp") / 1000.0;
+  sensors->cpuFrequency = ReadIntFromFile("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq") / 1000;
+
+  // Core clock and throttling status from the firmware, in output lines "frequency(1)=400000000" and "throttled=0x0"
+  FILE *handle = popen("vcgencmd measure_clock core; vcgencmd get_throttled", "r");
+  if (!handle) return;
+  char line[64];
+  while(fgets(line, sizeof(line), handle))
+  {
+    char *value = strchr(line, '=');
+    if (!value) continue;
+    if (!strncmp(line, "frequency", 9)) sensors->coreClock = atoi(value+1) / 1000000;
+    else if (!strncmp(line, "throttled", 9)) sensors->throttled = (strtoul(value+1, 0, 16) & 0x6) != 0; // Bit 1: ARM frequency capped, bit 2: currently throttled
+  }
+  pclose(handle);
+}
+
+#ifdef PERFORMANCE_GOVERNOR
+
+volatile int governorLevel = GOVERNOR_FULL_QUALITY;
+volatile int governorCoreClock = 0;
+#ifdef STATISTICS
+volatile int statsGovernorTransitions = 0;
+#endif
+static SoCSensors latestSensors = {};
+static pthread_mutex_t latestSensorsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t governorThread;
+static bool governorThreadRunning = false;
+static volatile int governorThreadQuit = 0;
+
+void *governor_thread(void *unused)
+{
+  RegisterStatisticsThread("gov");
+  uint64_t lastPressureTime = 0;
+  for(;;)
+  {
+    SoCSensors sensors;
+    ReadSoCSensors(&sensors);
+    pthread_mutex_lock(&latestSensorsLock);
+    latestSensors = sensors;
+    pthread_mutex_unlock(&latestSensorsLock);
+    uint64_t now = tick();
+    if (sensors.coreClock > 0) __atomic_store_n(&governorCoreClock, sensors.coreClock, __ATOMIC_RELAXED);
+
+    // Drop to the constrained level as soon as the SoC gets hot or throttled, but only come back once it has stayed comfortably
+    // cool and unthrottled for a while, so that the pipeline does not flip back and forth right at the threshold.
+    int level = governorLevel;
+    bool underPressure = sensors.temperature >= GOVERNOR_HOT_TEMPERATURE || sensors.throttled;
+    if (underPressure)
+    {
+      lastPressureTime = now;
+      level = GOVERNOR_CONSTRAINED;
+    }
+    else if (level == GOVERNOR_CONSTRAINED && sensors.temperature <= GOVERNOR_HOT_TEMPERATURE - GOVERNOR_HYSTERESIS && now - lastPressureTime >= GOVERNOR_RESTORE_DELAY)
+      level = GOVERNOR_FULL_QUALITY;
+
+    if (level != governorLevel)
+    {
+      LogMessage(LOG_INFO, "Governor: %s (temperature %.1fC, core clock %dMHz%s)", level == GOVERNOR_CONSTRAINED ? "tightening the interlacing budget and reducing GPU polling" : "restoring full quality",
+        sensors.temperature, sensors.coreClock, sensors.throttled ? ", throttled" : "");
+      __atomic_store_n(&governorLevel, level, __ATOMIC_RELAXED);
+#ifdef STATISTICS
+      __atomic_fetch_add(&statsGovernorTransitions, 1, __ATOMIC_RELAXED);
+#endif
+    }
+    if (SleepUnlessQuit(&governorThreadQuit, GOVERNOR_POLL_INTERVAL)) break;
+  }
+  return 0;
+}
+
+void InitGovernor()
+{
+  governorLevel = GOVERNOR_FULL_QUALITY;
+  governorThreadQuit = 0;
+  int rc = pthread_create(&governorThread, NULL, governor_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create governor thread!");
+  governorThreadRunning = true;
+}
+
+void DeinitGovernor()
+{
+  if (!governorThreadRunning) return;
+  StopThread(governorThread, &governorThreadQuit);
+  governorThreadRunning = false;
+}
+
+void ReadLatestSoCSensors(SoCSensors *sensors)
+{
+  pthread_mutex_lock(&latestSensorsLock);
+  *sensors = latestSensors;
+  pthread_mutex_unlock(&latestSensorsLock);
+}
+
+void ApplyGovernor()
+{
+  static int appliedCoreClock = 0;
+  int coreClock = __atomic_load_n(&governorCoreClock, __ATOMIC_RELAXED);
+  if (coreClock > 0 && coreClock != appliedCoreClock)
+  {
+    RescaleSPICostModel(coreClock);
+    appliedCoreClock = coreClock;
+  }
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+// Readings of the SoC temperature and clocks.
+struct SoCSensors
+{
+  double temperature; // CPU temperature in degrees Celsius, or 0 if not available
+  int cpuFrequency; // Current ARM CPU clock in MHz, or 0 if not available
+  int coreClock; // Current VideoCore core clock in MHz, which the SPI bus clock is divided from, or 0 if not available
+  bool throttled; // True if the firmware is currently capping clocks due to temperature or undervoltage
+};
+
+// Samples the SoC sensors. This spawns vcgencmd, so it takes several msecs, call on a background thread.
+void ReadSoCSensors(SoCSensors *sensors);
+
+#ifdef PERFORMANCE_GOVERNOR
+
+// When the SoC heats up or gets throttled, the SPI clock drops with the core clock and the CPU slows down, so frames start missing
+// their deadlines. The governor thread watches the sensors, and moves the pipeline to cheaper modes before that happens.
+enum GovernorLevel
+{
+  GOVERNOR_FULL_QUALITY = 0, // Progressive updates whenever they fit the frame budget, GPU polled at full rate
+  GOVERNOR_CONSTRAINED = 1 // Updates interlaced at GOVERNOR_CONSTRAINED_INTERLACE_BUDGET of the usual budget, GPU polled at most GOVERNOR_CONSTRAINED_POLL_RATE times per second
+};
+
+extern volatile int governorLevel;
+extern volatile int governorCoreClock; // Most recently observed core clock in MHz, 0 if unknown
+
+void InitGovernor(void);
+void DeinitGovernor(void);
+
+// The most recent sample of the governor thread, which is all zeros until the first one. Lets the statistics show the sensors without
+// spawning vcgencmd a second time.
+void ReadLatestSoCSensors(SoCSensors *sensors);
+
+// Called on the main thread before planning an update, applies the latest core clock to the SPI bus cost model.
+void ApplyGovernor(void);
+
+#ifdef STATISTICS
+extern volatile int statsGovernorTransitions; // Number of times the governor has changed level
+#endif
+
+#endif
@@ -1,9 +1,17 @@
+#ifdef SIMULATOR
+#include "sim.h"
+#else
 #include <bcm_host.h>
+#endif
 
+#include <errno.h>
 #include <linux/futex.h>
+#include <math.h>
 #include <sys/syscall.h>
 #include <syslog.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
 
 #include "config.h"
 #include "gpu.h"
@@ -11,138 +19,179 @@
 #include "tick.h"
 #include "util.h"
 #include "statistics.h"
+#include "governor.h"
+#include "trace.h"
+#include "input.h"
+#include "log.h"
 
 DISPMANX_DISPLAY_HANDLE_T display;
 DISPMANX_RESOURCE_HANDLE_T screen_resource;
 VC_RECT_T rect;
 
-int frameTimeHistorySize = 0;
-
-FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
-
 uint16_t *videoCoreFramebuffer[2] = {};
 volatile int numNewGpuFrames = 0;
-
-int displayXOffset = 0;
-int displayYOffset = 0;
+volatile uint64_t videoCoreFrameCaptureTime = 0;
+#ifdef STATISTICS
+volatile int numMissedGpuFrames = 0;
+volatile uint32_t lastMissedGpuPollGap = 0;
+#endif
 
 #ifdef USE_GPU_VSYNC
 
-volatile /*bool*/uint32_t gpuFrameAvailable = 0;
+static volatile int numVsyncs = 0; // Futex that the GPU polling thread waits on while locked to vsync, bumped on every vsync
+static volatile uint64_t lastVsyncTime = 0;
+static volatile uint32_t vsyncPeriod = 1000000/60; // Running average of the measured vsync interval, in usecs
 
 void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
 {
-  __atomic_store_n(&gpuFrameAvailable, 1, __ATOMIC_SEQ_CST);
-  syscall(SYS_futex, &gpuFrameAvailable, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread to process a new frame
-}
-
-uint64_t EstimateFrameRateInterval()
-{
-  return 1000000/60;
+  uint64_t now = tick();
+  uint64_t prev = __atomic_load_n(&lastVsyncTime, __ATOMIC_RELAXED);
+  uint32_t period = __atomic_load_n(&vsyncPeriod, __ATOMIC_RELAXED);
+  if (prev && now - prev < 2*period) __atomic_store_n(&vsyncPeriod, (uint32_t)((int64_t)period + ((int64_t)(now - prev) - period) / 16), __ATOMIC_RELAXED);
+  __atomic_store_n(&lastVsyncTime, now, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&numVsyncs, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &numVsyncs, FUTEX_WAKE, 1, 0, 0, 0); // Wake the GPU polling thread to snapshot at the learned phase
 }
 
-#else // !USE_GPU_VSYNC
-
-// Since we are polling for received GPU frames, run a histogram to predict when the next frame will arrive.
-// The histogram needs to be sufficiently small as to not cause a lag when frame rate suddenly changes on e.g.
-// main menu <-> ingame transitions
-#define HISTOGRAM_SIZE 30
-uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
-uint64_t frameArrivalTimesTail = 0;
-uint64_t lastFramePollTime = 0;
-int histogramSize = 0;
-
-// Returns Nth most recent entry in the frame times histogram, 0 = most recent, (histogramSize-1) = oldest
-#define GET_HISTOGRAM(idx) frameArrivalTimes[(frameArrivalTimesTail - 1 - (idx) + HISTOGRAM_SIZE) % HISTOGRAM_SIZE]
-
-void AddHistogramSample()
+// Phase lock state, only touched by the GPU polling thread
+static bool vsyncPhaseLocked = false;
+static double capturePhase = 0; // Usecs after vsync at which to snapshot while locked
+static double phaseCos = 0, phaseSin = 0; // Running average of the phases of new frames as unit vectors, |(phaseCos, phaseSin)| is their coherence
+static int numPhaseSamples = 0;
+static double captureMissRate = 0; // Running average of how often a snapshot at the learned phase missed the new frame
+static int lastNewFrameVsync = 0; // Vsync that the most recent new frame was found after
+static int captureVsync = -1; // Vsync that the current capture attempts are for
+static bool firstCaptureAttempt = false; // True if the snapshot being taken is the first one at the learned phase of its vsync
+static bool captureMissed = false; // True if the most recent snapshot found no new frame
+static double missedCapturePhase = 0; // Phase of the most recent snapshot that found no new frame
+
+static void UnlockVsyncPhase(const char *reason)
 {
-  frameArrivalTimes[frameArrivalTimesTail] = tick();
-  frameArrivalTimesTail = (frameArrivalTimesTail + 1) % HISTOGRAM_SIZE;
-  if (histogramSize < HISTOGRAM_SIZE) ++histogramSize;
+  if (!vsyncPhaseLocked) return;
+  vsyncPhaseLocked = false;
+  numPhaseSamples = 0;
+  phaseCos = phaseSin = 0;
+  LogMessage(LOG_INFO, "Capture unlocked from vsync: %s, falling back to frame arrival prediction", reason);
 }
 
-int cmp(const void *e1, const void *e2) { return *(uint64_t*)e1 > *(uint64_t*)e2; }
-
-uint64_t EstimateFrameRateInterval()
+// While locked, sleeps until the learned phase of the next vsync that a new frame is expected on, or until the retry of a snapshot
+// that missed. Returns false if the lock was dropped while waiting.
+static bool WaitForVsyncCapturePhase()
 {
-  if (histogramSize == 0) return 1000000/TARGET_FRAME_RATE;
-  uint64_t mostRecentFrame = GET_HISTOGRAM(0);
-
-  // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
-  uint64_t timeNow = tick();
-#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
-  if (timeNow - mostRecentFrame > 100000) return 100000; // if it's been more than 100ms since last seen update, assume interval of 100ms.
-  if (histogramSize <= HISTOGRAM_SIZE) return 1000000/TARGET_FRAME_RATE;
-#ifndef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
-  return 1000000/TARGET_FRAME_RATE;
-#endif
-#endif
-
-  // Look at the intervals of all previous arrived frames, and take their 40% percentile as our expected current frame rate
-  uint64_t intervals[HISTOGRAM_SIZE-1];
-  for(int i = 0; i < histogramSize-1; ++i)
-    intervals[i] = GET_HISTOGRAM(i) - GET_HISTOGRAM(i+1);
-  qsort(intervals, histogramSize-1, sizeof(uint64_t), cmp);
-  uint64_t interval = intervals[(histogramSize-1)*2/5];
-
-  // With bad luck, we may actually have synchronized to observing every second update, so halve the computed interval if it looks like a long period of time
-  if (interval >= 2000000/TARGET_FRAME_RATE) interval /= 2;
-  if (interval > 100000) interval = 100000;
-  return MAX(interval, 1000000/TARGET_FRAME_RATE);
+  uint32_t period = __atomic_load_n(&vsyncPeriod, __ATOMIC_RELAXED);
+  int vsync = __atomic_load_n(&numVsyncs, __ATOMIC_ACQUIRE);
+  uint64_t now = tick();
+  if (vsync == captureVsync && captureMissed && now + VSYNC_RETRY_USECS < __atomic_load_n(&lastVsyncTime, __ATOMIC_RELAXED) + period)
+  {
+    usleep(VSYNC_RETRY_USECS); // The snapshot at the learned phase missed, try again a bit later on the same vsync
+    firstCaptureAttempt = false;
+    return true;
+  }
 
+  // Content that updates on every Nth vsync does not need to be polled on the vsyncs in between
+  int vsyncsPerFrame = MAX(1, (int)((EstimateFrameRateInterval() + period/2) / period));
+  while(vsync == captureVsync || vsync - lastNewFrameVsync < vsyncsPerFrame)
+  {
+    struct timespec timeout = { 0, 100000000 };
+    if (syscall(SYS_futex, &numVsyncs, FUTEX_WAIT, vsync, &timeout, 0, 0) < 0 && errno == ETIMEDOUT)
+    {
+      UnlockVsyncPhase("no vsync signal");
+      return false;
+    }
+    vsync = __atomic_load_n(&numVsyncs, __ATOMIC_ACQUIRE);
+  }
+  uint64_t captureTime = __atomic_load_n(&lastVsyncTime, __ATOMIC_RELAXED) + (uint64_t)capturePhase;
+  now = tick();
+  if (captureTime > now) usleep(captureTime - now);
+  captureVsync = vsync;
+  firstCaptureAttempt = true;
+  return true;
 }
 
-uint64_t PredictNextFrameArrivalTime()
+// Learns the phase of the content relative to vsync from the outcome of a snapshot taken at time t0.
+static void UpdateVsyncPhaseLock(uint64_t t0, bool gotNewFramebuffer)
 {
-  uint64_t mostRecentFrame = histogramSize > 0 ? GET_HISTOGRAM(0) : tick();
+  uint32_t period = __atomic_load_n(&vsyncPeriod, __ATOMIC_RELAXED);
+  uint64_t vsyncTime = __atomic_load_n(&lastVsyncTime, __ATOMIC_RELAXED);
+  if (!vsyncTime) return; // No vsync signal
+  captureMissed = !gotNewFramebuffer;
+  double phase = (double)((t0 + period - vsyncTime % period) % period); // Snapshot time relative to the most recent vsync
+  if (gotNewFramebuffer)
+  {
+    lastNewFrameVsync = __atomic_load_n(&numVsyncs, __ATOMIC_ACQUIRE);
+    double angle = 2 * M_PI * phase / period;
+    // A plain mean over the first VSYNC_LOCK_MIN_FRAMES phases, so that coherent frames can lock right after that many, and a
+    // running average over the most recent ones after that
+    if (numPhaseSamples < VSYNC_LOCK_MIN_FRAMES) ++numPhaseSamples;
+    phaseCos += (cos(angle) - phaseCos) / numPhaseSamples;
+    phaseSin += (sin(angle) - phaseSin) / numPhaseSamples;
+  }
 
-  // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
-  uint64_t timeNow = tick();
-#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
-  if (timeNow - mostRecentFrame > 100000) return lastFramePollTime + 100000; // if it's been more than 100ms since last seen update, assume interval of 100ms.
-#endif
-  uint64_t interval = EstimateFrameRateInterval();
-
-  // Assume that frames are arriving at times mostRecentFrame + k * interval.
-  // Find integer k such that mostRecentFrame + k * interval >= timeNow
-  // i.e. k = ceil((timeNow - mostRecentFrame) / interval)
-  uint64_t k = (timeNow - mostRecentFrame + interval - 1) / interval;
-  uint64_t nextFrameArrivalTime = mostRecentFrame + k * interval;
-  uint64_t timeOfPreviousMissedFrame = nextFrameArrivalTime - interval;
-
-  // If there should have been a frame just 1/3rd of our interval window ago, assume it was just missed and report back "the next frame is right now"
-  if (timeNow - timeOfPreviousMissedFrame < interval/3 && timeOfPreviousMissedFrame > mostRecentFrame) return timeNow;
-  else return nextFrameArrivalTime;
+  if (vsyncPhaseLocked)
+  {
+    if (firstCaptureAttempt) captureMissRate += ((gotNewFramebuffer ? 0.0 : 1.0) - captureMissRate) / VSYNC_LOCK_MIN_FRAMES;
+    if (!gotNewFramebuffer) missedCapturePhase = phase;
+    else if (firstCaptureAttempt) capturePhase = MAX(0.0, capturePhase - VSYNC_PHASE_STEP_USECS);
+    else capturePhase = (missedCapturePhase < phase) ? (missedCapturePhase + phase) / 2 : phase; // The frame arrived in between the two snapshots
+    if (captureMissRate > VSYNC_UNLOCK_MISS_RATE) UnlockVsyncPhase("content is not locked to vsync");
+  }
+  else if (numPhaseSamples >= VSYNC_LOCK_MIN_FRAMES && sqrt(phaseCos*phaseCos + phaseSin*phaseSin) >= VSYNC_LOCK_COHERENCE)
+  {
+    // Start from the mean phase at which the frames were found, the phase steps then walk it down to when they actually arrive
+    double meanPhase = atan2(phaseSin, phaseCos) * period / (2 * M_PI);
+    capturePhase = (meanPhase < 0) ? meanPhase + period : meanPhase;
+    captureMissRate = 0;
+    captureVsync = -1;
+    vsyncPhaseLocked = true;
+    LogMessage(LOG_INFO, "Capture locked to vsync, snapshotting %.2f msecs after vsync, every %d vsyncs", capturePhase / 1000.0,
+      MAX(1, (int)((EstimateFrameRateInterval() + period/2) / period)));
+  }
 }
 
-#endif // ~USE_GPU_VSYNC
+#endif
 
 void *gpu_polling_thread(void*)
 {
+  RegisterStatisticsThread("gpu");
   uint64_t lastNewFrameReceivedTime = tick();
   for(;;)
   {
-#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
-    const int64_t earlyFramePrediction = 500;
-    uint64_t earliestNextFrameArrivaltime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE - earlyFramePrediction;
-    uint64_t now = tick();
-    if (now < earliestNextFrameArrivaltime)
+#ifdef USE_GPU_VSYNC
+    if (!vsyncPhaseLocked || !WaitForVsyncCapturePhase())
+#endif
     {
-      usleep(earliestNextFrameArrivaltime - now);
-    }
+#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+      const int64_t earlyFramePrediction = 500;
+      uint64_t earliestNextFrameArrivaltime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE - earlyFramePrediction;
+      uint64_t now = tick();
+      if (now < earliestNextFrameArrivaltime)
+      {
+        usleep(earliestNextFrameArrivaltime - now);
+      }
 #endif
 
 #if defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
-    uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
-    int64_t timeToSleep = nextFrameArrivalTime - tick();
-    const int64_t minimumSleepTime = 2500; // Don't sleep if the next frame is expected to arrive in less than this much time
-    if (timeToSleep > minimumSleepTime)
-    {
-      usleep(timeToSleep - minimumSleepTime);
+      uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
+      int64_t timeToSleep = nextFrameArrivalTime - tick();
+      const int64_t minimumSleepTime = 2500; // Don't sleep if the next frame is expected to arrive in less than this much time
+      if (timeToSleep > minimumSleepTime)
+      {
+#ifdef WAKE_ON_INPUT
+        SleepUntilInput(timeToSleep - minimumSleepTime); // An input event cuts an idle sleep short, since the screen is about to react to it
+#else
+        usleep(timeToSleep - minimumSleepTime);
+#endif
+      }
+#endif
     }
+
+#ifdef PERFORMANCE_GOVERNOR
+    // When the SoC is hot or throttled, cap the rate of snapshots, each of which costs ~1msec of CPU and GPU time
+    static uint64_t lastPollTime = 0;
+    uint64_t sinceLastPoll = tick() - lastPollTime;
+    if (governorLevel == GOVERNOR_CONSTRAINED && sinceLastPoll < 1000000/GOVERNOR_CONSTRAINED_POLL_RATE)
+      usleep(1000000/GOVERNOR_CONSTRAINED_POLL_RATE - sinceLastPoll);
+    lastPollTime = tick();
 #endif
 
    uint64_t t0 = tick();
@@ -154,9 +203,10 @@ void *gpu_polling_thread(void*)
     // Profiling, the following two lines take around ~1msec of time.
     vc_dispmanx_snapshot(display, screen_resource, (DISPMANX_TRANSFORM_T)0);
     vc_dispmanx_resource_read_data(screen_resource, &rect, videoCoreFramebuffer[0], SCANLINE_SIZE);
-#ifndef USE_GPU_VSYNC
-    lastFramePollTime = t0;
+#ifdef STATISTICS
+    uint64_t prevPollTime = lastFramePollTime, prevNewFrameTime = lastNewFrameReceivedTime;
 #endif
+    lastFramePollTime = t0;
 
     // Check the pixel contents of the snapshot to see if we actually received a new frame to render
     bool gotNewFramebuffer = false;
@@ -168,6 +218,10 @@ void *gpu_polling_thread(void*)
         break;
       }
 
+#ifdef USE_GPU_VSYNC
+    UpdateVsyncPhaseLock(t0, gotNewFramebuffer);
+#endif
+
     uint64_t t1 = tick();
     if (!gotNewFramebuffer)
     {
@@ -178,7 +232,20 @@ void *gpu_polling_thread(void*)
     }
     else
     {
+#ifdef STATISTICS
+      // If the content was animating, and the GPU then went unpolled for longer than a frame interval, frames came and went unseen
+      uint64_t interval = EstimateFrameRateInterval();
+      if (prevPollTime && prevNewFrameTime + 2*interval >= prevPollTime && t0 - prevPollTime > interval*3/2)
+      {
+        __atomic_store_n(&lastMissedGpuPollGap, (uint32_t)(t0 - prevPollTime), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&numMissedGpuFrames, (int)((t0 - prevPollTime + interval/2) / interval) - 1, __ATOMIC_RELAXED);
+      }
+#endif
+#ifdef FRAME_TRACE_FILE
+      RecordFrameTrace(videoCoreFramebuffer[0], t0);
+#endif
       memcpy(videoCoreFramebuffer[1], videoCoreFramebuffer[0], FRAMEBUFFER_SIZE);
+      __atomic_store_n(&videoCoreFrameCaptureTime, t0, __ATOMIC_RELAXED);
       __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
       syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was sleeping to get a new frame
     }
@@ -220,8 +287,7 @@ void InitGPU()
     displayXOffset = (DISPLAY_WIDTH - scaledWidth) / 2;
   }
 
-  syslog(LOG_INFO, "GPU display is %dx%d. SPI display is %dx%d. Applying scaling factor %.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, scalingFactor, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
-  printf("GPU display is %dx%d. SPI display is %dx%d. Applying scaling factor %.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d\n", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, scalingFactor, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
+  LogMessage(LOG_INFO, "GPU display is %dx%d. SPI display is %dx%d. Applying scaling factor %.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, scalingFactor, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
 
   uint32_t image_prt;
   screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledWidth, scaledHeight, &image_prt);
@@ -234,7 +300,8 @@ void InitGPU()
 
 #ifdef USE_GPU_VSYNC
   // Register to receive vsync notifications. This is a heuristic, since the application might not be locked at vsync, and even
-  // if it was, this signal is not a guaranteed edge trigger for availability of new frames.
+  // if it was, this signal is not a guaranteed edge trigger for availability of new frames, so the phase of the frames relative
+  // to it is learned, and capturing only locks to it while the frames keep arriving at that phase.
   vc_dispmanx_vsync_callback(display, VsyncCallback, 0);
 #endif
 }
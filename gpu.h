@@ -2,23 +2,15 @@
 
 #include <inttypes.h>
 
+#include "config.h"
+#include "framerate.h"
+
 void InitGPU();
-void AddHistogramSample();
-uint64_t EstimateFrameRateInterval();
-uint64_t PredictNextFrameArrivalTime();
 
 extern uint16_t *videoCoreFramebuffer[2];
 extern volatile int numNewGpuFrames;
-extern int displayXOffset;
-extern int displayYOffset;
-
-#define FRAME_HISTORY_MAX_SIZE 240
-extern int frameTimeHistorySize;
-
-struct FrameHistory
-{
-  uint64_t time;
-  bool interlaced;
-};
-
-extern FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE];
+extern volatile uint64_t videoCoreFrameCaptureTime; // Time when the most recent new frame was snapshotted from the GPU
+#ifdef STATISTICS
+extern volatile int numMissedGpuFrames; // Source frames estimated to have come and gone between two polls, taken by the main thread
+extern volatile uint32_t lastMissedGpuPollGap; // Usecs between the two polls that the most recently missed frames fell between
+#endif
@@ -25,12 +25,16 @@ void InitILI9341()
 #endif
     SPI_TRANSFER(0x36/*MADCTL: Memory Access Control*/, madctl);
 
-    SPI_TRANSFER(0x3A/*COLMOD: Pixel Format Set*/, 0x55/*DPI=16bits/pixel,DBI=16bits/pixel*/);
-    SPI_TRANSFER(0xB1/*Frame Rate Control (In Normal Mode/Full Colors)*/, 0x00/*DIVA=fosc*/, 0x18/*RTNA(Frame Rate)=79Hz*/);
+    SPI_TRANSFER(DISPLAY_SET_PIXEL_FORMAT/*COLMOD: Pixel Format Set*/, DISPLAY_PIXEL_FORMAT_16BPP);
+    SPI_TRANSFER(DISPLAY_FRAME_RATE_CONTROL/*Frame Rate Control (In Normal Mode/Full Colors)*/, 0x00/*DIVA=fosc*/, 0x18/*RTNA(Frame Rate)=79Hz*/);
     SPI_TRANSFER(0xB6/*Display Function Control*/, 0x08/*PTG=Interval Scan,PT=V63/V0/VCOML/VCOMH*/, 0x82/*REV=1(Normally white),ISC(Scan Cycle)=5 frames*/, 0x27/*LCD Driver Lines=320*/);
     SPI_TRANSFER(0x26/*Gamma Set*/, 0x01/*Gamma curve 1 (G2.2)*/);
     SPI_TRANSFER(0xE0/*Positive Gamma Correction*/, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08, 0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E, 0x09, 0x00);
     SPI_TRANSFER(0xE1/*Negative Gamma Correction*/, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, 0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F);
+#ifdef FADE_EMULATION
+    SPI_TRANSFER(DISPLAY_WRITE_BRIGHTNESS, 0xFF);
+    SPI_TRANSFER(0x53/*Write CTRL Display*/, 0x24/*BCTRL=1(Brightness control on),BL=1(Backlight on)*/);
+#endif
     SPI_TRANSFER(0x11/*Sleep Out*/);
     usleep(120 * 1000);
     SPI_TRANSFER(/*Display ON*/0x29);
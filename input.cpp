@@ -0,0 +1,244 @@
+#include "config.h"
+#include "input.h"
+
+#ifdef WAKE_ON_INPUT
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/input.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "statistics.h"
+#include "log.h"
+#include "tick.h"
+#include "util.h"
+
+#define INPUT_DEVICE_DIRECTORY "/dev/input"
+#define INPUT_MAX_DEVICES 32
+
+static volatile int numInputEvents = 0; // Futex that SleepUntilInput() waits on, bumped on every batch of input events
+static volatile uint64_t lastInputTime = 0;
+static int epollFd = -1;
+static int inotifyFd = -1;
+static int quitFd = -1; // Event fd that DeinitInputWake() signals to stop the thread
+
+struct InputDevice
+{
+  int fd;
+  int absReference[ABS_CNT]; // Position of each absolute axis when its motion last counted as input
+  int absThreshold[ABS_CNT]; // How far each absolute axis has to move from there to count as input, 0 if the device does not have it
+  int relMotion; // Relative motion since it last counted as input, summed over all axes
+};
+static InputDevice devices[INPUT_MAX_DEVICES]; // Open input devices, only accessed by the input thread once it is running
+static int numDevices = 0;
+static pthread_t inputThread;
+static bool inputThreadRunning = false;
+
+bool InputBoostActive()
+{
+  uint64_t t = __atomic_load_n(&lastInputTime, __ATOMIC_RELAXED);
+  return t != 0 && tick() - t < WAKE_ON_INPUT_BOOST_USECS;
+}
+
+void SleepUntilInput(uint64_t usecs)
+{
+  int events = __atomic_load_n(&numInputEvents, __ATOMIC_ACQUIRE);
+  struct timespec timeout = { (time_t)(usecs / 1000000), (long)(usecs % 1000000) * 1000 };
+  syscall(SYS_futex, &numInputEvents, FUTEX_WAIT, events, &timeout, 0, 0); // Returns right away if an event came in since the load above
+}
+
+static void WatchInputDevice(const char *name)
+{
+  if (strncmp(name, "event", 5)) return; // Skip the legacy mouse and joystick interfaces, their events also come through evdev
+  char path[64];
+  snprintf(path, sizeof(path), INPUT_DEVICE_DIRECTORY "/%s", name);
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) return; // Not readable by us, or already gone again
+  if (numDevices >= INPUT_MAX_DEVICES)
+  {
+    close(fd);
+    return;
+  }
+  InputDevice *d = &devices[numDevices];
+  memset(d, 0, sizeof(InputDevice));
+  d->fd = fd;
+  uint8_t absAxes[(ABS_CNT + 7) / 8] = {};
+  if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absAxes)), absAxes) >= 0)
+    for(int axis = 0; axis < ABS_CNT; ++axis)
+    {
+      struct input_absinfo info;
+      if (!(absAxes[axis >> 3] & (1 << (axis & 7))) || ioctl(fd, EVIOCGABS(axis), &info) < 0) continue;
+      d->absReference[axis] = info.value;
+      d->absThreshold[axis] = MAX(1, (int)((info.maximum - info.minimum) * WAKE_ON_INPUT_ABS_THRESHOLD));
+    }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    close(fd);
+    return;
+  }
+  ++numDevices;
+}
+
+static void CloseInputDevice(InputDevice *d)
+{
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, d->fd, 0);
+  close(d->fd);
+  *d = devices[--numDevices];
+}
+
+// True if the given event is the user doing something: a key or button, or motion beyond the noise of a stick, sensor or mouse.
+static bool IsUserInput(InputDevice *d, const struct input_event &e)
+{
+  if (e.type == EV_KEY) return true;
+  if (e.type == EV_ABS && e.code < ABS_CNT && d->absThreshold[e.code] > 0)
+  {
+    if (abs(e.value - d->absReference[e.code]) < d->absThreshold[e.code]) return false;
+    d->absReference[e.code] = e.value;
+    return true;
+  }
+  if (e.type == EV_REL)
+  {
+    if (e.code == REL_WHEEL || e.code == REL_HWHEEL) return true; // Each notch of a wheel is deliberate
+    d->relMotion += abs(e.value);
+    if (d->relMotion < WAKE_ON_INPUT_REL_THRESHOLD) return false;
+    d->relMotion = 0;
+    return true;
+  }
+  return false;
+}
+
+// Drains the pending events of the given device, and returns true if any of them was user input.
+static bool ReadInputDevice(int fd)
+{
+  InputDevice *d = 0;
+  for(int i = 0; i < numDevices && !d; ++i)
+    if (devices[i].fd == fd) d = &devices[i];
+  if (!d) return false;
+
+  bool gotInput = false;
+  struct input_event events[64];
+  for(;;)
+  {
+    ssize_t bytes = read(fd, events, sizeof(events));
+    if (bytes < 0 && errno == EAGAIN) break;
+    if (bytes <= 0)
+    {
+      CloseInputDevice(d); // Device was unplugged
+      break;
+    }
+    for(int i = 0; i < (int)(bytes / sizeof(struct input_event)); ++i)
+      if (IsUserInput(d, events[i])) gotInput = true;
+  }
+  return gotInput;
+}
+
+static void ReadInputDeviceDirectoryChanges()
+{
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t bytes;
+  while((bytes = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+    for(char *p = buffer; p < buffer + bytes; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+    {
+      struct inotify_event *e = (struct inotify_event *)p;
+      if (e->len > 0) WatchInputDevice(e->name);
+    }
+}
+
+void *input_thread(void*)
+{
+  RegisterStatisticsThread("input");
+  struct epoll_event events[16];
+  for(;;)
+  {
+    int n = epoll_wait(epollFd, events, sizeof(events)/sizeof(events[0]), -1);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      FATAL_ERROR("epoll_wait() on input devices failed!");
+    }
+    bool gotInput = false;
+    for(int i = 0; i < n; ++i)
+      if (events[i].data.fd == quitFd) return 0;
+      else if (events[i].data.fd == inotifyFd) ReadInputDeviceDirectoryChanges();
+      else if (ReadInputDevice(events[i].data.fd)) gotInput = true;
+
+    if (gotInput)
+    {
+      __atomic_store_n(&lastInputTime, tick(), __ATOMIC_RELAXED);
+      __atomic_fetch_add(&numInputEvents, 1, __ATOMIC_RELEASE);
+      syscall(SYS_futex, &numInputEvents, FUTEX_WAKE, 1, 0, 0, 0); // Wake the GPU polling thread if it is sleeping while idle
+    }
+  }
+}
+
+void InitInputWake()
+{
+#ifdef SIMULATOR
+  // There are no input devices to watch
+#else
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd < 0) FATAL_ERROR("Failed to create epoll instance for input devices!");
+  quitFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event quitEv = {};
+  quitEv.events = EPOLLIN;
+  quitEv.data.fd = quitFd;
+  if (quitFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, quitFd, &quitEv) < 0) FATAL_ERROR("Failed to create event fd for stopping the input thread!");
+
+  // Watch for devices that are plugged in later, e.g. a gamepad
+  inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotifyFd >= 0 && inotify_add_watch(inotifyFd, INPUT_DEVICE_DIRECTORY, IN_CREATE) >= 0)
+  {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = inotifyFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, inotifyFd, &ev);
+  }
+  else
+    LogMessage(LOG_WARNING, "Could not watch " INPUT_DEVICE_DIRECTORY " for new input devices, only devices present at startup will wake up idle polling");
+
+  DIR *dir = opendir(INPUT_DEVICE_DIRECTORY);
+  if (dir)
+  {
+    while(struct dirent *entry = readdir(dir)) WatchInputDevice(entry->d_name);
+    closedir(dir);
+  }
+
+  int rc = pthread_create(&inputThread, NULL, input_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create input watching thread!");
+  inputThreadRunning = true;
+#endif
+}
+
+void DeinitInputWake()
+{
+  if (!inputThreadRunning) return;
+  uint64_t one = 1;
+  if (write(quitFd, &one, sizeof(one)) != sizeof(one)) FATAL_ERROR("Failed to signal the input thread to stop!");
+  pthread_join(inputThread, 0);
+  inputThreadRunning = false;
+  for(int i = 0; i < numDevices; ++i) close(devices[i].fd);
+  numDevices = 0;
+  if (inotifyFd >= 0) close(inotifyFd);
+  close(quitFd);
+  close(epollFd);
+  epollFd = inotifyFd = quitFd = -1;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef WAKE_ON_INPUT
+
+// Watches the input event devices (/dev/input/event*, including ones plugged in later) on a thread of its own, so that the GPU
+// polling thread can be woken up from an idle sleep as soon as the user presses a button or touches the screen.
+void InitInputWake(void);
+void DeinitInputWake(void);
+
+// True for WAKE_ON_INPUT_BOOST_USECS after the most recent input event.
+bool InputBoostActive(void);
+
+// Sleeps for the given number of usecs, or until the next input event, whichever comes first.
+void SleepUntilInput(uint64_t usecs);
+
+#endif
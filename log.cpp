@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "statistics.h"
+#include "thread.h"
+#include "tick.h"
+#include "util.h"
+
+typedef union LogArg
+{
+  int64_t i;
+  uint64_t u;
+  double d;
+  const void *p;
+} LogArg;
+
+typedef struct LogRecord
+{
+  uint64_t time;
+  const char *format;
+  int priority;
+  int numArgs;
+  LogArg args[LOG_MAX_ARGS];
+} LogRecord;
+
+// Single producer single consumer ring of log records, one for each thread that logs
+typedef struct LogRing
+{
+  volatile uint32_t head; // Advanced by the logger thread
+  volatile uint32_t tail; // Advanced by the thread that owns the ring
+  volatile uint32_t dropped; // Records dropped since the ring was full, reset by the logger thread
+  int tid;
+  LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+static LogRing logRings[LOG_MAX_THREADS];
+static volatile int numLogRings = 0;
+static volatile uint32_t logRecordsDroppedNoRing = 0; // Records from threads beyond LOG_MAX_THREADS
+static __thread LogRing *threadLogRing = 0;
+static __thread int threadLogRingGeneration = 0;
+static volatile int logRingGeneration = 1; // Bumped by DeinitLog(), so that the threads of the next InitLog() take rings afresh
+static bool logThreadRunning = false;
+static pthread_t logThread;
+static volatile int logThreadQuit = 0;
+static pthread_mutex_t logOutputLock = PTHREAD_MUTEX_INITIALIZER; // Serializes the draining of the rings, not taken by the logging threads
+#ifdef LOG_FILE
+static FILE *logFile = 0;
+#endif
+
+// Finds the conversion specifier of the printf conversion that starts at the given '%', e.g. 'd' or 'f'.
+static const char *FindConversion(const char *p)
+{
+  ++p;
+  while(*p && strchr("-+ #0123456789.*hlLqjzt", *p)) ++p;
+  return p;
+}
+
+static void WriteLogLine(int priority, uint64_t time, const char *text)
+{
+  printf("%s\n", text);
+  syslog(priority, "%s", text);
+#ifdef LOG_FILE
+  if (logFile) fprintf(logFile, "%.6f %s\n", time / 1000000.0, text);
+#else
+  (void)time;
+#endif
+}
+
+// Formats the given record, converting each argument with the flags, width and precision of its conversion, but with the length
+// modifier of the type that it was stored as.
+static void FormatLogRecord(const LogRecord *r, char *out, int outSize)
+{
+  int len = 0, arg = 0;
+  for(const char *p = r->format; *p && len < outSize - 1;)
+  {
+    if (*p != '%')
+    {
+      out[len++] = *p++;
+      continue;
+    }
+    if (p[1] == '%')
+    {
+      out[len++] = '%';
+      p += 2;
+      continue;
+    }
+    const char *conv = FindConversion(p);
+    if (!*conv) break;
+    char spec[32];
+    int specLen = 0;
+    for(const char *s = p; s < conv && specLen < (int)sizeof(spec) - 4; ++s)
+      if (!strchr("hlLqjzt", *s)) spec[specLen++] = *s; // Drop the original length modifier
+    LogArg a = {};
+    if (arg < r->numArgs) a = r->args[arg];
+    ++arg;
+    int n;
+    if (strchr("di", *conv)) { spec[specLen++] = 'l'; spec[specLen++] = 'l'; spec[specLen++] = *conv; spec[specLen] = 0; n = snprintf(out + len, outSize - len, spec, (long long)a.i); }
+    else if (strchr("uoxXc", *conv)) { if (*conv != 'c') { spec[specLen++] = 'l'; spec[specLen++] = 'l'; } spec[specLen++] = *conv; spec[specLen] = 0; n = (*conv == 'c') ? snprintf(out + len, outSize - len, spec, (int)a.u) : snprintf(out + len, outSize - len, spec, (unsigned long long)a.u); }
+    else if (strchr("fFeEgGaA", *conv)) { spec[specLen++] = *conv; spec[specLen] = 0; n = snprintf(out + len, outSize - len, spec, a.d); }
+    else if (*conv == 's') { spec[specLen++] = 's'; spec[specLen] = 0; n = snprintf(out + len, outSize - len, spec, a.p ? (const char*)a.p : "(null)"); }
+    else { spec[specLen++] = 'p'; spec[specLen] = 0; n = snprintf(out + len, outSize - len, spec, a.p); }
+    len = MIN(outSize - 1, len + MAX(n, 0));
+    p = conv + 1;
+  }
+  out[len] = 0;
+}
+
+// Writes out all records in the rings, in the order they were logged in across all threads.
+static void DrainLogRings()
+{
+  pthread_mutex_lock(&logOutputLock);
+  int numRings = MIN(__atomic_load_n(&numLogRings, __ATOMIC_ACQUIRE), LOG_MAX_THREADS);
+  char text[512];
+  for(;;)
+  {
+    LogRing *next = 0;
+    for(int i = 0; i < numRings; ++i)
+    {
+      LogRing *ring = &logRings[i];
+      if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) && (!next || ring->records[ring->head % LOG_RING_SIZE].time < next->records[next->head % LOG_RING_SIZE].time))
+        next = ring;
+    }
+    if (!next) break;
+    const LogRecord *r = &next->records[next->head % LOG_RING_SIZE];
+    FormatLogRecord(r, text, sizeof(text));
+    WriteLogLine(r->priority, r->time, text);
+    __atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+  }
+
+  for(int i = 0; i < numRings; ++i)
+  {
+    uint32_t dropped = __atomic_exchange_n(&logRings[i].dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+    {
+      snprintf(text, sizeof(text), "Log ring of thread %d was full, dropped %u messages", logRings[i].tid, dropped);
+      WriteLogLine(LOG_WARNING, tick(), text);
+    }
+  }
+  uint32_t dropped = __atomic_exchange_n(&logRecordsDroppedNoRing, 0, __ATOMIC_RELAXED);
+  if (dropped)
+  {
+    snprintf(text, sizeof(text), "More than %d threads logged, dropped %u messages", LOG_MAX_THREADS, dropped);
+    WriteLogLine(LOG_WARNING, tick(), text);
+  }
+  fflush(stdout);
+#ifdef LOG_FILE
+  if (logFile) fflush(logFile);
+#endif
+  pthread_mutex_unlock(&logOutputLock);
+}
+
+void LogMessage(int priority, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  if (!logThreadRunning)
+  {
+    char text[512];
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    WriteLogLine(priority, tick(), text);
+    fflush(stdout);
+    return;
+  }
+
+  LogRing *ring = threadLogRing;
+  if (!ring || threadLogRingGeneration != __atomic_load_n(&logRingGeneration, __ATOMIC_ACQUIRE))
+  {
+    int i = __atomic_fetch_add(&numLogRings, 1, __ATOMIC_ACQ_REL);
+    if (i >= LOG_MAX_THREADS)
+    {
+      __atomic_fetch_add(&logRecordsDroppedNoRing, 1, __ATOMIC_RELAXED);
+      va_end(args);
+      return;
+    }
+    ring = threadLogRing = &logRings[i];
+    threadLogRingGeneration = logRingGeneration;
+    ring->tid = (int)syscall(SYS_gettid);
+  }
+
+  uint32_t tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+  {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    va_end(args);
+    return;
+  }
+
+  // Pick up the arguments by the types that the conversions of the format string say they have
+  LogRecord *r = &ring->records[tail % LOG_RING_SIZE];
+  r->time = tick();
+  r->format = format;
+  r->priority = priority;
+  r->numArgs = 0;
+  for(const char *p = strchr(format, '%'); p && r->numArgs < LOG_MAX_ARGS; p = strchr(p, '%'))
+  {
+    if (p[1] == '%') { p += 2; continue; }
+    const char *conv = FindConversion(p);
+    if (!*conv) break;
+    int longs = 0;
+    for(const char *s = p; s < conv; ++s)
+      if (*s == 'l' || *s == 'q' || *s == 'j' || *s == 'z' || *s == 't') ++longs;
+    LogArg *a = &r->args[r->numArgs++];
+    if (strchr("di", *conv)) a->i = (longs >= 2) ? va_arg(args, long long) : (longs == 1 ? va_arg(args, long) : va_arg(args, int));
+    else if (strchr("uoxXc", *conv)) a->u = (longs >= 2) ? va_arg(args, unsigned long long) : (longs == 1 ? va_arg(args, unsigned long) : va_arg(args, unsigned int));
+    else if (strchr("fFeEgGaA", *conv)) a->d = va_arg(args, double);
+    else a->p = va_arg(args, const void*);
+    p = conv + 1;
+  }
+  va_end(args);
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void FlushLog()
+{
+  DrainLogRings();
+}
+
+static void *log_thread(void *unused)
+{
+  RegisterStatisticsThread("log");
+#ifndef SIMULATOR
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19); // Formatting and writing out the messages must not compete with the pipeline threads
+#endif
+  while(!SleepUnlessQuit(&logThreadQuit, LOG_FLUSH_INTERVAL_USECS))
+    DrainLogRings();
+  return 0;
+}
+
+void InitLog()
+{
+#ifdef LOG_FILE
+  logFile = fopen(LOG_FILE, "a");
+  if (!logFile) syslog(LOG_WARNING, "Failed to open log file " LOG_FILE ", logging only to stdout and syslog");
+#endif
+  logThreadQuit = 0;
+  int rc = pthread_create(&logThread, NULL, log_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create logger thread!");
+  static bool flushAtExit = false;
+  if (!flushAtExit) atexit(FlushLog);
+  flushAtExit = true;
+  logThreadRunning = true;
+}
+
+void DeinitLog()
+{
+  if (!logThreadRunning) return;
+  logThreadRunning = false; // From here on, messages are written out synchronously again
+  StopThread(logThread, &logThreadQuit);
+  DrainLogRings();
+  pthread_mutex_lock(&logOutputLock);
+  memset(logRings, 0, sizeof(logRings));
+  __atomic_store_n(&numLogRings, 0, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&logRingGeneration, 1, __ATOMIC_RELEASE);
+#ifdef LOG_FILE
+  if (logFile) fclose(logFile);
+  logFile = 0;
+#endif
+  pthread_mutex_unlock(&logOutputLock);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <syslog.h>
+
+// Asynchronous logging: LogMessage() takes a printf style format and its arguments, but instead of formatting them, copies the
+// arguments as they are into a fixed-size binary record in a lock-free ring of the calling thread. A low priority logger thread
+// formats the records and writes them to stdout, syslog, and LOG_FILE if defined. The logging threads never block: if a ring is
+// full, the record is dropped and counted, and the count is reported once the logger thread catches up.
+//
+// Since the formatting happens later on another thread, %s arguments must point to strings that stay alive, such as string
+// literals. '*' widths and precisions are not supported, and arguments past the first LOG_MAX_ARGS are ignored. Messages logged
+// before InitLog() are written out synchronously.
+
+#define LOG_MAX_ARGS 8
+
+// The priority is a syslog priority, e.g. LOG_INFO or LOG_WARNING.
+void LogMessage(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void InitLog(void);
+
+// Stops the logger thread after writing out all pending records. Called last, after the other threads have been stopped.
+void DeinitLog(void);
+
+// Writes out all records logged so far. Called at exit, so that messages logged right before a FATAL_ERROR are not lost.
+void FlushLog(void);
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <memory.h>
+#include <stdio.h>
+#include <syslog.h>
+
+#include "config.h"
+#include "oscillation.h"
+#include "display.h"
+#include "util.h"
+
+#ifdef OSCILLATION_FILTER
+
+#define OSCILLATION_TILES_X ((DISPLAY_WIDTH + OSCILLATION_TILE_SIZE - 1) / OSCILLATION_TILE_SIZE)
+#define OSCILLATION_TILES_Y ((DISPLAY_HEIGHT + OSCILLATION_TILE_SIZE - 1) / OSCILLATION_TILE_SIZE)
+
+static uint16_t *sourceHistory[2] = {}; // The previous source frame, and the one before that, as they came in before filtering
+static uint8_t tileToggleFrames[OSCILLATION_TILES_Y * OSCILLATION_TILES_X] = {}; // Number of frames in a row that each tile has only been toggling
+static uint8_t tileChange[OSCILLATION_TILES_Y * OSCILLATION_TILES_X]; // How each tile changed in the current frame, see below
+static uint32_t filteredFrames = 0;
+
+#ifdef STATISTICS
+uint64_t statsOscillationBytesSaved = 0;
+#endif
+
+#define TILE_UNCHANGED 0
+#define TILE_TOGGLED 1 // All changed pixels went back to their value from two frames ago
+#define TILE_CHANGED 2 // Some pixel changed in some other way
+
+// True if the pixel went back to the value it had two frames ago, and the two values are close enough to be blended.
+static inline bool Toggles(uint16_t cur, uint16_t prev, uint16_t prev2)
+{
+  if (cur == prev || cur != prev2) return false;
+  int dr = abs((cur >> 11) - (prev >> 11)), dg = abs(((cur >> 5) & 0x3F) - ((prev >> 5) & 0x3F)), db = abs((cur & 0x1F) - (prev & 0x1F));
+  return dr <= OSCILLATION_MAX_AMPLITUDE && dg <= 2*OSCILLATION_MAX_AMPLITUDE && db <= OSCILLATION_MAX_AMPLITUDE;
+}
+
+// Per channel average of two RGB565 pixels. Symmetric, so that a pixel toggling between a and b stays at the same value.
+static inline uint16_t AveragePixel(uint16_t a, uint16_t b)
+{
+  return (uint16_t)(((((a >> 11) + (b >> 11) + 1) >> 1) << 11) | (((((a >> 5) & 0x3F) + ((b >> 5) & 0x3F) + 1) >> 1) << 5) | (((a & 0x1F) + (b & 0x1F) + 1) >> 1));
+}
+
+void InitOscillationFilter()
+{
+  sourceHistory[0] = (uint16_t *)calloc(1, FRAMEBUFFER_SIZE);
+  sourceHistory[1] = (uint16_t *)calloc(1, FRAMEBUFFER_SIZE);
+  if (!sourceHistory[0] || !sourceHistory[1]) FATAL_ERROR("Failed to allocate oscillation filter history!");
+}
+
+void FilterOscillatingPixels(uint16_t *frame, const uint16_t *displayed, const uint16_t *damageMinX, const uint16_t *damageEndX)
+{
+  ++filteredFrames;
+  uint16_t *prev = sourceHistory[0], *prev2 = sourceHistory[1];
+
+  // First classify the changes in each tile, to find the tiles that have only been toggling for long enough
+  memset(tileChange, TILE_UNCHANGED, sizeof(tileChange));
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    uint8_t *tileRow = tileChange + (y / OSCILLATION_TILE_SIZE) * OSCILLATION_TILES_X;
+    for(int x = damageMinX[y], i = y*DISPLAY_WIDTH + x; x < damageEndX[y]; ++x, ++i)
+    {
+      if (frame[i] == prev[i]) continue;
+      uint8_t change = Toggles(frame[i], prev[i], prev2[i]) ? TILE_TOGGLED : TILE_CHANGED;
+      tileRow[x / OSCILLATION_TILE_SIZE] = MAX(tileRow[x / OSCILLATION_TILE_SIZE], change);
+    }
+  }
+  for(int i = 0; i < OSCILLATION_TILES_Y * OSCILLATION_TILES_X; ++i)
+    if (tileChange[i] == TILE_CHANGED) tileToggleFrames[i] = 0;
+    else if (tileChange[i] == TILE_TOGGLED && tileToggleFrames[i] < 255) ++tileToggleFrames[i];
+
+  // Then shift the unfiltered frame into the history, and replace the toggling pixels of those tiles
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    const uint8_t *tileRow = tileToggleFrames + (y / OSCILLATION_TILE_SIZE) * OSCILLATION_TILES_X;
+    for(int x = damageMinX[y], i = y*DISPLAY_WIDTH + x; x < damageEndX[y]; ++x, ++i)
+    {
+      uint16_t cur = frame[i], p = prev[i], p2 = prev2[i];
+      prev2[i] = p;
+      prev[i] = cur;
+      if (tileRow[x / OSCILLATION_TILE_SIZE] < OSCILLATION_DETECT_FRAMES || !Toggles(cur, p, p2)) continue;
+#if OSCILLATION_REFRESH_DIVISOR > 0
+      frame[i] = (filteredFrames % OSCILLATION_REFRESH_DIVISOR == 0) ? cur : displayed[i]; // Keep showing whichever value was last sent
+#else
+      frame[i] = AveragePixel(cur, p);
+#endif
+#ifdef STATISTICS
+      if (cur != displayed[i] && frame[i] == displayed[i]) statsOscillationBytesSaved += DISPLAY_BYTESPERPIXEL;
+#endif
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef OSCILLATION_FILTER
+
+// Some content flips pixels between two values on every frame, e.g. GPU temporal dithering, or 30Hz blinking effects rendered at
+// 60Hz. Sending those pixels costs bus time on every frame, even though the eye only sees a blend of the two values. The filter
+// keeps the two previous source frames, and per 16x16 tile, counts how many frames in a row every change in the tile was a pixel
+// returning to its value from two frames ago, within OSCILLATION_MAX_AMPLITUDE. Once a tile has done so for OSCILLATION_DETECT_FRAMES
+// frames, its toggling pixels are replaced in the frame to display, until any other change happens in the tile.
+#define OSCILLATION_TILE_SIZE 16
+
+void InitOscillationFilter(void);
+
+// Filters the damaged range [damageMinX[y], damageEndX[y][ of each scanline of the new source frame in place, before it is diffed
+// against displayed, which is what the display is currently showing.
+void FilterOscillatingPixels(uint16_t *frame, const uint16_t *displayed, const uint16_t *damageMinX, const uint16_t *damageEndX);
+
+#ifdef STATISTICS
+extern uint64_t statsOscillationBytesSaved; // Pixel bytes that did not need to be sent since the filter held them at the displayed value
+#endif
+
+#endif
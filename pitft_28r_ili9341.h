@@ -10,6 +10,16 @@
 #define DISPLAY_SET_CURSOR_X 0x2A
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
+#define DISPLAY_WRITE_BRIGHTNESS 0x51 // Sets the duty cycle of the backlight PWM output pin (LEDPWM) of the controller
+#define DISPLAY_SET_PIXEL_FORMAT 0x3A
+#define DISPLAY_PIXEL_FORMAT_16BPP 0x55 // DPI=16bits/pixel,DBI=16bits/pixel
+// The ILI9341 takes only 16 or 18 bits per pixel over SPI, so there is no DISPLAY_PIXEL_FORMAT_12BPP for REDUCED_DEPTH_ON_OVERLOAD
+#define DISPLAY_FRAME_RATE_CONTROL 0xB1 // Sets the division ratio (DIVA) and the clocks per line (RTNA) of the panel refresh
+#define DISPLAY_REFRESH_OSCILLATOR_HZ 615000 // Nominal frequency of the internal oscillator that clocks the panel refresh
+#define DISPLAY_REFRESH_LINES 324 // Lines per panel refresh: 320 scanlines, and the front and back porches of 2 lines each
+#define DISPLAY_REFRESH_MIN_RTNA 0x10
+#define DISPLAY_REFRESH_MAX_RTNA 0x1F
+#define DISPLAY_REFRESH_MAX_DIVA 3 // Divides the oscillator by 1, 2, 4 or 8
 
 void InitILI9341(void);
 #define InitSPIDisplay InitILI9341
@@ -0,0 +1,93 @@
+#include "config.h"
+#include "presentation.h"
+
+#ifdef PRESENTATION_FEEDBACK
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "spi.h"
+#include "log.h"
+#include "tick.h"
+#include "util.h"
+
+PresentationRing *presentationRing = 0;
+
+// Updates that have been submitted to the SPI task queue, but not yet sent out. Only written by the main thread and only read by
+// the SPI thread. At most two frames are in flight in the SPI task queue at a time, so this never fills up in practice.
+#define PENDING_PRESENTATIONS_SIZE 16
+struct PendingPresentation
+{
+  uint64_t endBytes;
+  PresentedFrame frame;
+};
+PendingPresentation pendingPresentations[PENDING_PRESENTATIONS_SIZE];
+volatile uint32_t pendingPresentationsHead = 0, pendingPresentationsTail = 0;
+
+void InitPresentationFeedback()
+{
+  int fd = shm_open(PRESENTATION_FEEDBACK_SHM_NAME, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) FATAL_ERROR("Failed to create presentation feedback shared memory!");
+  if (ftruncate(fd, sizeof(PresentationRing)) < 0) FATAL_ERROR("Failed to size presentation feedback shared memory!");
+  presentationRing = (PresentationRing*)mmap(NULL, sizeof(PresentationRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (presentationRing == MAP_FAILED) FATAL_ERROR("Failed to map presentation feedback shared memory!");
+  memset(presentationRing, 0, sizeof(PresentationRing));
+  presentationRing->magic = PRESENTATION_FEEDBACK_MAGIC;
+  presentationRing->version = PRESENTATION_FEEDBACK_VERSION;
+  __sync_synchronize();
+  LogMessage(LOG_INFO, "Publishing presentation feedback to /dev/shm%s", PRESENTATION_FEEDBACK_SHM_NAME);
+}
+
+void QueuePresentedFrame(uint32_t frameId, uint64_t endBytes, uint32_t bytes, uint64_t captureTime, bool interlaced, int skippedFrames)
+{
+  uint32_t tail = pendingPresentationsTail;
+  if (tail - __atomic_load_n(&pendingPresentationsHead, __ATOMIC_ACQUIRE) >= PENDING_PRESENTATIONS_SIZE) return; // Full, drop the event
+  PendingPresentation *p = &pendingPresentations[tail % PENDING_PRESENTATIONS_SIZE];
+  p->endBytes = endBytes;
+  p->frame.captureTime = captureTime;
+  p->frame.lastByteTime = 0;
+  p->frame.frameId = frameId;
+  p->frame.interlaced = interlaced ? 1 : 0;
+  p->frame.skippedFrames = skippedFrames;
+  p->frame.bytes = bytes;
+  __atomic_store_n(&pendingPresentationsTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void PublishPresentedFrames()
+{
+  uint32_t head = pendingPresentationsHead;
+  if (head == __atomic_load_n(&pendingPresentationsTail, __ATOMIC_ACQUIRE)) return;
+
+  uint64_t bytesSent = spiBytesSent;
+  uint32_t sequence = presentationRing->sequence;
+  bool published = false;
+  while(head != __atomic_load_n(&pendingPresentationsTail, __ATOMIC_ACQUIRE) && bytesSent >= pendingPresentations[head % PENDING_PRESENTATIONS_SIZE].endBytes)
+  {
+    // Each event gets its own sequence bump, which must be visible before the slot it frees up is overwritten, so that a client
+    // that is still reading the event being overwritten sees that it has to discard it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    PresentedFrame *f = &presentationRing->frames[sequence % PRESENTATION_RING_SIZE];
+    *f = pendingPresentations[head % PENDING_PRESENTATIONS_SIZE].frame;
+    f->lastByteTime = tick();
+#ifdef SIMULATOR
+    SimFramePresented(f);
+#endif
+    ++head;
+    __atomic_store_n(&presentationRing->sequence, ++sequence, __ATOMIC_RELEASE);
+    published = true;
+  }
+  if (!published) return;
+  __atomic_store_n(&pendingPresentationsHead, head, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &presentationRing->sequence, FUTEX_WAKE, INT_MAX, 0, 0, 0); // Wake up clients waiting for presentation events
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+// Presentation feedback: for each display update that is sent over the SPI bus, an event is published to a shared memory ring
+// at /dev/shm/PRESENTATION_FEEDBACK_SHM_NAME, so that applications can find out when, and whether, their frames reached the panel,
+// and pace their rendering to the actual bus throughput. The ring layout below is the protocol that clients read.
+
+#define PRESENTATION_FEEDBACK_MAGIC 0x50434246 // "FBCP"
+#define PRESENTATION_FEEDBACK_VERSION 1
+#define PRESENTATION_RING_SIZE 64
+
+// All times are in usecs, in the time base of tick() (CLOCK_REALTIME).
+struct PresentedFrame
+{
+  uint64_t captureTime; // When the frame was captured from the GPU, or submitted by the application
+  uint64_t lastByteTime; // When the last byte of the update was written to the SPI bus
+  uint32_t frameId; // Id returned by fbcp_submit_frame(), increasing by one for each update that was sent to the display
+  uint32_t interlaced; // 1 if the update was only one interlaced field of the frame, 0 if it was a progressive update
+  uint32_t skippedFrames; // Number of source frames that were dropped without being displayed since the previous update
+  uint32_t bytes; // Number of bytes the update put on the SPI bus
+};
+
+// Clients map the shared memory read-only, and read events with sequence numbers in [lastRead, sequence[ from
+// frames[seq % PRESENTATION_RING_SIZE]. sequence is bumped after each event is written, and before the slot of the event that is
+// PRESENTATION_RING_SIZE older is overwritten with the next one. So if, after reading an event, sequence has advanced by
+// PRESENTATION_RING_SIZE or more past it, the event may have been overwritten while it was being read, and must be discarded:
+//
+//   uint32_t end = __atomic_load_n(&ring->sequence, __ATOMIC_ACQUIRE);
+//   if (end - lastRead > PRESENTATION_RING_SIZE) lastRead = end - PRESENTATION_RING_SIZE; // Older events are gone
+//   for(; lastRead != end; ++lastRead)
+//   {
+//     PresentedFrame f = ring->frames[lastRead % PRESENTATION_RING_SIZE];
+//     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+//     if (__atomic_load_n(&ring->sequence, __ATOMIC_RELAXED) - lastRead >= PRESENTATION_RING_SIZE) continue; // Overwritten, discard
+//     ... use f ...
+//   }
+//
+// Clients can sleep waiting for new events with a futex wait on sequence.
+struct PresentationRing
+{
+  uint32_t magic;
+  uint32_t version;
+  volatile uint32_t sequence; // Number of events published so far
+  uint32_t unused;
+  PresentedFrame frames[PRESENTATION_RING_SIZE];
+};
+
+#ifdef PRESENTATION_FEEDBACK
+
+#ifdef KERNEL_MODULE_CLIENT
+#error PRESENTATION_FEEDBACK needs the userland SPI thread to timestamp the updates, it is not supported with KERNEL_MODULE_CLIENT
+#endif
+
+void InitPresentationFeedback(void);
+
+// Called on the main thread before the tasks of an update are submitted. endBytes is the value spiBytesCommitted will have after the
+// last task of the update has been committed.
+void QueuePresentedFrame(uint32_t frameId, uint64_t endBytes, uint32_t bytes, uint64_t captureTime, bool interlaced, int skippedFrames);
+
+// Called on the SPI thread after finishing tasks, publishes all queued updates that the SPI thread has now sent out.
+void PublishPresentedFrames(void);
+
+#endif
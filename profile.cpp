@@ -0,0 +1,370 @@
+#include "config.h"
+#include "profile.h"
+
+#ifdef APP_PROFILES
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "display.h"
+#include "framerate.h"
+#include "log.h"
+#include "spi.h"
+#include "statistics.h"
+#include "thread.h"
+#include "tick.h"
+#include "util.h"
+
+#define APP_PROFILE_LEARNING_RATE 0.02 // Weight of each new frame in the running averages of a profile
+#define APP_PROFILE_PRELOAD_FRAMES 100 // A profile needs to have been learned from at least this many frames to be preloaded
+#define APP_PROFILE_CONVERGENCE_FRAMES 30 // The frame rate estimate is converged once it stays within 10% for this many frames
+#define APP_PROFILE_PREDICTION_FRAMES 60 // Frame arrival prediction error is averaged over this many first frames of the application
+#define APP_PROFILE_MAX_FRAME_INTERVAL 100000 // Longer gaps between frames are idle time, not the cadence of the application
+
+static const char * const contentClassNames[] = { "static", "UI", "full motion" };
+
+static AppProfile profiles[APP_PROFILES_MAX];
+static int numProfiles = 0;
+static AppProfile *currentProfile = 0; // Profile being learned, or 0 until the foreground application is known
+static char detectedName[APP_PROFILE_NAME_LENGTH] = {}; // Newly detected foreground application, handed from the profile thread to the main thread
+static pthread_mutex_t profilesLock = PTHREAD_MUTEX_INITIALIZER; // Guards all of the above
+static pthread_t profileThread;
+static bool profileThreadRunning = false;
+static volatile int profileThreadQuit = 0;
+static bool profileNameFixed = false; // True if the profile was named with FBCP_PROFILE, then no foreground detection is done
+
+// Learning and convergence tracking state of the current profile, only touched by the main thread
+static uint64_t lastFrameTime, firstFrameTime, stableRunStartTime, stableRunInterval;
+static int stableRunFrames;
+static bool converged, preloaded;
+static uint64_t predictedFrameInterval, predictionErrorUsecs; // Frame rate estimate at the previous frame, and the sum of the errors so far
+static int predictionFrames;
+
+static void LoadAppProfiles()
+{
+  FILE *handle = fopen(APP_PROFILES_FILE, "r");
+  if (!handle) return; // No profiles saved yet
+  char line[1024];
+  while(numProfiles < APP_PROFILES_MAX && fgets(line, sizeof(line), handle))
+  {
+    if (line[0] == '#') continue;
+    AppProfile p = {};
+    unsigned long long frames, lastUsed;
+    char predictionError[32] = {};
+    int n = sscanf(line, "%31s %lf %lf %lf %lf %lf %d %u %llu %llu %31s", p.name, &p.frameInterval, &p.coverage, &p.interlacedFraction, &p.spiUsecsPerByte,
+      &p.spiUsecsPerTask, &p.contentClass, &p.coldConvergenceMsecs, &frames, &lastUsed, predictionError);
+    if (n < 10 || p.contentClass < CONTENT_STATIC || p.contentClass > CONTENT_FULL_MOTION) continue;
+    char *end;
+    p.coldPredictionErrorUsecs = (uint32_t)strtoul(predictionError, &end, 10);
+    if (*end) p.coldPredictionErrorUsecs = 0; // Not known in files written before it was measured
+    p.frames = frames;
+    p.lastUsed = lastUsed;
+    profiles[numProfiles++] = p;
+  }
+  fclose(handle);
+}
+
+// Writes the given profiles to APP_PROFILES_FILE, one line per profile.
+static void SaveAppProfiles(const AppProfile *p, int n)
+{
+  FILE *handle = fopen(APP_PROFILES_FILE ".tmp", "w");
+  if (!handle)
+  {
+    static bool warned = false;
+    if (!warned) LogMessage(LOG_WARNING, "Failed to write application profiles to " APP_PROFILES_FILE ", they will be learned again on each start");
+    warned = true;
+    return;
+  }
+  fprintf(handle, "# name frame_interval_usecs coverage interlaced_fraction spi_usecs_per_byte spi_usecs_per_task content_class cold_convergence_msecs frames last_used cold_prediction_error_usecs\n");
+  for(int i = 0; i < n; ++i, ++p)
+    fprintf(handle, "%s %.1f %.4f %.4f %.6f %.3f %d %u %llu %llu %u\n", p->name, p->frameInterval, p->coverage, p->interlacedFraction, p->spiUsecsPerByte,
+      p->spiUsecsPerTask, p->contentClass, p->coldConvergenceMsecs, (unsigned long long)p->frames, (unsigned long long)p->lastUsed, p->coldPredictionErrorUsecs);
+  fclose(handle);
+  rename(APP_PROFILES_FILE ".tmp", APP_PROFILES_FILE);
+}
+
+// Returns the profile of the given application, creating it in place of the least recently used one if there is none yet.
+static AppProfile *FindAppProfile(const char *name)
+{
+  for(int i = 0; i < numProfiles; ++i)
+    if (!strcmp(profiles[i].name, name)) return &profiles[i];
+
+  AppProfile *p = &profiles[numProfiles];
+  if (numProfiles < APP_PROFILES_MAX) ++numProfiles;
+  else
+  {
+    p = &profiles[0];
+    for(int i = 1; i < numProfiles; ++i)
+      if (profiles[i].lastUsed < p->lastUsed) p = &profiles[i];
+  }
+  memset(p, 0, sizeof(AppProfile));
+  strncpy(p->name, name, APP_PROFILE_NAME_LENGTH-1);
+  return p;
+}
+
+// Called with profilesLock held.
+static void SwitchAppProfile(const char *name)
+{
+  currentProfile = FindAppProfile(name);
+  currentProfile->lastUsed = time(0);
+  bool known = currentProfile->frames >= APP_PROFILE_PRELOAD_FRAMES;
+
+  // Static content only animates in short bursts, like a slide transition, and predicting frames at the cadence of those would
+  // only poll for frames that do not come. Its frame rate is left to be estimated from scratch, like the idle polling expects.
+  preloaded = known && currentProfile->frameInterval > 0 && currentProfile->contentClass != CONTENT_STATIC;
+  if (known)
+  {
+    if (preloaded) SeedFrameRateHistogram((uint64_t)currentProfile->frameInterval);
+    SeedSPICostModel(currentProfile->spiUsecsPerByte, currentProfile->spiUsecsPerTask);
+    LogMessage(LOG_INFO, "Preloaded profile of \"%s\": %.1f fps %s content, %.0f%% of the screen and %.0f%% interlaced per update", currentProfile->name,
+      1000000.0 / currentProfile->frameInterval, contentClassNames[currentProfile->contentClass], currentProfile->coverage * 100.0, currentProfile->interlacedFraction * 100.0);
+  }
+  else
+    LogMessage(LOG_INFO, "Learning the profile of \"%s\"", currentProfile->name);
+  lastFrameTime = firstFrameTime = 0;
+  stableRunFrames = 0;
+  converged = false;
+  predictedFrameInterval = predictionErrorUsecs = 0;
+  predictionFrames = 0;
+}
+
+// Measures how long it takes from the first frame of the application until the frame rate estimate settles, to compare starting
+// out from a preloaded profile against learning from scratch.
+static void TrackConvergence(AppProfile *p, uint64_t now)
+{
+  if (converged) return;
+  if (!firstFrameTime) firstFrameTime = now;
+  uint64_t estimate = EstimateFrameRateInterval();
+  if (!FrameRateHistogramFull() || !stableRunFrames || estimate*10 < stableRunInterval*9 || estimate*10 > stableRunInterval*11)
+  {
+    stableRunStartTime = now;
+    stableRunInterval = estimate;
+    stableRunFrames = FrameRateHistogramFull() ? 1 : 0;
+    return;
+  }
+  if (++stableRunFrames < APP_PROFILE_CONVERGENCE_FRAMES) return;
+
+  converged = true;
+  uint32_t msecs = (uint32_t)((stableRunStartTime - firstFrameTime) / 1000);
+  if (preloaded) LogMessage(LOG_INFO, "Frame rate of \"%s\" converged in %u msecs with the preloaded profile (%u msecs without)", p->name, msecs, p->coldConvergenceMsecs);
+  else
+  {
+    p->coldConvergenceMsecs = msecs;
+    LogMessage(LOG_INFO, "Frame rate of \"%s\" converged in %u msecs without a profile", p->name, msecs);
+  }
+}
+
+// Measures how far each of the first frames of the application arrives from the closest of the times that the frame rate estimate
+// predicts, which like PredictNextFrameArrivalTime() are the multiples of the estimated interval after the previous frame. A seeded
+// histogram counts as converged right away, so this is what tells whether the preloaded cadence actually fits the application.
+static void TrackPrediction(AppProfile *p, uint64_t now)
+{
+  if (predictionFrames >= APP_PROFILE_PREDICTION_FRAMES) return;
+  uint64_t elapsed = now - lastFrameTime;
+  if (predictedFrameInterval && elapsed < APP_PROFILE_MAX_FRAME_INTERVAL) // Gaps in the animation are not mispredictions
+  {
+    uint64_t predicted = MAX(1, (elapsed + predictedFrameInterval/2) / predictedFrameInterval) * predictedFrameInterval;
+    predictionErrorUsecs += (elapsed > predicted) ? elapsed - predicted : predicted - elapsed;
+    if (++predictionFrames == APP_PROFILE_PREDICTION_FRAMES)
+    {
+      uint32_t usecs = (uint32_t)(predictionErrorUsecs / APP_PROFILE_PREDICTION_FRAMES);
+      if (preloaded) LogMessage(LOG_INFO, "Frame arrival prediction of \"%s\" was off by %.2f msecs on average over the first %d frames with the preloaded profile (%.2f msecs without)",
+        p->name, usecs / 1000.0, APP_PROFILE_PREDICTION_FRAMES, p->coldPredictionErrorUsecs / 1000.0);
+      else
+      {
+        p->coldPredictionErrorUsecs = usecs;
+        LogMessage(LOG_INFO, "Frame arrival prediction of \"%s\" was off by %.2f msecs on average over the first %d frames without a profile",
+          p->name, usecs / 1000.0, APP_PROFILE_PREDICTION_FRAMES);
+      }
+    }
+  }
+  predictedFrameInterval = EstimateFrameRateInterval();
+}
+
+void UpdateAppProfile(bool newFrame, uint32_t bytes, bool interlaced)
+{
+  pthread_mutex_lock(&profilesLock);
+  if (detectedName[0])
+  {
+    if (!currentProfile || strcmp(currentProfile->name, detectedName)) SwitchAppProfile(detectedName);
+    detectedName[0] = 0;
+  }
+  AppProfile *p = currentProfile;
+  if (!p || !newFrame)
+  {
+    pthread_mutex_unlock(&profilesLock);
+    return;
+  }
+
+  // Plain averages over the first frames, so that a new profile does not start out biased towards zero, then running averages
+  uint64_t now = tick();
+  double w = MAX(APP_PROFILE_LEARNING_RATE, 1.0 / (p->frames + 1));
+  if (lastFrameTime && now - lastFrameTime < APP_PROFILE_MAX_FRAME_INTERVAL)
+    p->frameInterval = p->frameInterval ? p->frameInterval + w * ((now - lastFrameTime) - p->frameInterval) : (now - lastFrameTime);
+  p->coverage += w * ((double)bytes / FRAMEBUFFER_SIZE - p->coverage);
+  p->interlacedFraction += w * ((interlaced ? 1.0 : 0.0) - p->interlacedFraction);
+  p->contentClass = (p->coverage < 0.01) ? CONTENT_STATIC : (p->coverage < 0.25 ? CONTENT_UI : CONTENT_FULL_MOTION);
+  p->spiUsecsPerByte = spiUsecsPerByte;
+  p->spiUsecsPerTask = spiUsecsPerTask;
+  ++p->frames;
+  TrackPrediction(p, now);
+  lastFrameTime = now;
+  TrackConvergence(p, now);
+  pthread_mutex_unlock(&profilesLock);
+}
+
+// The foreground application is taken to be the process that used the most CPU time since the previous call, other than
+// fbcp-ili9341 itself and kernel threads. Returns false if there was no previous call to compare to, or no process was busy.
+#define MAX_PROCESSES 1024
+struct ProcessCpuTime
+{
+  int pid;
+  uint64_t ticks;
+};
+static ProcessCpuTime prevProcesses[MAX_PROCESSES], curProcesses[MAX_PROCESSES];
+static int numPrevProcesses = 0;
+
+static bool DetectForegroundApplication(char *name)
+{
+  DIR *dir = opendir("/proc");
+  if (!dir) return false;
+  int numProcesses = 0;
+  uint64_t busiestTicks = 0;
+  int self = getpid();
+  while(struct dirent *entry = readdir(dir))
+  {
+    int pid = atoi(entry->d_name);
+    if (pid <= 0 || pid == self || numProcesses >= MAX_PROCESSES) continue;
+    char path[64], stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *handle = fopen(path, "r");
+    if (!handle) continue; // Exited already
+    int n = fread(stat, 1, sizeof(stat)-1, handle);
+    fclose(handle);
+    if (n <= 0) continue;
+    stat[n] = 0;
+
+    // "pid (comm) state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime ...", where comm may contain spaces and parentheses
+    char *comm = strchr(stat, '('), *commEnd = strrchr(stat, ')');
+    int ppid;
+    unsigned long utime, stime;
+    if (!comm || !commEnd || sscanf(commEnd + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ppid, &utime, &stime) != 3) continue;
+    if (pid == 2 || ppid == 2) continue; // kthreadd and the kernel threads it spawns
+
+    uint64_t ticks = (uint64_t)utime + stime;
+    curProcesses[numProcesses].pid = pid;
+    curProcesses[numProcesses++].ticks = ticks;
+    for(int i = 0; i < numPrevProcesses; ++i)
+      if (prevProcesses[i].pid == pid)
+      {
+        if (ticks - prevProcesses[i].ticks > busiestTicks)
+        {
+          busiestTicks = ticks - prevProcesses[i].ticks;
+          int len = MIN((int)(commEnd - comm - 1), APP_PROFILE_NAME_LENGTH-1);
+          for(int j = 0; j < len; ++j) name[j] = (comm[1+j] <= ' ') ? '_' : comm[1+j]; // Profile names are whitespace separated in the file
+          name[len] = 0;
+        }
+        break;
+      }
+  }
+  closedir(dir);
+  memcpy(prevProcesses, curProcesses, numProcesses * sizeof(ProcessCpuTime));
+  numPrevProcesses = numProcesses;
+  return busiestTicks > 0;
+}
+
+static void *profile_thread(void *unused)
+{
+  RegisterStatisticsThread("profile");
+#ifndef SIMULATOR
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19); // Scanning /proc and writing the file must not compete with the pipeline threads
+#endif
+  static AppProfile savedProfiles[APP_PROFILES_MAX];
+  char name[APP_PROFILE_NAME_LENGTH], candidate[APP_PROFILE_NAME_LENGTH] = {}, current[APP_PROFILE_NAME_LENGTH] = {};
+  uint64_t lastSaveTime = tick();
+  if (!profileNameFixed) DetectForegroundApplication(name);
+  while(!SleepUnlessQuit(&profileThreadQuit, APP_PROFILES_DETECT_INTERVAL))
+  {
+    bool switched = false;
+
+    // Only switch once the same application has been the busiest for two intervals in a row, so that a short burst of work in a
+    // background process does not swap out the profile.
+    if (!profileNameFixed && DetectForegroundApplication(name))
+    {
+      if (!strcmp(name, candidate) && strcmp(name, current))
+      {
+        pthread_mutex_lock(&profilesLock);
+        strcpy(detectedName, name);
+        pthread_mutex_unlock(&profilesLock);
+        strcpy(current, name);
+        switched = true;
+      }
+      strcpy(candidate, name);
+    }
+
+    // Save on each switch, so that the profile of the application that went away is kept, and otherwise rarely, to spare SD cards
+    uint64_t now = tick();
+    if (switched || now - lastSaveTime >= APP_PROFILES_SAVE_INTERVAL)
+    {
+      pthread_mutex_lock(&profilesLock);
+      int n = numProfiles;
+      memcpy(savedProfiles, profiles, n * sizeof(AppProfile));
+      pthread_mutex_unlock(&profilesLock);
+      SaveAppProfiles(savedProfiles, n);
+      lastSaveTime = now;
+    }
+  }
+  return 0;
+}
+
+void InitAppProfiles()
+{
+  LoadAppProfiles();
+  const char *name = getenv("FBCP_PROFILE");
+#ifdef SIMULATOR
+  if (!name) name = "simulator"; // Picking the busiest host process would make the runs nondeterministic
+#endif
+  if (name && name[0])
+  {
+    profileNameFixed = true;
+    char profileName[APP_PROFILE_NAME_LENGTH] = {};
+    for(int i = 0; i < APP_PROFILE_NAME_LENGTH-1 && name[i]; ++i) profileName[i] = (name[i] <= ' ') ? '_' : name[i];
+    pthread_mutex_lock(&profilesLock);
+    SwitchAppProfile(profileName);
+    pthread_mutex_unlock(&profilesLock);
+  }
+
+  profileThreadQuit = 0;
+  int rc = pthread_create(&profileThread, NULL, profile_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create application profile thread!");
+  profileThreadRunning = true;
+}
+
+void DeinitAppProfiles()
+{
+  if (!profileThreadRunning) return;
+  StopThread(profileThread, &profileThreadQuit);
+  profileThreadRunning = false;
+
+  // Keep what was learned since the last periodic save
+  static AppProfile savedProfiles[APP_PROFILES_MAX];
+  pthread_mutex_lock(&profilesLock);
+  int n = numProfiles;
+  memcpy(savedProfiles, profiles, n * sizeof(AppProfile));
+  numProfiles = 0; // Loaded again on the next InitAppProfiles()
+  currentProfile = 0;
+  detectedName[0] = 0;
+  profileNameFixed = false;
+  pthread_mutex_unlock(&profilesLock);
+  SaveAppProfiles(savedProfiles, n);
+}
+
+#endif
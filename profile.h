@@ -0,0 +1,47 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef APP_PROFILES
+
+// What an application has been observed to do, learned while it runs on the foreground. The profiles of all applications seen so
+// far are kept in APP_PROFILES_FILE, and when an application comes back on the foreground (typically after a restart), its profile
+// is preloaded: the frame arrival histogram is seeded with its cadence unless its content is static, and the SPI bus cost model
+// with the fit measured on its content, so that frame arrival prediction and the interlacing decisions start out from what was
+// learned. How much that helps is logged: the time the frame rate estimate takes to converge, and the average error of the predicted
+// arrival times of the first frames, both with the preloaded profile and without.
+#define APP_PROFILE_NAME_LENGTH 32
+
+enum ContentClass
+{
+  CONTENT_STATIC = 0, // Updates rarely, e.g. a dashboard or a slideshow
+  CONTENT_UI = 1, // Updates small parts of the screen at a time, e.g. menus, text and HUD counters
+  CONTENT_FULL_MOTION = 2 // Updates most of the screen on each frame, e.g. video or games
+};
+
+struct AppProfile
+{
+  char name[APP_PROFILE_NAME_LENGTH]; // Process name of the application, or the FBCP_PROFILE environment variable
+  double frameInterval; // Usecs between new source frames when the application is animating
+  double coverage; // Average fraction of the screen that each update sends
+  double interlacedFraction; // Fraction of the updates that were sent interlaced
+  double spiUsecsPerByte, spiUsecsPerTask; // Fitted SPI bus cost model on the content of the application
+  int contentClass; // A static application only animates in short bursts, so its cadence is not preloaded
+  uint32_t coldConvergenceMsecs; // How long the frame rate estimate took to converge without the profile, 0 if not known
+  uint32_t coldPredictionErrorUsecs; // Average error of the predicted arrival times of the first frames without the profile, 0 if not known
+  uint64_t frames; // Number of source frames the profile has been learned from
+  uint64_t lastUsed; // Unix time of when the application was last seen, the least recently seen profile is evicted when full
+};
+
+void InitAppProfiles(void);
+
+// Stops the detection thread and saves the profiles.
+void DeinitAppProfiles(void);
+
+// Called on the main thread after each update has been planned, with the number of bytes it sends and whether it was interlaced.
+// Switches over to the profile of a newly detected foreground application, and learns from the update.
+void UpdateAppProfile(bool newFrame, uint32_t bytes, bool interlaced);
+
+#endif
@@ -0,0 +1,122 @@
+#include <math.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "refresh.h"
+#include "display.h"
+#include "framerate.h"
+#include "log.h"
+#include "spi.h"
+#include "tick.h"
+#include "util.h"
+
+#ifdef PANEL_REFRESH_MATCHING
+
+static int panelDiva = 0, panelRtna = 0x18; // The 79Hz that InitILI9341() programs
+static bool panelRefreshMatched = false; // True once the refresh rate has been picked for the source frame rate
+static uint64_t settlingEstimate = 0; // Source frame interval estimate that the last frames have stayed close to
+static uint64_t settlingFrameTime = 0; // Capture time of the most recent of those frames
+static int settledFrames = 0;
+static int settledIntervals = 0; // Number of source frame intervals that the settled frames span, counting in frames never captured
+static double settledUsecs = 0;
+static double sourceInterval = 0; // Average interval between the source frames of the cadence that the panel was matched to
+
+static int64_t phaseAnchor = 0; // A point in time on the source frame cadence, follows the average phase of the captures
+static double phaseSpread = 0; // How late in the cadence, relative to phaseAnchor, the recent frames have been captured at most
+
+static double PanelRefreshRate(int diva, int rtna)
+{
+  return DISPLAY_REFRESH_OSCILLATOR_HZ / ((double)(rtna << diva) * DISPLAY_REFRESH_LINES);
+}
+
+// Frequency in Hz at which the scan of the panel drifts against the closest multiple of the source frame rate.
+static double BeatFrequency(double refreshRate, double sourceFps)
+{
+  double multiple = MAX(1.0, round(refreshRate / sourceFps));
+  return fabs(refreshRate - multiple * sourceFps);
+}
+
+bool UpdatePanelRefreshRate(uint64_t captureTime)
+{
+  // Wait for the frame rate estimate to settle, so that the panel is not reprogrammed back and forth as the content speeds up. The
+  // estimate of a steady source still moves around by the polling granularity.
+  uint64_t interval = EstimateFrameRateInterval();
+  if (!FrameRateHistogramFull()) return false;
+  if (!settlingEstimate || interval * 100 < settlingEstimate * 97 || interval * 100 > settlingEstimate * 103)
+  {
+    settlingEstimate = interval;
+    settlingFrameTime = captureTime;
+    settledFrames = settledIntervals = 0;
+    settledUsecs = 0;
+    return false;
+  }
+  // The estimate is only as fine as the polling, so measure the rate of the cadence over all the frames it takes to settle
+  double usecs = (double)(captureTime - settlingFrameTime);
+  settlingFrameTime = captureTime;
+  settledIntervals += (int)MAX(1.0, round(usecs / settlingEstimate));
+  settledUsecs += usecs;
+  if (++settledFrames != PANEL_REFRESH_SETTLE_FRAMES) return false;
+  sourceInterval = settledUsecs / settledIntervals;
+  double sourceFps = 1000000.0 / sourceInterval;
+
+  // Pick the setting with the slowest beat against the source frame rate, and the higher refresh rate of equally good ones
+  int bestDiva = panelDiva, bestRtna = panelRtna;
+  double bestRate = PanelRefreshRate(panelDiva, panelRtna), bestBeat = BeatFrequency(bestRate, sourceFps);
+  for(int diva = 0; diva <= DISPLAY_REFRESH_MAX_DIVA; ++diva)
+    for(int rtna = DISPLAY_REFRESH_MIN_RTNA; rtna <= DISPLAY_REFRESH_MAX_RTNA; ++rtna)
+    {
+      double rate = PanelRefreshRate(diva, rtna), beat = BeatFrequency(rate, sourceFps);
+      if (rate < PANEL_REFRESH_MIN_HZ) continue;
+      if (beat < bestBeat - 0.05 || (beat < bestBeat + 0.05 && rate > bestRate)) // Beats within 0.05Hz of each other look the same
+      {
+        bestDiva = diva;
+        bestRtna = rtna;
+        bestRate = rate;
+        bestBeat = beat;
+      }
+    }
+
+  panelRefreshMatched = true;
+  phaseAnchor = 0;
+  if (bestDiva == panelDiva && bestRtna == panelRtna) return false;
+  panelDiva = bestDiva;
+  panelRtna = bestRtna;
+  LogMessage(LOG_INFO, "Source frame rate settled at %.2f fps, setting panel refresh rate to %.2f Hz (DIVA=%d, RTNA=0x%02X, beat %.2f Hz)",
+    sourceFps, bestRate, panelDiva, panelRtna, bestBeat);
+  return true;
+}
+
+int QueuePanelRefreshRate()
+{
+  char diva = (char)panelDiva, rtna = (char)panelRtna;
+  QUEUE_SPI_TRANSFER(DISPLAY_FRAME_RATE_CONTROL, diva, rtna);
+  return 3;
+}
+
+void WaitForPanelRefreshPhase()
+{
+  if (!panelRefreshMatched) return;
+  int64_t interval = (int64_t)(sourceInterval + 0.5);
+  uint64_t now = tick();
+  if (!phaseAnchor)
+  {
+    phaseAnchor = (int64_t)now;
+    phaseSpread = 0;
+    return;
+  }
+
+  // Phase on the source frame cadence at which the update is ready to go out, in [-interval/2, interval/2[ around the anchor
+  int64_t phase = ((int64_t)now - phaseAnchor) % interval;
+  if (phase < 0) phase += interval;
+  if (phase >= interval/2) phase -= interval;
+  phaseAnchor += phase / 16; // Follow slow drift between the measured interval and the actual source cadence
+  phaseSpread = MAX((double)phase, phaseSpread - interval / 256.0);
+
+  // Hold the update back to the phase of the latest recent updates, unless the bus is still busy with earlier updates, which then
+  // decides when the pixels start to go out anyway
+  double holdUsecs = MIN(phaseSpread - phase, (double)PANEL_REFRESH_MAX_ALIGN_USECS);
+  if (holdUsecs >= 1 && spiTaskMemory->spiBytesQueued == 0) usleep((useconds_t)holdUsecs);
+}
+
+#endif
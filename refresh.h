@@ -0,0 +1,26 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef PANEL_REFRESH_MATCHING
+
+// The panel refreshes itself from the display memory at a rate set by its own oscillator, unsynchronized to the updates sent over
+// SPI, which shows up as a tearing band where the scan crosses the update in progress. When the source frame rate is not close to
+// a multiple of the refresh rate, the band moves at their beat frequency and is easy to see. The panel refresh rate is instead
+// matched to the source frame rate, and the updates are started at a steady phase of the source frame cadence.
+
+// Called on the main thread for each new frame with the time it was captured, after its arrival has been added to the frame rate
+// histogram. Returns true if the source frame rate has settled to a cadence that another refresh rate setting matches better: the
+// new setting must then be queued with QueuePanelRefreshRate() before the pixels of the frame.
+bool UpdatePanelRefreshRate(uint64_t captureTime);
+
+// Queues the command to set the panel refresh rate. Returns the number of bytes queued.
+int QueuePanelRefreshRate(void);
+
+// Called on the main thread before the pixels of a new frame are queued. Sleeps until the phase of the source frame cadence that
+// the latest recent updates have started at, if this update is ready to go out earlier in the cadence than that.
+void WaitForPanelRefreshPhase(void);
+
+#endif
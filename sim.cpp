@@ -0,0 +1,748 @@
+#include "config.h"
+
+#ifdef SIMULATOR
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <linux/input.h>
+#include <memory.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "display.h"
+#include "presentation.h"
+#include "spi.h"
+#include "touch.h"
+#include "trace.h"
+#include "util.h"
+
+// This file implements the simulated primitives, so it needs the real ones
+#undef usleep
+#undef syscall
+#undef pthread_create
+#undef pthread_join
+
+// Virtual clock and scheduler. Exactly one registered thread is running at any time, all others are waiting on their condition
+// variable for their turn. When the running thread blocks, the next thread to run is the one that has been ready the longest,
+// or if none are ready, the virtual clock is advanced to the earliest time that a blocked thread is due to wake up.
+#define SIM_MAX_THREADS 16
+#define SIM_NEVER UINT64_MAX
+
+enum SimThreadState
+{
+  SIM_RUNNING,
+  SIM_READY,
+  SIM_BLOCKED,
+  SIM_EXITED, // Returned from its start routine, waiting to be joined
+  SIM_JOINED // Slot can be reused by a new thread
+};
+
+struct SimThread
+{
+  const char *name;
+  pthread_cond_t wakeup;
+  SimThreadState state;
+  uint64_t wakeTime; // If blocked, when the thread is due to wake up regardless of futex wakes
+  volatile void *futexAddress; // If blocked in a futex wait, the futex that is being waited on
+  bool timedOut; // True if the last futex wait returned due to timeout
+  uint64_t readyOrder; // Ready threads are run in the order they became ready in
+  uint64_t wakeups; // Number of times the thread has returned from a blocking call
+  void *(*startRoutine)(void*);
+  void *arg;
+  pthread_t handle;
+};
+
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static SimThread simThreads[SIM_MAX_THREADS];
+static int numSimThreads = 0;
+static int simRunningThread = -1;
+static __thread int simThreadIndex = -1;
+static uint64_t simReadyCounter = 0;
+static uint64_t simTime = 1000000; // Start the clock at a nonzero time, the pipeline treats time 0 as "never"
+
+// Simulation parameters, see config.h
+static uint64_t simDuration = SIM_DURATION_USECS;
+static int simSourceFps = SIM_SOURCE_FPS;
+static int simSourceJitter = SIM_SOURCE_JITTER_USECS;
+static int simSourceRectSize = SIM_SOURCE_RECT_SIZE;
+static int simSourceDither = SIM_SOURCE_DITHER;
+static int simSourceFade = SIM_SOURCE_FADE;
+static int simSourcePattern = SIM_SOURCE_PATTERN;
+static int simSpiCoreClock = SIM_SPI_CORE_CLOCK_MHZ;
+static uint32_t simSeed = SIM_SEED;
+static int simVsyncHz = SIM_VSYNC_HZ;
+static int simSourcePhase = SIM_SOURCE_PHASE_USECS;
+#ifdef TOUCH_CONTROLLER_STMPE610
+static int simTouchTaps = SIM_TOUCH_TAPS_PER_SEC;
+#endif
+static uint64_t simStartTime = 0;
+static FrameTrace *simTrace = 0; // If replaying a recorded frame trace, source frames come from it instead (FBCP_SIM_TRACE)
+
+// Measurements
+static uint64_t simBusBusyUsecs = 0;
+static double simBusUsecsRemainder = 0;
+static uint64_t simSnapshots = 0, simWastedSnapshots = 0;
+static int64_t simFirstCapturedFrame = -1, simLastCapturedFrame = -1;
+static uint64_t simCapturedFrames = 0;
+static uint64_t simUpdates = 0, simInterlacedUpdates = 0, simUpdateBytes = 0, simPipelineSkippedFrames = 0;
+static uint32_t *simLatencies = 0; // Latency from source frame arrival to the last byte of the frame leaving the SPI bus, for each displayed frame
+static int simNumLatencies = 0, simMaxLatencies = 0;
+static uint64_t simPlanningStartNsecs = 0, simPlanningNsecs = 0, simMaxPlanningNsecs = 0, simPlannedFrames = 0; // Host CPU time, not virtual time
+static uint64_t simCopyingStartNsecs = 0, simCopyingNsecs = 0;
+
+// Maps snapshot times to the source frames they captured, so that presented frames can be traced back to their source frame.
+#define SIM_SNAPSHOT_HISTORY 64
+struct SimSnapshot
+{
+  uint64_t time;
+  int64_t frame;
+};
+static SimSnapshot simSnapshotHistory[SIM_SNAPSHOT_HISTORY];
+static uint64_t simPendingCaptureTime = 0, simPendingLastByteTime = 0; // The most recently presented source frame, whose latency is final once a later one is presented
+
+static uint32_t SimHash(uint32_t x)
+{
+  x ^= simSeed * 0x9E3779B9u;
+  x ^= x >> 16; x *= 0x7FEB352Du;
+  x ^= x >> 15; x *= 0x846CA68Bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// Source frame k arrives at k*interval, offset by a pseudorandom jitter that is smaller than half the interval, so frames stay in order.
+static uint64_t SourceFrameArrivalTime(int64_t k)
+{
+  if (simTrace) // Replay the trace at the pace it was captured at, the last frame stays up once the trace runs out
+    return (k < simTrace->numFrames) ? simStartTime + simTrace->frames[k].captureTime - simTrace->frames[0].captureTime : UINT64_MAX;
+  int64_t interval = 1000000 / simSourceFps;
+  int64_t jitter = MIN(simSourceJitter, interval/2 - 1);
+  int64_t offset = (jitter > 0) ? (int64_t)(SimHash((uint32_t)k) % (2*jitter + 1)) - jitter : 0;
+  return simStartTime + simSourcePhase + k * interval + offset;
+}
+
+// Returns the most recent source frame that has arrived by the given time, or -1 if none has.
+static int64_t SourceFrameAt(uint64_t t)
+{
+  if (simTrace)
+  {
+    int64_t lo = -1, hi = simTrace->numFrames - 1; // Binary search for the last frame that has arrived
+    while(lo < hi)
+    {
+      int64_t mid = (lo + hi + 1) / 2;
+      if (SourceFrameArrivalTime(mid) <= t) lo = mid;
+      else hi = mid - 1;
+    }
+    return lo;
+  }
+  int64_t interval = 1000000 / simSourceFps;
+  int64_t k = ((int64_t)t - (int64_t)simStartTime - simSourcePhase) / interval + 1;
+  while(k >= 0 && SourceFrameArrivalTime(k) > t) --k;
+  return k;
+}
+
+// Renders source frame k: a square moving across a black background, in a different color each frame. If dithering is enabled,
+// the background is instead a gray gradient that is temporally dithered, with every pixel toggling up and down on each frame. If
+// fading is enabled, the background is a gray gradient, and the whole frame repeatedly fades to black and back. The adversarial
+// patterns replace the background with ones that dirty the frame in the most fragmented ways.
+static void RenderSourceFrame(int64_t k, uint16_t *dst, int dstPitch)
+{
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    uint16_t *scanline = (uint16_t*)((uint8_t*)dst + y*dstPitch);
+    if (simSourcePattern == 1)
+      for(int x = 0; x < DISPLAY_WIDTH; ++x) scanline[x] = (uint16_t)SimHash((uint32_t)(k * DISPLAY_WIDTH * DISPLAY_HEIGHT + y * DISPLAY_WIDTH + x));
+    else if (simSourcePattern == 2) // Dots 6 pixels apart, shifted by 3 on each scanline, so that neither horizontal nor vertical neighbors merge
+      for(int x = 0; x < DISPLAY_WIDTH; ++x) scanline[x] = ((k & 1) && (x + 3*y) % 6 == 0) ? 0xFFFF : 0;
+    else if (!simSourceDither && !simSourceFade) memset(scanline, 0, DISPLAY_WIDTH*DISPLAY_BYTESPERPIXEL);
+    else for(int x = 0; x < DISPLAY_WIDTH; ++x)
+    {
+      int v = MIN(31, x * 24 / DISPLAY_WIDTH + (((x + y + (int)k) & 1) ? simSourceDither : 0));
+      scanline[x] = (uint16_t)((v << 11) | (2*v << 5) | v);
+    }
+  }
+  if (k < 0) return;
+  if (simTrace)
+  {
+    const uint16_t *frame = DecodeFrameTraceFrame(simTrace, (int)k);
+    if (!frame) FATAL_ERROR("Simulator: frame trace is corrupt!");
+    for(int y = 0; y < DISPLAY_HEIGHT; ++y) memcpy((uint8_t*)dst + y*dstPitch, frame + y*DISPLAY_WIDTH, DISPLAY_WIDTH*DISPLAY_BYTESPERPIXEL);
+    return;
+  }
+  int size = MIN(simSourceRectSize, MIN(DISPLAY_WIDTH, DISPLAY_HEIGHT));
+  int x0 = (int)((k * 4) % (DISPLAY_WIDTH - size + 1));
+  int y0 = (int)((k * 3) % (DISPLAY_HEIGHT - size + 1));
+  uint16_t color = (uint16_t)(SimHash((uint32_t)k + 0x51ED) | 1);
+  for(int y = y0; y < y0 + size; ++y)
+  {
+    uint16_t *scanline = (uint16_t*)((uint8_t*)dst + y*dstPitch);
+    for(int x = x0; x < x0 + size; ++x) scanline[x] = color;
+  }
+  if (!simSourceFade) return;
+  int phase = (int)(k % simSourceFade);
+  int level = abs(2*phase - simSourceFade) * 255 / simSourceFade; // Triangle wave from full brightness down to black and back
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+  {
+    uint16_t *scanline = (uint16_t*)((uint8_t*)dst + y*dstPitch);
+    for(int x = 0; x < DISPLAY_WIDTH; ++x)
+    {
+      uint16_t p = scanline[x];
+      scanline[x] = (uint16_t)((((p >> 11) * level / 255) << 11) | ((((p >> 5) & 0x3F) * level / 255) << 5) | ((p & 0x1F) * level / 255));
+    }
+  }
+}
+
+static void SimInit()
+{
+  if (getenv("FBCP_SIM_DURATION")) simDuration = strtoull(getenv("FBCP_SIM_DURATION"), 0, 10);
+  if (getenv("FBCP_SIM_FPS")) simSourceFps = MAX(1, atoi(getenv("FBCP_SIM_FPS")));
+  if (getenv("FBCP_SIM_JITTER")) simSourceJitter = MAX(0, atoi(getenv("FBCP_SIM_JITTER")));
+  if (getenv("FBCP_SIM_RECT")) simSourceRectSize = MAX(1, atoi(getenv("FBCP_SIM_RECT")));
+  if (getenv("FBCP_SIM_DITHER")) simSourceDither = MAX(0, atoi(getenv("FBCP_SIM_DITHER")));
+  if (getenv("FBCP_SIM_FADE")) simSourceFade = MAX(0, atoi(getenv("FBCP_SIM_FADE")));
+  if (getenv("FBCP_SIM_PATTERN")) simSourcePattern = MAX(0, atoi(getenv("FBCP_SIM_PATTERN")));
+  if (getenv("FBCP_SIM_CORE_CLOCK")) simSpiCoreClock = MAX(1, atoi(getenv("FBCP_SIM_CORE_CLOCK")));
+  if (getenv("FBCP_SIM_SEED")) simSeed = (uint32_t)atoi(getenv("FBCP_SIM_SEED"));
+  if (getenv("FBCP_SIM_VSYNC")) simVsyncHz = MAX(0, atoi(getenv("FBCP_SIM_VSYNC")));
+  if (getenv("FBCP_SIM_PHASE")) simSourcePhase = MAX(0, atoi(getenv("FBCP_SIM_PHASE")));
+#ifdef TOUCH_CONTROLLER_STMPE610
+  if (getenv("FBCP_SIM_TOUCH")) simTouchTaps = MIN(1000000, MAX(0, atoi(getenv("FBCP_SIM_TOUCH")))); // At most one tap per usec
+#endif
+  simStartTime = simTime;
+  if (getenv("FBCP_SIM_TRACE"))
+  {
+    simTrace = OpenFrameTrace(getenv("FBCP_SIM_TRACE"));
+    if (!simTrace) FATAL_ERROR("Simulator: failed to open the frame trace given in FBCP_SIM_TRACE!");
+    if (simTrace->header.width != DISPLAY_WIDTH || simTrace->header.height != DISPLAY_HEIGHT || simTrace->numFrames == 0)
+      FATAL_ERROR("Simulator: the frame trace is empty, or was recorded at a different display size!");
+    printf("Replaying frame trace %s: %d frames over %.2f seconds\n", getenv("FBCP_SIM_TRACE"), simTrace->numFrames,
+      (simTrace->frames[simTrace->numFrames-1].captureTime - simTrace->frames[0].captureTime) / 1000000.0);
+  }
+  printf("Simulating %.2f seconds: source at %d fps with +/-%d usecs jitter, %dx%d pixels changing per frame, SPI core clock %d MHz, seed %u\n",
+    simDuration / 1000000.0, simSourceFps, simSourceJitter, simSourceRectSize, simSourceRectSize, simSpiCoreClock, simSeed);
+
+  // The thread that first calls into the simulator is the main thread, which is running
+  SimThread *t = &simThreads[numSimThreads];
+  memset(t, 0, sizeof(SimThread));
+  t->name = "main";
+  pthread_cond_init(&t->wakeup, 0);
+  t->state = SIM_RUNNING;
+  simThreadIndex = simRunningThread = numSimThreads++;
+}
+
+static SimThread *SimCurrentThread()
+{
+  if (simThreadIndex < 0)
+  {
+    if (numSimThreads > 0) FATAL_ERROR("Simulator: a thread that was not created with pthread_create() called into the simulator!");
+    SimInit();
+  }
+  return &simThreads[simThreadIndex];
+}
+
+static int CompareLatencies(const void *a, const void *b) { return *(const uint32_t*)a < *(const uint32_t*)b ? -1 : (*(const uint32_t*)a > *(const uint32_t*)b); }
+
+static void RecordPresentedSourceFrame()
+{
+  if (!simPendingCaptureTime) return;
+  for(int i = 0; i < SIM_SNAPSHOT_HISTORY; ++i)
+    if (simSnapshotHistory[i].time == simPendingCaptureTime)
+    {
+      if (simNumLatencies == simMaxLatencies)
+      {
+        simMaxLatencies = MAX(1024, simMaxLatencies*2);
+        simLatencies = (uint32_t*)realloc(simLatencies, simMaxLatencies*sizeof(uint32_t));
+        if (!simLatencies) FATAL_ERROR("Simulator: out of memory!");
+      }
+      simLatencies[simNumLatencies++] = (uint32_t)(simPendingLastByteTime - SourceFrameArrivalTime(simSnapshotHistory[i].frame));
+      break;
+    }
+  simPendingCaptureTime = 0;
+}
+
+#ifdef TOUCH_CONTROLLER_STMPE610
+static void SimReportTouch(uint64_t elapsed);
+#endif
+
+static void SimReport()
+{
+  RecordPresentedSourceFrame();
+  uint64_t elapsed = simTime - simStartTime;
+  int64_t sourceFrames = SourceFrameAt(simTime) + 1;
+  uint64_t missedCaptures = (simFirstCapturedFrame >= 0) ? (simLastCapturedFrame - simFirstCapturedFrame + 1) - simCapturedFrames : 0;
+  printf("\nSimulated %.2f seconds:\n", elapsed / 1000000.0);
+  printf("  Source frames:    %" PRId64 " produced, %" PRIu64 " captured, %" PRIu64 " never captured, %" PRIu64 " captured but skipped, %d displayed\n",
+    sourceFrames, simCapturedFrames, missedCaptures, simPipelineSkippedFrames, simNumLatencies);
+  printf("  Display updates:  %" PRIu64 " (%" PRIu64 " interlaced), %.2f updates/sec, %.1f KB/update\n",
+    simUpdates, simInterlacedUpdates, simUpdates * 1000000.0 / MAX(elapsed, 1), simUpdates ? simUpdateBytes / 1024.0 / simUpdates : 0.0);
+  if (simNumLatencies > 0)
+  {
+    qsort(simLatencies, simNumLatencies, sizeof(uint32_t), CompareLatencies);
+    uint64_t sum = 0;
+    for(int i = 0; i < simNumLatencies; ++i) sum += simLatencies[i];
+    printf("  Frame latency:    avg %.2f ms, median %.2f ms, 95th %.2f ms, max %.2f ms (source frame arrival to last byte on the bus)\n",
+      sum / 1000.0 / simNumLatencies, simLatencies[simNumLatencies/2] / 1000.0, simLatencies[simNumLatencies*95/100] / 1000.0, simLatencies[simNumLatencies-1] / 1000.0);
+  }
+  printf("  GPU polls:        %" PRIu64 " snapshots, %" PRIu64 " (%.1f%%) found no new frame\n",
+    simSnapshots, simWastedSnapshots, simSnapshots ? simWastedSnapshots * 100.0 / simSnapshots : 0.0);
+  printf("  SPI bus:          %.1f%% busy, idle for %.2f ms in total\n", simBusBusyUsecs * 100.0 / MAX(elapsed, 1), (elapsed - MIN(elapsed, simBusBusyUsecs)) / 1000.0);
+  printf("  Planning:         avg %.1f usecs, max %.1f usecs per frame (host CPU time)\n",
+    simPlannedFrames ? simPlanningNsecs / 1000.0 / simPlannedFrames : 0.0, simMaxPlanningNsecs / 1000.0);
+#ifdef SPI_PIXEL_DESCRIPTORS
+  const int framebuffers = SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS + 1; // The pool, and the previous frame
+#else
+  const int framebuffers = 2;
+#endif
+  printf("  Copying:          avg %.1f usecs per frame (host CPU time), %d KB of frame buffers and task queue\n",
+    simPlannedFrames ? simCopyingNsecs / 1000.0 / simPlannedFrames : 0.0, (int)((framebuffers * FRAMEBUFFER_SIZE + SHARED_MEMORY_SIZE) / 1024));
+#ifdef TOUCH_CONTROLLER_STMPE610
+  SimReportTouch(elapsed);
+#endif
+  printf("  Thread wakeups:  ");
+  for(int i = 0; i < numSimThreads; ++i) printf(" %s: %" PRIu64 "%s", simThreads[i].name, simThreads[i].wakeups, i + 1 < numSimThreads ? "," : "\n");
+  fflush(stdout);
+}
+
+// Picks the next thread to run and hands over to it. Called with simLock held.
+static void SimScheduleNext()
+{
+  for(;;)
+  {
+    // Threads whose sleep has elapsed become ready, in order of their wake up times
+    for(;;)
+    {
+      int due = -1;
+      for(int i = 0; i < numSimThreads; ++i)
+        if (simThreads[i].state == SIM_BLOCKED && simThreads[i].wakeTime <= simTime && (due < 0 || simThreads[i].wakeTime < simThreads[due].wakeTime))
+          due = i;
+      if (due < 0) break;
+      if (simThreads[due].futexAddress) simThreads[due].timedOut = true;
+      simThreads[due].futexAddress = 0;
+      simThreads[due].state = SIM_READY;
+      simThreads[due].readyOrder = ++simReadyCounter;
+    }
+
+    int next = -1;
+    for(int i = 0; i < numSimThreads; ++i)
+      if (simThreads[i].state == SIM_READY && (next < 0 || simThreads[i].readyOrder < simThreads[next].readyOrder))
+        next = i;
+    if (next >= 0)
+    {
+      simThreads[next].state = SIM_RUNNING;
+      simRunningThread = next;
+      pthread_cond_signal(&simThreads[next].wakeup);
+      return;
+    }
+
+    // Nothing can run now, so advance the clock
+    uint64_t nextWakeTime = SIM_NEVER;
+    for(int i = 0; i < numSimThreads; ++i)
+      if (simThreads[i].state == SIM_BLOCKED) nextWakeTime = MIN(nextWakeTime, simThreads[i].wakeTime);
+    if (nextWakeTime == SIM_NEVER) FATAL_ERROR("Simulator: deadlock, all threads are waiting on futexes with no timeout!");
+    simTime = nextWakeTime;
+    if (simTime - simStartTime >= simDuration)
+    {
+      SimReport();
+      _exit(0);
+    }
+  }
+}
+
+// Blocks the calling thread until it is scheduled to run again. Called with simLock held.
+static void SimBlock(SimThread *t)
+{
+  SimScheduleNext();
+  int self = (int)(t - simThreads);
+  while(simRunningThread != self) pthread_cond_wait(&t->wakeup, &simLock);
+  ++t->wakeups;
+}
+
+uint64_t SimTime()
+{
+  return simTime;
+}
+
+int SimUsleep(useconds_t usecs)
+{
+  pthread_mutex_lock(&simLock);
+  SimThread *t = SimCurrentThread();
+  t->state = SIM_BLOCKED;
+  t->wakeTime = simTime + usecs;
+  t->futexAddress = 0;
+  SimBlock(t);
+  pthread_mutex_unlock(&simLock);
+  return 0;
+}
+
+long SimSyscall(long number, ...)
+{
+  if (number == SYS_gettid) return syscall(SYS_gettid);
+  if (number != SYS_futex)
+  {
+    errno = ENOSYS;
+    return -1;
+  }
+  va_list args;
+  va_start(args, number);
+  volatile int *address = va_arg(args, volatile int *);
+  int op = va_arg(args, int) & FUTEX_CMD_MASK;
+  int val = va_arg(args, int);
+  const struct timespec *timeout = va_arg(args, const struct timespec *);
+  va_end(args);
+
+  long ret = 0;
+  pthread_mutex_lock(&simLock);
+  SimThread *t = SimCurrentThread();
+  if (op == FUTEX_WAIT)
+  {
+    if (*address != val)
+    {
+      errno = EAGAIN;
+      ret = -1;
+    }
+    else
+    {
+      t->state = SIM_BLOCKED;
+      t->wakeTime = timeout ? simTime + timeout->tv_sec * 1000000ull + timeout->tv_nsec / 1000 : SIM_NEVER;
+      t->futexAddress = address;
+      t->timedOut = false;
+      SimBlock(t);
+      if (t->timedOut)
+      {
+        errno = ETIMEDOUT;
+        ret = -1;
+      }
+    }
+  }
+  else if (op == FUTEX_WAKE)
+  {
+    // Woken threads become ready, but the calling thread keeps running until it blocks
+    for(int i = 0; i < numSimThreads && ret < val; ++i)
+      if (simThreads[i].state == SIM_BLOCKED && simThreads[i].futexAddress == address)
+      {
+        simThreads[i].futexAddress = 0;
+        simThreads[i].state = SIM_READY;
+        simThreads[i].readyOrder = ++simReadyCounter;
+        ++ret;
+      }
+  }
+  else
+  {
+    errno = ENOSYS;
+    ret = -1;
+  }
+  pthread_mutex_unlock(&simLock);
+  return ret;
+}
+
+static void *SimThreadTrampoline(void *arg)
+{
+  SimThread *t = (SimThread*)arg;
+  pthread_mutex_lock(&simLock);
+  simThreadIndex = (int)(t - simThreads);
+  while(simRunningThread != simThreadIndex) pthread_cond_wait(&t->wakeup, &simLock);
+  pthread_mutex_unlock(&simLock);
+  void *ret = t->startRoutine(t->arg);
+
+  // Hand over to the next thread for good
+  pthread_mutex_lock(&simLock);
+  t->state = SIM_EXITED;
+  SimScheduleNext();
+  pthread_mutex_unlock(&simLock);
+  return ret;
+}
+
+int SimCreateThread(pthread_t *thread, const pthread_attr_t *attr, void *(*startRoutine)(void*), void *arg, const char *name)
+{
+  pthread_mutex_lock(&simLock);
+  SimCurrentThread();
+  SimThread *t = 0;
+  for(int i = 0; i < numSimThreads && !t; ++i)
+    if (simThreads[i].state == SIM_JOINED) t = &simThreads[i];
+  if (!t)
+  {
+    if (numSimThreads >= SIM_MAX_THREADS) FATAL_ERROR("Simulator: too many threads!");
+    t = &simThreads[numSimThreads++];
+  }
+  memset(t, 0, sizeof(SimThread));
+  t->name = name;
+  pthread_cond_init(&t->wakeup, 0);
+  t->state = SIM_READY;
+  t->readyOrder = ++simReadyCounter;
+  t->startRoutine = startRoutine;
+  t->arg = arg;
+  int rc = pthread_create(&t->handle, attr, SimThreadTrampoline, t);
+  if (rc != 0) t->state = SIM_JOINED;
+  else *thread = t->handle;
+  pthread_mutex_unlock(&simLock);
+  return rc;
+}
+
+int SimJoinThread(pthread_t thread, void **retval)
+{
+  SimThread *t = 0;
+  pthread_mutex_lock(&simLock);
+  for(int i = 0; i < numSimThreads && !t; ++i)
+    if (simThreads[i].state != SIM_JOINED && simThreads[i].startRoutine && pthread_equal(simThreads[i].handle, thread)) t = &simThreads[i];
+  pthread_mutex_unlock(&simLock);
+  if (!t) return pthread_join(thread, retval);
+
+  // The thread needs the virtual clock to run to its exit, so poll for it in virtual time rather than blocking the whole simulation
+  while(__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != SIM_EXITED) SimUsleep(100);
+  int rc = pthread_join(thread, retval);
+  pthread_mutex_lock(&simLock);
+  t->state = SIM_JOINED;
+  pthread_mutex_unlock(&simLock);
+  return rc;
+}
+
+void SimSPITransfer(uint32_t bytes)
+{
+  // Same model as the nominal bus cost in InitSPI(), but against the simulated core clock, plus the FIFO flushes of each task
+  double usecsPerByte = 8.0 * SPI_BUS_CLOCK_DIVISOR * 9.0/8.0 / simSpiCoreClock;
+  simBusUsecsRemainder += (bytes + SIM_SPI_TASK_OVERHEAD_BYTES) * usecsPerByte;
+  uint32_t usecs = (uint32_t)simBusUsecsRemainder;
+  simBusUsecsRemainder -= usecs;
+  simBusBusyUsecs += usecs;
+  if (usecs > 0) SimUsleep(usecs);
+}
+
+#ifdef TOUCH_CONTROLLER_STMPE610
+// Model of the STMPE610 touch controller. A finger taps the screen simTouchTaps times per second, holding each tap for a quarter of
+// the period, at a position that moves from tap to tap. While the screen is touched, the controller adds a sample to its FIFO every
+// SIM_TOUCH_SAMPLE_USECS, and each read of the data register pops one byte of the oldest sample.
+#define SIM_TOUCH_SAMPLE_USECS 2000
+#define SIM_TOUCH_FIFO_SIZE 128
+
+static uint8_t simTouchRegisters[256];
+static int simTouchFifoSamples = 0, simTouchFifoByte = 0;
+static uint64_t simTouchLastSampleTime = 0;
+static uint64_t simTouchPolls = 0, simTouchPresses = 0, simTouchReleases = 0, simTouchWrongPositions = 0;
+static uint64_t simTouchLatencySum = 0, simTouchMaxLatency = 0;
+static int simTouchReportedX = -1, simTouchReportedY = -1;
+
+// Returns the index of the tap that is down at the given time, or -1 if the screen is not touched.
+static int64_t SimTouchTapAt(uint64_t t)
+{
+  if (simTouchTaps <= 0) return -1;
+  uint64_t period = 1000000 / simTouchTaps, phase = (t - simStartTime) % period;
+  return (phase >= period/2 && phase < period*3/4) ? (int64_t)((t - simStartTime) / period) : -1;
+}
+
+static uint64_t SimTouchTapStartTime(int64_t tap)
+{
+  uint64_t period = 1000000 / simTouchTaps;
+  return simStartTime + tap * period + period/2;
+}
+
+static void SimTouchTapPosition(int64_t tap, int *x, int *y)
+{
+  *x = 200 + (int)((tap * 977) % 3600);
+  *y = 200 + (int)((tap * 1409) % 3600);
+}
+
+static void SimAdvanceTouchFifo()
+{
+  bool enabled = simTouchRegisters[STMPE_TSC_CTRL] & STMPE_TSC_CTRL_EN_XYZ;
+  if (!enabled || SimTouchTapAt(simTime) < 0)
+  {
+    simTouchLastSampleTime = simTime;
+    return;
+  }
+  while(simTouchLastSampleTime + SIM_TOUCH_SAMPLE_USECS <= simTime)
+  {
+    simTouchLastSampleTime += SIM_TOUCH_SAMPLE_USECS;
+    if (simTouchFifoSamples < SIM_TOUCH_FIFO_SIZE) ++simTouchFifoSamples;
+  }
+}
+
+static uint8_t SimReadTouchRegister(uint8_t reg)
+{
+  switch(reg)
+  {
+  case STMPE_CHIP_ID: return 0x08;
+  case STMPE_CHIP_ID+1: return 0x11;
+  case STMPE_TSC_CTRL: return (simTouchRegisters[STMPE_TSC_CTRL] & ~STMPE_TSC_CTRL_TOUCH_DET) | (SimTouchTapAt(simTime) >= 0 ? STMPE_TSC_CTRL_TOUCH_DET : 0);
+  case STMPE_FIFO_SIZE: return (uint8_t)simTouchFifoSamples;
+  case STMPE_TSC_DATA_XYZ & ~STMPE_READ:
+  {
+    if (simTouchFifoSamples == 0) return 0;
+    int64_t tap = SimTouchTapAt(simTime);
+    int x = 0, y = 0;
+    if (tap >= 0) SimTouchTapPosition(tap, &x, &y);
+    uint8_t sample[4] = { (uint8_t)(x >> 4), (uint8_t)(((x & 0x0F) << 4) | (y >> 8)), (uint8_t)y, 0x40 };
+    uint8_t byte = sample[simTouchFifoByte];
+    if (++simTouchFifoByte == 4)
+    {
+      simTouchFifoByte = 0;
+      --simTouchFifoSamples;
+    }
+    return byte;
+  }
+  default: return simTouchRegisters[reg];
+  }
+}
+
+void SimTouchTransfer(const uint8_t *tx, uint8_t *rx, int bytes)
+{
+  SimAdvanceTouchFifo();
+  if (tx[0] == (STMPE_READ | STMPE_TSC_CTRL)) ++simTouchPolls;
+  memset(rx, 0, bytes);
+  if (!(tx[0] & STMPE_READ))
+  {
+    // Register write: address byte followed by the value
+    if (bytes >= 2) simTouchRegisters[tx[0]] = tx[1];
+    if (tx[0] == STMPE_FIFO_STA && (tx[1] & STMPE_FIFO_STA_RESET)) simTouchFifoSamples = simTouchFifoByte = 0;
+  }
+  else // Register reads: the value of each address byte comes back while the next byte is sent
+    for(int i = 0; i + 1 < bytes; ++i)
+      if (tx[i] & STMPE_READ) rx[i+1] = SimReadTouchRegister(tx[i] & ~STMPE_READ);
+
+  // The bus runs at the touch controller clock for the transfer
+  uint32_t usecs = (uint32_t)(bytes * 8.0 * TOUCH_SPI_CLOCK_DIVISOR * 9.0/8.0 / simSpiCoreClock);
+  simBusBusyUsecs += usecs;
+  if (usecs > 0) SimUsleep(usecs);
+}
+
+void SimTouchEvent(uint16_t type, uint16_t code, int32_t value)
+{
+  if (type == EV_ABS && code == ABS_X) simTouchReportedX = value;
+  else if (type == EV_ABS && code == ABS_Y) simTouchReportedY = value;
+  else if (type == EV_KEY && code == BTN_TOUCH && value == 0) ++simTouchReleases;
+  else if (type == EV_KEY && code == BTN_TOUCH && value == 1)
+  {
+    int64_t tap = SimTouchTapAt(simTime);
+    if (tap < 0) FATAL_ERROR("Simulator: touch press reported while the screen was not touched!");
+    ++simTouchPresses;
+    uint64_t latency = simTime - SimTouchTapStartTime(tap);
+    simTouchLatencySum += latency;
+    simTouchMaxLatency = MAX(simTouchMaxLatency, latency);
+  }
+  else if (type == EV_SYN && simTouchReportedX >= 0)
+  {
+    int64_t tap = SimTouchTapAt(simTime);
+    int x = -1, y = -1;
+    if (tap >= 0) SimTouchTapPosition(tap, &x, &y);
+    if (simTouchReportedX != x || simTouchReportedY != y) ++simTouchWrongPositions;
+    simTouchReportedX = simTouchReportedY = -1;
+  }
+}
+
+static void SimReportTouch(uint64_t elapsed)
+{
+  uint64_t taps = simTouchTaps > 0 ? (elapsed + 1000000 / simTouchTaps / 4) * simTouchTaps / 1000000 : 0; // Taps that started during the run
+  printf("  Touch:            %" PRIu64 " polls, %" PRIu64 " of %" PRIu64 " taps reported, %" PRIu64 " released, %" PRIu64 " wrong positions, press latency avg %.2f ms, max %.2f ms\n",
+    simTouchPolls, simTouchPresses, taps, simTouchReleases, simTouchWrongPositions, simTouchPresses ? simTouchLatencySum / 1000.0 / simTouchPresses : 0.0, simTouchMaxLatency / 1000.0);
+}
+#endif
+
+int SimCoreClock()
+{
+  return simSpiCoreClock;
+}
+
+static uint64_t SimHostThreadNsecs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void SimBeginPlanning()
+{
+  simPlanningStartNsecs = SimHostThreadNsecs();
+}
+
+void SimEndPlanning()
+{
+  uint64_t nsecs = SimHostThreadNsecs() - simPlanningStartNsecs;
+  simPlanningNsecs += nsecs;
+  simMaxPlanningNsecs = MAX(simMaxPlanningNsecs, nsecs);
+  ++simPlannedFrames;
+}
+
+void SimBeginCopying()
+{
+  simCopyingStartNsecs = SimHostThreadNsecs();
+}
+
+void SimEndCopying()
+{
+  simCopyingNsecs += SimHostThreadNsecs() - simCopyingStartNsecs;
+}
+
+void SimFramePresented(const PresentedFrame *frame)
+{
+  ++simUpdates;
+  if (frame->interlaced) ++simInterlacedUpdates;
+  simUpdateBytes += frame->bytes;
+  simPipelineSkippedFrames += frame->skippedFrames;
+  // The interlaced fields of a frame carry the same capture time, the frame is fully displayed when its last field is
+  if (frame->captureTime != simPendingCaptureTime) RecordPresentedSourceFrame();
+  simPendingCaptureTime = frame->captureTime;
+  simPendingLastByteTime = frame->lastByteTime;
+}
+
+void bcm_host_init() {}
+DISPMANX_DISPLAY_HANDLE_T vc_dispmanx_display_open(uint32_t device) { return 1; }
+int vc_dispmanx_display_get_info(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_MODEINFO_T *pinfo) { pinfo->width = DISPLAY_WIDTH; pinfo->height = DISPLAY_HEIGHT; return 0; }
+DISPMANX_RESOURCE_HANDLE_T vc_dispmanx_resource_create(int type, uint32_t width, uint32_t height, uint32_t *nativeImageHandle) { return 1; }
+int vc_dispmanx_rect_set(VC_RECT_T *rect, uint32_t x, uint32_t y, uint32_t width, uint32_t height) { rect->x = x; rect->y = y; rect->width = width; rect->height = height; return 0; }
+static DISPMANX_CALLBACK_FUNC_T simVsyncCallback = 0;
+static void *simVsyncCallbackArg = 0;
+
+// Calls the vsync callback at simVsyncHz, with the vsyncs aligned to the start of the simulation like the source frames are
+static void *vsync(void *unused)
+{
+  uint64_t period = 1000000 / simVsyncHz;
+  for(;;)
+  {
+    SimUsleep((useconds_t)(period - (simTime - simStartTime) % period));
+    simVsyncCallback(0, simVsyncCallbackArg);
+  }
+  return 0;
+}
+
+int vc_dispmanx_vsync_callback(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_CALLBACK_FUNC_T callback, void *arg)
+{
+  simVsyncCallback = callback;
+  simVsyncCallbackArg = arg;
+  pthread_t thread;
+  if (simVsyncHz > 0) SimCreateThread(&thread, 0, vsync, 0, "vsync");
+  return 0;
+}
+
+static int64_t simSnapshotFrame = -1;
+
+int vc_dispmanx_snapshot(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_RESOURCE_HANDLE_T resource, DISPMANX_TRANSFORM_T transform)
+{
+  uint64_t t0 = SimTime();
+  int64_t frame = SourceFrameAt(t0);
+  ++simSnapshots;
+  if (frame == simSnapshotFrame) ++simWastedSnapshots;
+  else if (frame >= 0)
+  {
+    if (simFirstCapturedFrame < 0) simFirstCapturedFrame = frame;
+    simLastCapturedFrame = frame;
+    ++simCapturedFrames;
+  }
+  simSnapshotFrame = frame;
+  simSnapshotHistory[simSnapshots % SIM_SNAPSHOT_HISTORY].time = t0;
+  simSnapshotHistory[simSnapshots % SIM_SNAPSHOT_HISTORY].frame = frame;
+  SimUsleep(SIM_SNAPSHOT_USECS);
+  return 0;
+}
+
+int vc_dispmanx_resource_read_data(DISPMANX_RESOURCE_HANDLE_T resource, const VC_RECT_T *rect, void *dst, int dstPitch)
+{
+  RenderSourceFrame(simSnapshotFrame, (uint16_t*)dst, dstPitch);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+// Discrete-event simulator of the capture/plan/SPI thread pipeline. When building with SIMULATOR defined (cmake -DSIMULATOR=ON),
+// the real pipeline code is run on the host against a virtual clock, a simulated source of frames in place of the VideoCore GPU,
+// and a timing model of the SPI bus in place of the hardware. Only one thread runs at a time, and the virtual clock only advances
+// when all threads are blocked in usleep() or in a futex wait, so the run is fully deterministic, and several seconds of pipeline
+// time are simulated in a fraction of that. At the end of the run, per-frame latencies, skipped frames, poll wakeups and bus idle
+// time are reported.
+
+#ifdef SIMULATOR
+
+#ifdef KERNEL_MODULE_CLIENT
+#error SIMULATOR runs the SPI thread against a simulated bus, it is not supported with KERNEL_MODULE_CLIENT
+#endif
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct PresentedFrame;
+
+uint64_t SimTime(void); // Current virtual time in usecs
+int SimUsleep(useconds_t usecs); // Blocks the calling thread for the given amount of virtual time
+long SimSyscall(long number, ...); // Handles FUTEX_WAIT and FUTEX_WAKE against the virtual clock
+int SimCreateThread(pthread_t *thread, const pthread_attr_t *attr, void *(*startRoutine)(void*), void *arg, const char *name);
+int SimJoinThread(pthread_t thread, void **retval); // Blocks the calling thread in virtual time until the given thread has exited
+void SimSPITransfer(uint32_t bytes); // Occupies the SPI thread for the time the bus model takes to send the given bytes
+void SimFramePresented(const PresentedFrame *frame); // Called by the SPI thread for each update that has been sent out
+int SimCoreClock(void); // Simulated core clock in MHz, which the SPI bus clock is divided from
+void SimTouchTransfer(const uint8_t *tx, uint8_t *rx, int bytes); // With TOUCH_CONTROLLER_STMPE610, a model of the touch controller answers the polls
+void SimTouchEvent(uint16_t type, uint16_t code, int32_t value); // Called for each input event that would be published to uinput
+void SimBeginPlanning(void); // Called by the main thread around planning each update, to measure the host CPU time that planning takes
+void SimEndPlanning(void);
+void SimBeginCopying(void); // Called by the main thread around copying pixels, into the frame buffers and into the task queue
+void SimEndCopying(void);
+
+// Route the blocking primitives of the pipeline to the virtual clock
+#define usleep(usecs) SimUsleep(usecs)
+#define syscall(...) SimSyscall(__VA_ARGS__)
+#define pthread_create(thread, attr, startRoutine, arg) SimCreateThread(thread, attr, startRoutine, arg, #startRoutine)
+#define pthread_join(thread, retval) SimJoinThread(thread, retval)
+
+// Spin loops that wait on another thread to make progress must yield to it, since only one thread runs at a time.
+// Each spin is modeled to take one usec.
+#define SIM_YIELD() SimUsleep(1)
+
+// Simulated VideoCore dispmanx API used by gpu.cpp: snapshots return the frame of the simulated source at the current virtual time.
+typedef uint32_t DISPMANX_DISPLAY_HANDLE_T, DISPMANX_RESOURCE_HANDLE_T, DISPMANX_UPDATE_HANDLE_T;
+typedef int DISPMANX_TRANSFORM_T;
+typedef struct { int32_t x, y, width, height; } VC_RECT_T;
+typedef struct { int32_t width, height; } DISPMANX_MODEINFO_T;
+typedef void (*DISPMANX_CALLBACK_FUNC_T)(DISPMANX_UPDATE_HANDLE_T u, void *arg);
+#define VC_IMAGE_RGB565 1
+
+void bcm_host_init(void);
+DISPMANX_DISPLAY_HANDLE_T vc_dispmanx_display_open(uint32_t device);
+int vc_dispmanx_display_get_info(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_MODEINFO_T *pinfo);
+DISPMANX_RESOURCE_HANDLE_T vc_dispmanx_resource_create(int type, uint32_t width, uint32_t height, uint32_t *nativeImageHandle);
+int vc_dispmanx_rect_set(VC_RECT_T *rect, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+int vc_dispmanx_snapshot(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_RESOURCE_HANDLE_T resource, DISPMANX_TRANSFORM_T transform);
+int vc_dispmanx_resource_read_data(DISPMANX_RESOURCE_HANDLE_T resource, const VC_RECT_T *rect, void *dst, int dstPitch);
+int vc_dispmanx_vsync_callback(DISPMANX_DISPLAY_HANDLE_T display, DISPMANX_CALLBACK_FUNC_T callback, void *arg);
+
+#else
+
+#define SIM_YIELD() ((void)0)
+
+#endif
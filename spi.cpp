@@ -12,14 +12,40 @@
 
 #include "config.h"
 #include "spi.h"
+#include "touch.h"
+#include "presentation.h"
+#include "dma.h"
 #include "util.h"
+#ifndef KERNEL_MODULE
+#include "statistics.h"
+#endif
 
 volatile GPIORegisterFile *gpio = 0;
 volatile SPIRegisterFile *spi = 0;
 
-// Synchonously performs a single SPI command byte + N data bytes transfer on the calling thread. Call in between a BEGIN_SPI_COMMUNICATION() and END_SPI_COMMUNICATION() pair.
-void RunSPITask(SPITask *task)
+#ifdef SPI_PIXEL_DESCRIPTORS
+uint16_t *pixelFramebuffers[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS] = {};
+volatile uint32_t pixelFramebufferUsers[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS] = {};
+uint16_t pixelFramebufferVersions[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS] = {};
+volatile uint32_t pixelFramebufferReleases = 0;
+#endif
+
+// Reads the data bytes of a command from rows of rowBytes bytes that are strideBytes apart in memory. XORing the address of each
+// byte with swapBytes = 1 swaps the bytes of each 16-bit word, which sends native endian pixels out in big endian order.
+#define NEXT_DATA_BYTE(byte) do { \
+    byte = *(const uint8_t*)((uintptr_t)tStart ^ swapBytes); \
+    if (++tStart == tRowEnd) { tStart += strideBytes - rowBytes; tRowEnd = tStart + rowBytes; } \
+  } while(0)
+
+// Synchonously performs a single SPI command byte + N data bytes transfer on the calling thread, with the data bytes read from
+// rows of memory as described above.
+static void RunSPICommandRows(uint8_t cmd, const uint8_t *data, uint32_t size, uint32_t rowBytes, uint32_t strideBytes, uintptr_t swapBytes)
 {
+#ifdef SIMULATOR
+  SimSPITransfer(size + 1); // No hardware, instead occupy the SPI thread for the time the bus model says the transfer takes
+  return;
+#endif
+
   // An SPI transfer to the display always starts with one control (command) byte, followed by N data bytes.
   uint32_t cs;
   while (!((cs = spi->cs) & BCM2835_SPI0_CS_DONE))
@@ -29,30 +55,178 @@ void RunSPITask(SPITask *task)
   if ((cs & BCM2835_SPI0_CS_RXD)) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
 
   CLEAR_GPIO(GPIO_TFT_DATA_CONTROL);
-  spi->fifo = task->cmd;
+  spi->fifo = cmd;
 
-  uint8_t *tStart = task->data;
-  uint8_t *tEnd = task->data + task->size;
-  uint8_t *tPrefillEnd = task->data + MIN(15, task->size);
+  const uint8_t *tStart = data;
+  const uint8_t *tRowEnd = data + rowBytes;
+  uint32_t bytesLeft = size;
+  uint32_t prefill = MIN(15, size);
+  uint8_t byte;
   while(!(spi->cs & (BCM2835_SPI0_CS_RXD|BCM2835_SPI0_CS_DONE))) /*nop*/;
 
   SET_GPIO(GPIO_TFT_DATA_CONTROL);
 
-  while(tStart < tPrefillEnd) spi->fifo = *tStart++;
-  while(tStart < tEnd)
+#ifdef SPI_BATCHED_FEEDER
+  // Refill the FIFO in batches: when the RX FIFO signals that it needs reading, at least SPI_FIFO_REFILL_BATCH bytes have been
+  // received since it was last cleared, so at least that many bytes have left the TX FIFO, and the next batch can be written in
+  // one go without testing TXD per byte.
+  spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
+  for(bytesLeft -= prefill; prefill > 0; --prefill) { NEXT_DATA_BYTE(byte); spi->fifo = byte; }
+  while(bytesLeft > 0)
+  {
+    while(!(spi->cs & BCM2835_SPI0_CS_RXR)) /*nop*/;
+    spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
+    uint32_t batch = MIN(SPI_FIFO_REFILL_BATCH, bytesLeft);
+    for(bytesLeft -= batch; batch > 0; --batch) { NEXT_DATA_BYTE(byte); spi->fifo = byte; }
+  }
+#else
+  for(bytesLeft -= prefill; prefill > 0; --prefill) { NEXT_DATA_BYTE(byte); spi->fifo = byte; }
+  while(bytesLeft > 0)
   {
     cs = spi->cs;
-    if ((cs & BCM2835_SPI0_CS_TXD)) spi->fifo = *tStart++;
+    if ((cs & BCM2835_SPI0_CS_TXD)) { NEXT_DATA_BYTE(byte); spi->fifo = byte; --bytesLeft; }
     if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
   }
+#endif
+}
+
+#undef NEXT_DATA_BYTE
+
+// Synchonously performs a single SPI command byte + N data bytes transfer on the calling thread.
+static void RunSPICommand(uint8_t cmd, const uint8_t *data, uint32_t size)
+{
+  RunSPICommandRows(cmd, data, size, size, size, 0);
+}
+
+// Synchonously runs the command(s) of the given task on the calling thread. Call in between a BEGIN_SPI_COMMUNICATION() and END_SPI_COMMUNICATION() pair.
+void RunSPITask(SPITask *task)
+{
+#ifdef SPI_COMMAND_LISTS
+  if (task->cmd == SPI_COMMAND_LIST)
+  {
+    SPICommandListHeader *header = (SPICommandListHeader*)task->data;
+    uint8_t *command = task->data + sizeof(SPICommandListHeader);
+    for(uint32_t i = 0; i < header->numCommands; ++i)
+    {
+      uint32_t size = command[1] | (command[2] << 8);
+      RunSPICommand(command[0], command + SPI_COMMAND_LIST_COMMAND_HEADER_SIZE, size);
+      command += SPI_COMMAND_LIST_COMMAND_HEADER_SIZE + size;
+    }
+    return;
+  }
+#endif
+#ifdef SPI_PIXEL_DESCRIPTORS
+  if (task->cmd == SPI_PIXEL_DESCRIPTOR)
+  {
+    const SPIPixelDescriptor *d = (const SPIPixelDescriptor*)task->data;
+    if (d->version != pixelFramebufferVersions[d->framebuffer]) FATAL_ERROR("Frame buffer was recycled while an SPI task still referred to it!");
+    const uint8_t *pixels = (const uint8_t*)(pixelFramebuffers[d->framebuffer] + d->y * DISPLAY_WIDTH + d->x);
+    RunSPICommandRows(d->cmd, pixels, SPIPixelDescriptorBytes(d), d->width * DISPLAY_BYTESPERPIXEL, DISPLAY_WIDTH * DISPLAY_BYTESPERPIXEL, 1);
+    return;
+  }
+#endif
+  RunSPICommand(task->cmd, task->data, task->size);
 }
 
 SharedMemory *spiTaskMemory = 0;
+#if !defined(KERNEL_MODULE) && !defined(KERNEL_MODULE_CLIENT)
+uint64_t spiBytesCommitted = 0;
+volatile uint64_t spiBytesSent = 0;
+#endif
 volatile uint64_t spiThreadIdleUsecs = 0;
 volatile uint64_t spiThreadSleepStartTime = 0;
 volatile int spiThreadSleeping = 0;
 double spiUsecsPerByte;
 
+#ifndef KERNEL_MODULE
+double spiUsecsPerTask;
+static double spiNominalUsecsPerByte;
+
+// The SPI thread records how long each of its busy periods took, and how many bytes and tasks it pushed out during that time.
+// The main thread consumes these samples to fit the bus cost model.
+#define SPI_COST_SAMPLES_SIZE 64
+typedef struct SPICostSample
+{
+  uint32_t usecs, bytes, tasks;
+} SPICostSample;
+static SPICostSample spiCostSamples[SPI_COST_SAMPLES_SIZE];
+static volatile uint32_t spiCostSamplesHead = 0, spiCostSamplesTail = 0;
+
+static void AddSPICostSample(uint32_t usecs, uint32_t bytes, uint32_t tasks) // Called on the SPI thread
+{
+  uint32_t tail = spiCostSamplesTail;
+  uint32_t newTail = (tail + 1) % SPI_COST_SAMPLES_SIZE;
+  if (newTail == __atomic_load_n(&spiCostSamplesHead, __ATOMIC_ACQUIRE)) return; // Main thread has not been consuming samples, drop this one
+  spiCostSamples[tail].usecs = usecs;
+  spiCostSamples[tail].bytes = bytes;
+  spiCostSamples[tail].tasks = tasks;
+  __atomic_store_n(&spiCostSamplesTail, newTail, __ATOMIC_RELEASE);
+}
+
+// Fits usecs = bytes*spiUsecsPerByte + tasks*spiUsecsPerTask to the measured SPI thread busy periods, using a least squares fit
+// where older samples decay exponentially so that the model follows changes in the bus clock. Called on the main thread.
+static double sumBB = 0, sumBT = 0, sumTT = 0, sumUB = 0, sumUT = 0;
+void UpdateSPICostModel()
+{
+  uint32_t head = spiCostSamplesHead;
+  uint32_t tail = __atomic_load_n(&spiCostSamplesTail, __ATOMIC_ACQUIRE);
+  if (head == tail) return;
+  for(; head != tail; head = (head + 1) % SPI_COST_SAMPLES_SIZE)
+  {
+    const double decay = 0.98;
+    double b = spiCostSamples[head].bytes, t = spiCostSamples[head].tasks, u = spiCostSamples[head].usecs;
+    sumBB = sumBB*decay + b*b;
+    sumBT = sumBT*decay + b*t;
+    sumTT = sumTT*decay + t*t;
+    sumUB = sumUB*decay + u*b;
+    sumUT = sumUT*decay + u*t;
+  }
+  __atomic_store_n(&spiCostSamplesHead, head, __ATOMIC_RELEASE);
+  if (sumTT <= 0) return;
+
+  // If the observed busy periods all had about the same bytes/task ratio, the two costs cannot be told apart, so stick to the
+  // nominal per-byte cost and only fit the per-task cost.
+  double perByte = spiNominalUsecsPerByte;
+  double det = sumBB*sumTT - sumBT*sumBT;
+  if (det > 1e-3 * sumBB*sumTT) perByte = (sumUB*sumTT - sumUT*sumBT) / det;
+  spiUsecsPerByte = MIN(spiNominalUsecsPerByte*4.0, MAX(spiNominalUsecsPerByte*0.5, perByte));
+  spiUsecsPerTask = MIN(100.0, MAX(0.0, (sumUT - spiUsecsPerByte*sumBT) / sumTT));
+}
+
+void SeedSPICostModel(double usecsPerByte, double usecsPerTask)
+{
+  // A prior worth SPI_COST_MODEL_PRIOR_SAMPLES busy periods of each of two different bytes/task ratios, so that both costs can be
+  // told apart from the start. It decays away like any other sample as real ones come in.
+#define SPI_COST_MODEL_PRIOR_SAMPLES 10
+  const double b[2] = { 20000, 2000 }, t[2] = { 10, 100 };
+  sumBB = sumBT = sumTT = sumUB = sumUT = 0;
+  for(int i = 0; i < 2; ++i)
+  {
+    double u = b[i]*usecsPerByte + t[i]*usecsPerTask;
+    sumBB += SPI_COST_MODEL_PRIOR_SAMPLES*b[i]*b[i];
+    sumBT += SPI_COST_MODEL_PRIOR_SAMPLES*b[i]*t[i];
+    sumTT += SPI_COST_MODEL_PRIOR_SAMPLES*t[i]*t[i];
+    sumUB += SPI_COST_MODEL_PRIOR_SAMPLES*u*b[i];
+    sumUT += SPI_COST_MODEL_PRIOR_SAMPLES*u*t[i];
+  }
+  spiUsecsPerByte = MIN(spiNominalUsecsPerByte*4.0, MAX(spiNominalUsecsPerByte*0.5, usecsPerByte));
+  spiUsecsPerTask = MIN(100.0, MAX(0.0, usecsPerTask));
+}
+
+// The SPI bus clock is divided from the core clock, so when the core clock changes (e.g. the SoC gets throttled), scale the
+// nominal and measured costs by the same ratio right away, instead of waiting for new samples to pull the fit over.
+void RescaleSPICostModel(int coreClockMhz)
+{
+  double nominalUsecsPerByte = 8.0/*bits/byte*/ * SPI_BUS_CLOCK_DIVISOR * 9.0/8.0/*idle bit per byte*/ / coreClockMhz;
+  double ratio = nominalUsecsPerByte / spiNominalUsecsPerByte;
+  spiNominalUsecsPerByte = nominalUsecsPerByte;
+  spiUsecsPerByte *= ratio;
+  spiUsecsPerTask *= ratio;
+  sumUB *= ratio;
+  sumUT *= ratio;
+}
+#endif
+
 SPITask *GetTask() // Returns the first task in the queue, called in worker thread
 {
   uint32_t head = spiTaskMemory->queueHead;
@@ -71,19 +245,37 @@ SPITask *GetTask() // Returns the first task in the queue, called in worker thre
 
 void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called in worker thread
 {
-  __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->size+1, __ATOMIC_RELAXED);
+  uint32_t busBytes = SPITaskBusBytes(task);
+  __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, busBytes, __ATOMIC_RELAXED);
+#ifdef SPI_PIXEL_DESCRIPTORS
+  if (task->cmd == SPI_PIXEL_DESCRIPTOR && __atomic_sub_fetch(&pixelFramebufferUsers[((SPIPixelDescriptor*)task->data)->framebuffer], 1, __ATOMIC_RELEASE) == 0)
+  {
+    __atomic_fetch_add(&pixelFramebufferReleases, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &pixelFramebufferReleases, FUTEX_WAKE, 1, 0, 0, 0); // The main thread may be waiting for a free buffer
+  }
+#endif
+#if !defined(KERNEL_MODULE) && !defined(KERNEL_MODULE_CLIENT)
+  __atomic_store_n(&spiBytesSent, spiBytesSent + busBytes, __ATOMIC_RELEASE);
+#endif
   spiTaskMemory->queueHead = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
   __sync_synchronize();
 }
 
 #ifndef KERNEL_MODULE
+pthread_t spiThread;
+volatile int spiThreadQuit = 0;
+volatile int spiThreadExited = 0;
+
 // A worker thread that keeps the SPI bus filled at all times
 void *spi_thread(void *unused)
 {
-  for(;;)
+  RegisterStatisticsThread("spi");
+  while(!spiThreadQuit)
   {
     if (spiTaskMemory->queueTail != spiTaskMemory->queueHead)
     {
+      uint64_t t0 = tick();
+      uint32_t bytes = 0, tasks = 0;
       BEGIN_SPI_COMMUNICATION();
       {
         while(spiTaskMemory->queueTail != spiTaskMemory->queueHead)
@@ -92,11 +284,24 @@ void *spi_thread(void *unused)
           if (task)
           {
             RunSPITask(task);
+            bytes += SPITaskBusBytes(task);
+#ifdef SPI_COMMAND_LISTS
+            if (task->cmd == SPI_COMMAND_LIST) tasks += ((SPICommandListHeader*)task->data)->numCommands; // Each command still costs a FIFO flush and D/C toggle
+            else
+#endif
+            ++tasks;
             DoneTask(task);
+#ifdef PRESENTATION_FEEDBACK
+            PublishPresentedFrames();
+#endif
           }
+#ifdef TOUCH_CONTROLLER_STMPE610
+          if (TouchPollDue(tick())) PollTouch(); // Interleave touch polls in between display tasks to keep touch latency bounded
+#endif
         }
       }
       END_SPI_COMMUNICATION();
+      AddSPICostSample((uint32_t)(tick() - t0), bytes, tasks);
     }
     else
     {
@@ -105,7 +310,19 @@ void *spi_thread(void *unused)
       spiThreadSleepStartTime = t0;
       __atomic_store_n(&spiThreadSleeping, 1, __ATOMIC_RELAXED);
 #endif
+#ifdef TOUCH_CONTROLLER_STMPE610
+      // Sleep until we get new tasks, or until it is time to poll the touch controller
+      if (TouchPollDue(tick())) PollTouch();
+      if (touchNextPollTime == TOUCH_POLL_DISABLED) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, spiTaskMemory->queueHead, 0, 0, 0);
+      else
+      {
+        uint64_t touchPollSleepUsecs = TouchPollSleepUsecs(tick());
+        struct timespec timeout = { (time_t)(touchPollSleepUsecs / 1000000), (long)(touchPollSleepUsecs % 1000000) * 1000 };
+        syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, spiTaskMemory->queueHead, &timeout, 0, 0);
+      }
+#else
       syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, spiTaskMemory->queueHead, 0, 0, 0); // Start sleeping until we get new tasks
+#endif
 #ifdef STATISTICS
       __atomic_store_n(&spiThreadSleeping, 0, __ATOMIC_RELAXED);
       uint64_t t1 = tick();
@@ -113,6 +330,8 @@ void *spi_thread(void *unused)
 #endif
     }
   }
+  __atomic_store_n(&spiThreadExited, 1, __ATOMIC_SEQ_CST);
+  return 0;
 }
 #endif
 
@@ -130,6 +349,11 @@ int InitSPI()
   spi = (volatile SPIRegisterFile*)((uintptr_t)bcm2835 + BCM2835_SPI0_BASE - BCM2835_GPIO_BASE);
   gpio = (volatile GPIORegisterFile*)((uintptr_t)bcm2835);
 
+#elif defined(SIMULATOR)
+  // The simulated bus is driven from RunSPITask(), the register writes elsewhere go to dummy register files
+  spi = (volatile SPIRegisterFile*)calloc(1, sizeof(SPIRegisterFile));
+  gpio = (volatile GPIORegisterFile*)calloc(1, sizeof(GPIORegisterFile));
+
 #else // Userland version
   // Find the memory address to the BCM2835 peripherals
   FILE *fp = fopen("/proc/device-tree/soc/ranges", "rb");
@@ -151,6 +375,12 @@ int InitSPI()
 
   // Estimate how many microseconds transferring a single byte over the SPI bus takes?
   spiUsecsPerByte = 8.0/*bits/byte*/ * SPI_BUS_CLOCK_DIVISOR * 9.0/8.0/*BCM2835 SPI master idles for one bit per each byte*/ / 400/*Approx BCM2835 SPI clock (250MHz is lowest, turbo is at 400MHz)*/;
+#ifndef KERNEL_MODULE
+  // Until the SPI thread has measured the actual costs, assume that each task costs the time of two bytes on top of its payload:
+  // one to flush the FIFO before toggling the D/C line for the command byte, and another to flush it after the command byte.
+  spiNominalUsecsPerByte = spiUsecsPerByte;
+  spiUsecsPerTask = 2 * spiUsecsPerByte;
+#endif
 
 #ifndef KERNEL_MODULE_CLIENT
   // By default all GPIO pins are in input mode (0x00), initialize them for SPI and GPIO writes
@@ -186,11 +416,19 @@ int InitSPI()
 
 #if !defined(KERNEL_MODULE) && !defined(KERNEL_MODULE_CLIENT)
   InitSPIDisplay();
+#ifdef TOUCH_CONTROLLER_STMPE610
+  InitTouch();
+#endif
 
+  spiThreadQuit = spiThreadExited = 0; // Raised by a previous DeinitSPI()
+#ifdef USE_DMA_TRANSFERS
+  InitDMA();
+  int rc = pthread_create(&spiThread, NULL, dma_spi_thread, NULL);
+#else
   // Create a dedicated thread to feed the SPI bus. While this is fast, it consumes a lot of CPU. It would be best to replace
   // this thread with a kernel module that processes the created SPI task queue using interrupts. (while juggling the GPIO D/C line as well)
-  pthread_t thread;
-  int rc = pthread_create(&thread, NULL, spi_thread, NULL); // After creating the thread, it is assumed to have ownership of the SPI bus, so no SPI chat on the main thread after this.
+  int rc = pthread_create(&spiThread, NULL, spi_thread, NULL);
+#endif // After creating the thread, it is assumed to have ownership of the SPI bus, so no SPI chat on the main thread after this.
   if (rc != 0) FATAL_ERROR("Failed to create SPI thread!");
 #endif
 
@@ -199,6 +437,21 @@ int InitSPI()
 
 void DeinitSPI()
 {
+#if !defined(KERNEL_MODULE) && !defined(KERNEL_MODULE_CLIENT)
+  // Let the SPI thread finish the tasks it has been given, and then stop it before releasing the task memory under it
+  while(spiTaskMemory->queueHead != spiTaskMemory->queueTail) usleep(1000);
+  __atomic_store_n(&spiThreadQuit, 1, __ATOMIC_SEQ_CST);
+  while(!__atomic_load_n(&spiThreadExited, __ATOMIC_SEQ_CST))
+  {
+    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0);
+    usleep(1000);
+  }
+  pthread_join(spiThread, 0);
+#ifdef USE_DMA_TRANSFERS
+  DeinitDMA();
+#endif
+#endif
+
 #ifndef KERNEL_MODULE_CLIENT
 
 #ifdef KERNEL_MODULE
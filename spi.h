@@ -2,6 +2,7 @@
 
 #ifndef KERNEL_MODULE
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/syscall.h>
 #endif
 #include <linux/futex.h>
@@ -24,6 +25,9 @@
 #define BMC2835_SPI0_CS_INTR                 0x00000400 // Fire interrupts on RXR?
 #define BMC2835_SPI0_CS_INTD                 0x00000200 // Fire interrupts on DONE?
 
+// Number of bytes that are known to have left the TX FIFO when the RX FIFO signals RXR (RX FIFO 3/4 full)
+#define SPI_FIFO_REFILL_BATCH                12
+
 #define BCM2835_SPI0_CS_CPOL                 0x00000008 // Clock Polarity
 #define BCM2835_SPI0_CS_CPHA                 0x00000004 // Clock Phase
 #define BCM2835_SPI0_CS_CS                   0x00000003 // Chip Select
@@ -65,7 +69,11 @@ extern volatile SPIRegisterFile *spi;
 // so for best performance, should be at least ~DISPLAY_WIDTH*DISPLAY_HEIGHT*BYTES_PER_PIXEL*2 bytes in size, plus some small
 // amount for structuring each SPITask command. Technically this can be something very small, like 4096b, and not need to contain
 // even a single full frame of data, but such small buffers can cause performance issues from threads starving.
+#ifdef SPI_PIXEL_DESCRIPTORS
+#define SHARED_MEMORY_SIZE (DISPLAY_WIDTH*DISPLAY_HEIGHT*DISPLAY_BYTESPERPIXEL/2) // Only small spans are copied into the queue, larger ones are sent by descriptor
+#else
 #define SHARED_MEMORY_SIZE (DISPLAY_WIDTH*DISPLAY_HEIGHT*DISPLAY_BYTESPERPIXEL*5/2)
+#endif
 #define SPI_QUEUE_SIZE (SHARED_MEMORY_SIZE - sizeof(SharedMemory))
 
 typedef struct __attribute__((packed)) SPITask
@@ -75,11 +83,65 @@ typedef struct __attribute__((packed)) SPITask
   uint8_t data[];
 } SPITask;
 
+#ifdef SPI_COMMAND_LISTS
+#ifdef KERNEL_MODULE_CLIENT
+#error SPI_COMMAND_LISTS is not supported with KERNEL_MODULE_CLIENT, the kernel module runs each task as a single command
+#endif
+
+// A task with this command is a command list: instead of a single display command, its data is a SPICommandListHeader followed by
+// a sequence of display commands, each one a command byte and a 16-bit little endian data size, followed by the data bytes. The SPI
+// thread runs them all back to back as part of the one task. (0xFF is not a command of the display controller)
+#define SPI_COMMAND_LIST 0xFF
+#define SPI_COMMAND_LIST_COMMAND_HEADER_SIZE 3
+
+typedef struct __attribute__((packed)) SPICommandListHeader
+{
+  uint32_t busBytes; // Number of bytes that the commands put on the SPI bus, a command byte plus the data bytes of each
+  uint32_t numCommands;
+} SPICommandListHeader;
+#endif
+
+#ifdef SPI_PIXEL_DESCRIPTORS
+#ifdef KERNEL_MODULE_CLIENT
+#error SPI_PIXEL_DESCRIPTORS is not supported with KERNEL_MODULE_CLIENT, the kernel module can only read the task queue memory
+#endif
+
+// A task with this command is a pixel descriptor: instead of the pixel data, its data is a SPIPixelDescriptor, and the SPI thread
+// reads the pixels from the described rectangle of a frame buffer in the pool. (0xFE is not a command of the display controller)
+#define SPI_PIXEL_DESCRIPTOR 0xFE
+
+typedef struct __attribute__((packed)) SPIPixelDescriptor
+{
+  uint8_t cmd; // Display command to send the pixels with
+  uint8_t framebuffer; // Index of the frame buffer in pixelFramebuffers
+  uint16_t version; // Version of the frame buffer that the rectangle refers to, for catching buffers that were recycled too early
+  uint16_t x, y, width, height; // Rectangle [x, x+width[ * [y, y+height[ of pixels, in scanline order
+  uint16_t lastRowWidth; // Number of pixels of the last scanline to send, which may be less than width, like for a Span
+} SPIPixelDescriptor;
+
+// The frame buffer pool, in native byte order, DISPLAY_WIDTH pixels per scanline. The main thread captures a new frame into a buffer
+// only once no task in the queue refers to it anymore, i.e. its number of users has dropped to zero.
+extern uint16_t *pixelFramebuffers[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS];
+extern volatile uint32_t pixelFramebufferUsers[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS]; // Descriptor tasks in the queue that refer to each buffer
+extern uint16_t pixelFramebufferVersions[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS]; // Bumped each time a buffer is reused for a new frame
+extern volatile uint32_t pixelFramebufferReleases; // Bumped each time the users of a buffer drop to zero, the main thread sleeps on it while it waits for a free buffer
+
+static inline uint32_t SPIPixelDescriptorBytes(const SPIPixelDescriptor *d)
+{
+  return ((d->height - 1) * d->width + d->lastRowWidth) * DISPLAY_BYTESPERPIXEL;
+}
+#endif
+
+#ifdef SIMULATOR
+#define BEGIN_SPI_COMMUNICATION() ((void)0)
+#define END_SPI_COMMUNICATION() ((void)0)
+#else
 #define BEGIN_SPI_COMMUNICATION() do { spi->cs |= BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_TA; __sync_synchronize(); } while(0)
 #define END_SPI_COMMUNICATION()  do { \
     while (!(spi->cs & BCM2835_SPI0_CS_DONE)) if ((spi->cs & BCM2835_SPI0_CS_RXD)) (void)spi->fifo; \
     spi->cs &= ~BCM2835_SPI0_CS_TA; \
   } while(0)
+#endif
 
 // A convenience for defining and dispatching SPI task bytes inline
 #define SPI_TRANSFER(command, ...) do { \
@@ -130,6 +192,17 @@ typedef struct SharedMemory
 
 extern SharedMemory *spiTaskMemory;
 extern double spiUsecsPerByte;
+#ifndef KERNEL_MODULE
+extern double spiUsecsPerTask; // Measured overhead of each individual SPI task on top of its bytes, see UpdateSPICostModel()
+#endif
+
+#if !defined(KERNEL_MODULE) && !defined(KERNEL_MODULE_CLIENT)
+extern pthread_t spiThread;
+extern volatile int spiThreadQuit;
+extern volatile int spiThreadExited;
+extern uint64_t spiBytesCommitted; // Total number of bytes ever committed to the SPI task queue, only accessed on the main thread
+extern volatile uint64_t spiBytesSent; // Total number of bytes ever sent out on the SPI bus
+#endif
 
 #ifdef STATISTICS
 extern volatile uint64_t spiThreadIdleUsecs;
@@ -137,6 +210,18 @@ extern volatile uint64_t spiThreadSleepStartTime;
 extern volatile int spiThreadSleeping;
 #endif
 
+// Returns the number of bytes that the given task puts on the SPI bus. The spiBytes* counters are all in bus bytes.
+static inline uint32_t SPITaskBusBytes(const SPITask *task)
+{
+#ifdef SPI_COMMAND_LISTS
+  if (task->cmd == SPI_COMMAND_LIST) return ((const SPICommandListHeader*)task->data)->busBytes;
+#endif
+#ifdef SPI_PIXEL_DESCRIPTORS
+  if (task->cmd == SPI_PIXEL_DESCRIPTOR) return SPIPixelDescriptorBytes((const SPIPixelDescriptor*)task->data) + 1;
+#endif
+  return task->size + 1;
+}
+
 static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new SPI task block, called on main thread
 {
   uint32_t bytesToAllocate = sizeof(SPITask) + bytes;
@@ -147,8 +232,10 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
     uint32_t head = spiTaskMemory->queueHead;
     while(head > tail || head == 0/*Head must move > 0 so that we don't stomp on it*/)
     {
-#ifndef KERNEL_MODULE
+#if !defined(KERNEL_MODULE) && !defined(USE_DMA_TRANSFERS) // With DMA, TA is set by the DLEN/CS word of each transfer; setting it here would start an empty transfer
       if (!(spi->cs & BCM2835_SPI0_CS_TA)) spi->cs |= BCM2835_SPI0_CS_TA;
+#endif
+#ifndef KERNEL_MODULE
       usleep(100); // Wait until there are no remaining bytes to process in the far right end of the buffer - we'll write an eob marker there as soon as the read pointer has cleared it.
 #endif
       head = spiTaskMemory->queueHead;
@@ -168,8 +255,10 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
   uint32_t head = spiTaskMemory->queueHead;
   while(head > tail && head <= newTail)
   {
-#ifndef KERNEL_MODULE
+#if !defined(KERNEL_MODULE) && !defined(USE_DMA_TRANSFERS)
     if (!(spi->cs & BCM2835_SPI0_CS_TA)) spi->cs |= BCM2835_SPI0_CS_TA;
+#endif
+#ifndef KERNEL_MODULE
     usleep(100);
 #endif
     head = spiTaskMemory->queueHead;
@@ -187,15 +276,96 @@ static inline void CommitTask(SPITask *task) // Advertises the given SPI task fr
   uint32_t tail = spiTaskMemory->queueTail;
 #endif
   spiTaskMemory->queueTail = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->size+1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, SPITaskBusBytes(task), __ATOMIC_RELAXED);
   __sync_synchronize();
 #if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
+  spiBytesCommitted += SPITaskBusBytes(task);
   if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
 #endif
 }
 
+#ifdef SPI_COMMAND_LISTS
+// Allocates a command list task with room for SPI_COMMAND_LIST_SIZE bytes of commands. Commands are appended to it with
+// AppendToCommandList(), and it is committed with CommitTask() as usual. No other task may be allocated while a list is open.
+static inline SPITask *AllocCommandList(void)
+{
+  SPITask *list = AllocTask(sizeof(SPICommandListHeader) + SPI_COMMAND_LIST_SIZE);
+  list->cmd = SPI_COMMAND_LIST;
+  list->size = sizeof(SPICommandListHeader); // Only the used part of the allocation is committed
+  SPICommandListHeader *header = (SPICommandListHeader*)list->data;
+  header->busBytes = 0;
+  header->numCommands = 0;
+  return list;
+}
+
+static inline int CommandListHasRoom(const SPITask *list, uint32_t bytes)
+{
+  return list->size + SPI_COMMAND_LIST_COMMAND_HEADER_SIZE + bytes <= sizeof(SPICommandListHeader) + SPI_COMMAND_LIST_SIZE;
+}
+
+// Appends a display command to the given command list, and returns a pointer to write its data bytes to.
+static inline uint8_t *AppendToCommandList(SPITask *list, uint8_t cmd, uint32_t bytes)
+{
+  uint8_t *command = list->data + list->size;
+  command[0] = cmd;
+  command[1] = bytes & 0xFF;
+  command[2] = bytes >> 8;
+  list->size += SPI_COMMAND_LIST_COMMAND_HEADER_SIZE + bytes;
+  SPICommandListHeader *header = (SPICommandListHeader*)list->data;
+  header->busBytes += 1 + bytes;
+  ++header->numCommands;
+  return command + SPI_COMMAND_LIST_COMMAND_HEADER_SIZE;
+}
+#endif
+
+#ifdef SPI_PIXEL_DESCRIPTORS
+// Queues a task that sends the given rectangle of pixels of a frame buffer in the pool with the given display command. The pixels
+// must not change until the task has been retired, which the frame buffer pool takes care of.
+static inline SPITask *QueuePixelDescriptor(uint8_t cmd, int framebuffer, int x, int y, int width, int height, int lastRowWidth)
+{
+  SPITask *task = AllocTask(sizeof(SPIPixelDescriptor));
+  task->cmd = SPI_PIXEL_DESCRIPTOR;
+  SPIPixelDescriptor *d = (SPIPixelDescriptor*)task->data;
+  d->cmd = cmd;
+  d->framebuffer = framebuffer;
+  d->version = pixelFramebufferVersions[framebuffer];
+  d->x = x;
+  d->y = y;
+  d->width = width;
+  d->height = height;
+  d->lastRowWidth = lastRowWidth;
+  __atomic_fetch_add(&pixelFramebufferUsers[framebuffer], 1, __ATOMIC_RELAXED);
+  CommitTask(task);
+  return task;
+}
+
+// Copies bytes [offset, offset+bytes[ of the pixels that the given descriptor sends to dst, in big endian byte order as they go on
+// the bus. The offset and the number of bytes must be whole pixels.
+static inline void CopyPixelDescriptorBytes(const SPIPixelDescriptor *d, uint32_t offset, uint32_t bytes, uint8_t *dst)
+{
+  uint16_t *out = (uint16_t*)dst;
+  uint32_t pixel = offset / DISPLAY_BYTESPERPIXEL, numPixels = bytes / DISPLAY_BYTESPERPIXEL;
+  uint32_t row = pixel / d->width, x = pixel % d->width;
+  const uint16_t *src = pixelFramebuffers[d->framebuffer] + (d->y + row) * DISPLAY_WIDTH + d->x;
+  while(numPixels > 0)
+  {
+    uint32_t n = d->width - x;
+    if (n > numPixels) n = numPixels;
+    for(uint32_t i = 0; i < n; ++i) *out++ = __builtin_bswap16(src[x+i]);
+    numPixels -= n;
+    x = 0;
+    src += DISPLAY_WIDTH;
+  }
+}
+#endif
+
 int InitSPI(void);
 void DeinitSPI(void);
 void RunSPITask(SPITask *task);
 SPITask *GetTask(void);
 void DoneTask(SPITask *task);
+#ifndef KERNEL_MODULE
+void UpdateSPICostModel(void);
+void SeedSPICostModel(double usecsPerByte, double usecsPerTask); // Starts the fit out from the given costs, e.g. from a saved profile
+void RescaleSPICostModel(int coreClockMhz);
+#endif
@@ -9,24 +9,81 @@
 #include <memory.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/syscall.h>
 
+#include "thread.h"
 #include "tick.h"
 #include "text.h"
 #include "spi.h"
+#include "touch.h"
 #include "util.h"
+#include "governor.h"
+#include "oscillation.h"
 
 volatile uint64_t timeWastedPollingGPU = 0;
 volatile int statsSpiBusSpeed = 0;
 volatile int statsCpuFrequency = 0;
 volatile double statsCpuTemperature = 0;
 double spiThreadUtilizationRate;
+double spiThreadCpuUsage;
 double spiBusDataRate;
 int statsGpuPollingWasted = 0;
 uint64_t statsBytesTransferred = 0;
+int statsMispredictedFrames = 0;
+int statsPlanCacheHits = 0;
+int statsPlanCacheMisses = 0;
+double statsPlanningUsecsSaved = 0;
+int statsFramesDisplayed = 0;
+#ifdef SHADOW_PLANNER
+PlannerStatistics statsProductionPlanner = {}, statsShadowPlanner = {};
+uint64_t statsShadowFramesSkipped = 0;
+#endif
 
 int frameSkipTimeHistorySize = 0;
 uint64_t frameSkipTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
 
+uint64_t statsDroppedFrames[NUM_DROP_CAUSES] = {};
+uint64_t statsInterlacedUpdates[NUM_DROP_CAUSES] = {};
+static int dropsSinceRefresh[2][NUM_DROP_CAUSES] = {}; // Skipped frames and interlaced updates by cause since the overlay was last refreshed
+static char skipCauseLetter = 0, interlaceCauseLetter = 0; // Most common cause of the recent drops, shown on the overlay
+static const char dropCauseLetters[NUM_DROP_CAUSES+1] = "LPQBMG";
+
+#define NUM_DROP_EXAMPLES 8
+struct DropExample
+{
+  uint64_t time;
+  int cause;
+  bool interlaced;
+  int frames;
+  uint32_t usecs, budgetUsecs;
+};
+static DropExample dropExamples[NUM_DROP_EXAMPLES] = {}; // Ring of the most recent drops, oldest overwritten first
+static int numDropExamples = 0;
+
+void RecordFrameDrop(int cause, bool interlaced, int frames, uint32_t usecs, uint32_t budgetUsecs)
+{
+  if (interlaced) ++statsInterlacedUpdates[cause];
+  else statsDroppedFrames[cause] += frames;
+  dropsSinceRefresh[interlaced ? 1 : 0][cause] += frames;
+  DropExample &e = dropExamples[numDropExamples++ % NUM_DROP_EXAMPLES];
+  e.time = tick();
+  e.cause = cause;
+  e.interlaced = interlaced;
+  e.frames = frames;
+  e.usecs = usecs;
+  e.budgetUsecs = budgetUsecs;
+}
+
+// Letter of the cause of most of the given drops, or 0 if there were none.
+static char DominantDropCause(const int *drops)
+{
+  int cause = 0;
+  for(int i = 1; i < NUM_DROP_CAUSES; ++i)
+    if (drops[i] > drops[cause]) cause = i;
+  return drops[cause] > 0 ? dropCauseLetters[cause] : 0;
+}
+
 char fpsText[32] = {};
 char spiUsagePercentageText[32] = {};
 char spiBusDataRateText[32] = {};
@@ -37,54 +94,298 @@ char cpuTemperatureText[32] = {};
 uint16_t cpuTemperatureColor = 0;
 char gpuPollingWastedText[32] = {};
 uint16_t gpuPollingWastedColor = 0;
+char mispredictedFramesText[32] = {};
+char planCacheText[32] = {};
+char touchText[32] = {};
+char spiThreadCpuText[32] = {};
+char governorText[32] = {};
+char threadCpuText[64] = {};
+char contextSwitchesText[32] = {};
+char oscillationText[32] = {};
 
 uint64_t statsLastPrint = 0;
 
+#ifdef STATISTICS_GRAPH
+#define STATISTICS_GRAPH_GAP 3 // Columns cleared ahead of the newest one, so that the sweep position is visible
+#define STATISTICS_GRAPH_BACKGROUND RGB565(0,0,0)
+#define STATISTICS_GRAPH_TARGET_LINE RGB565(8,16,8)
+
+// The graph sweeps from left to right over a persistent image of the strip, overwriting its oldest column, instead of scrolling,
+// which would change every pixel of the strip on each update.
+static uint16_t graphPixels[STATISTICS_GRAPH_HEIGHT][DISPLAY_WIDTH];
+static int graphColumn = 0;
+static uint64_t graphPrevSampleTime = 0;
+
+static int GraphRow(double value, double maxValue) // Row of the strip that the given value reaches, 0 is the top
+{
+  return STATISTICS_GRAPH_HEIGHT - 1 - (int)MIN(STATISTICS_GRAPH_HEIGHT - 1, MAX(0.0, value * (STATISTICS_GRAPH_HEIGHT - 1) / maxValue));
+}
+
+static void ClearGraphColumn(int x)
+{
+  int targetRow = GraphRow(1000000.0 / TARGET_FRAME_RATE, STATISTICS_GRAPH_MAX_INTERVAL);
+  for(int y = 0; y < STATISTICS_GRAPH_HEIGHT; ++y) graphPixels[y][x] = (y == targetRow) ? STATISTICS_GRAPH_TARGET_LINE : STATISTICS_GRAPH_BACKGROUND;
+}
+
+void AddStatisticsGraphSample(bool interlaced, int skippedFrames, uint32_t bytes)
+{
+  uint64_t now = tick();
+  uint64_t interval = now - graphPrevSampleTime;
+  graphPrevSampleTime = now;
+  if (interval == now) return; // First update, there is no interval yet
+
+  int x = graphColumn;
+  ClearGraphColumn(x);
+  uint16_t barColor = interlaced ? RGB565(31,30,11) : 0xFFFF;
+  for(int y = GraphRow((double)interval, STATISTICS_GRAPH_MAX_INTERVAL); y < STATISTICS_GRAPH_HEIGHT; ++y) graphPixels[y][x] = barColor;
+  graphPixels[GraphRow(MIN(1.0, bytes * spiUsecsPerByte / interval), 1.0)][x] = RGB565(0,63,31);
+  if (skippedFrames > 0) graphPixels[0][x] = RGB565(31,0,0);
+
+  graphColumn = (graphColumn + 1) % DISPLAY_WIDTH;
+  for(int i = 0; i < STATISTICS_GRAPH_GAP; ++i) ClearGraphColumn((graphColumn + i) % DISPLAY_WIDTH);
+}
+#endif
+
+// Pipeline threads that have registered to have their CPU usage accounted for. The registering threads fill in the name and ids,
+// after which the poll thread samples the thread, and publishes the results under statsThreadsLock for the overlay.
+#define MAX_STATISTICS_THREADS 12
+struct StatisticsThread
+{
+  const char *name;
+  pthread_t thread;
+  int tid;
+  uint64_t cpuTime; // Thread CPU time in usecs at the previous refresh
+  uint64_t voluntarySwitches, involuntarySwitches; // Context switch counts at the previous refresh
+  double cpuMsPerSecond, cpuMsPerFrame, voluntarySwitchesPerSecond, involuntarySwitchesPerSecond;
+};
+static StatisticsThread statsThreads[MAX_STATISTICS_THREADS] = {};
+static volatile int numStatsThreads = 0;
+static pthread_mutex_t statsThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+
+void RegisterStatisticsThread(const char *name)
+{
+  char threadName[16];
+  snprintf(threadName, sizeof(threadName), "fbcp-%s", name); // Shows up in top -H and ps -L
+  pthread_setname_np(pthread_self(), threadName);
+
+  pthread_mutex_lock(&statsThreadsLock);
+  int i = numStatsThreads;
+  if (i < MAX_STATISTICS_THREADS)
+  {
+    statsThreads[i].name = name;
+    statsThreads[i].thread = pthread_self();
+    statsThreads[i].tid = (int)syscall(SYS_gettid);
+    __atomic_store_n(&numStatsThreads, i+1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&statsThreadsLock);
+}
+
+// Reads the CPU time of the given thread from its CPU clock, and its voluntary (blocked) and involuntary (preempted) context
+// switch counts from /proc/self/task/<tid>/status.
+static void SampleThreadCpu(const StatisticsThread &t, uint64_t &cpuTime, uint64_t &voluntarySwitches, uint64_t &involuntarySwitches)
+{
+  clockid_t clock;
+  struct timespec ts;
+  if (pthread_getcpuclockid(t.thread, &clock) == 0 && clock_gettime(clock, &ts) == 0)
+    cpuTime = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+
+  char filename[64];
+  sprintf(filename, "/proc/self/task/%d/status", t.tid);
+  FILE *handle = fopen(filename, "r");
+  if (!handle) return;
+  char line[128];
+  while(fgets(line, sizeof(line), handle))
+  {
+    if (!strncmp(line, "voluntary_ctxt_switches:", 24)) voluntarySwitches = strtoull(line+24, 0, 10);
+    else if (!strncmp(line, "nonvoluntary_ctxt_switches:", 27)) involuntarySwitches = strtoull(line+27, 0, 10);
+  }
+  fclose(handle);
+}
+
+// Frame rate of the most recent overlay refresh, which the poll thread divides the thread CPU times by. Guarded by statsThreadsLock.
+static double statsFramesPerSecond = 0;
+
+// Samples the CPU time and context switches of all registered threads over the given interval. Called on the poll thread.
+static void SampleThreads(uint64_t elapsed)
+{
+  int numThreads = __atomic_load_n(&numStatsThreads, __ATOMIC_ACQUIRE);
+  for(int i = 0; i < numThreads; ++i)
+  {
+    StatisticsThread &t = statsThreads[i];
+    uint64_t cpuTime = t.cpuTime, voluntarySwitches = t.voluntarySwitches, involuntarySwitches = t.involuntarySwitches;
+    SampleThreadCpu(t, cpuTime, voluntarySwitches, involuntarySwitches);
+    pthread_mutex_lock(&statsThreadsLock);
+    t.cpuMsPerSecond = (cpuTime - t.cpuTime) * 1000.0 / elapsed;
+    t.cpuMsPerFrame = statsFramesPerSecond > 0 ? t.cpuMsPerSecond / statsFramesPerSecond : 0;
+    t.voluntarySwitchesPerSecond = (voluntarySwitches - t.voluntarySwitches) * 1000000.0 / elapsed;
+    t.involuntarySwitchesPerSecond = (involuntarySwitches - t.involuntarySwitches) * 1000000.0 / elapsed;
+    pthread_mutex_unlock(&statsThreadsLock);
+    t.cpuTime = cpuTime;
+    t.voluntarySwitches = voluntarySwitches;
+    t.involuntarySwitches = involuntarySwitches;
+  }
+}
+
+#ifdef STATISTICS_METRICS_FILE
+static const char *dropCauseNames[NUM_DROP_CAUSES] = { "capture_late", "planner_over_budget", "spi_queue_full", "spi_bandwidth", "polling_miss", "governor" };
+
+// The counters that ExportMetrics() writes out, copied by the main thread at each overlay refresh, so that the poll thread can write
+// the file without racing the main thread that updates them.
+struct MetricsSnapshot
+{
+  double framesPerSecond, spiBusBitsPerSecond, oscillationBytesSavedPerSecond;
+#ifdef SHADOW_PLANNER
+  PlannerStatistics planners[2];
+  uint64_t shadowFramesSkipped;
+#endif
+  uint64_t droppedFrames[NUM_DROP_CAUSES], interlacedUpdates[NUM_DROP_CAUSES];
+  DropExample dropExamples[NUM_DROP_EXAMPLES];
+  int numDropExamples;
+};
+static MetricsSnapshot metricsSnapshot = {};
+static bool metricsSnapshotPending = false; // True once the main thread has refreshed the snapshot since the last export
+static pthread_mutex_t metricsSnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void SnapshotMetrics(double framesPerSecond, double oscillationBytesSavedPerSecond)
+{
+  pthread_mutex_lock(&metricsSnapshotLock);
+  MetricsSnapshot &m = metricsSnapshot;
+  m.framesPerSecond = framesPerSecond;
+  m.spiBusBitsPerSecond = spiBusDataRate;
+  m.oscillationBytesSavedPerSecond = oscillationBytesSavedPerSecond;
+#ifdef SHADOW_PLANNER
+  m.planners[0] = statsProductionPlanner;
+  m.planners[1] = statsShadowPlanner;
+  m.shadowFramesSkipped = statsShadowFramesSkipped;
+#endif
+  memcpy(m.droppedFrames, statsDroppedFrames, sizeof(m.droppedFrames));
+  memcpy(m.interlacedUpdates, statsInterlacedUpdates, sizeof(m.interlacedUpdates));
+  memcpy(m.dropExamples, dropExamples, sizeof(m.dropExamples));
+  m.numDropExamples = numDropExamples;
+  metricsSnapshotPending = true;
+  pthread_mutex_unlock(&metricsSnapshotLock);
+}
+
+// Writes the metrics in Prometheus text exposition format, and atomically replaces the previous file so readers never see a partial
+// write. Called on the poll thread, since it does file I/O.
+static void ExportMetrics()
+{
+  static MetricsSnapshot m;
+  pthread_mutex_lock(&metricsSnapshotLock);
+  bool pending = metricsSnapshotPending;
+  m = metricsSnapshot;
+  metricsSnapshotPending = false;
+  pthread_mutex_unlock(&metricsSnapshotLock);
+  if (!pending) return; // Nothing new since the last export
+
+  FILE *handle = fopen(STATISTICS_METRICS_FILE ".tmp", "w");
+  if (!handle) return;
+  int numThreads = __atomic_load_n(&numStatsThreads, __ATOMIC_ACQUIRE);
+  fprintf(handle, "# TYPE fbcp_frames_per_second gauge\nfbcp_frames_per_second %.2f\n", m.framesPerSecond);
+  fprintf(handle, "# TYPE fbcp_spi_bus_bits_per_second gauge\nfbcp_spi_bus_bits_per_second %.0f\n", m.spiBusBitsPerSecond);
+  fprintf(handle, "# TYPE fbcp_thread_cpu_ms_per_second gauge\n");
+  for(int i = 0; i < numThreads; ++i) fprintf(handle, "fbcp_thread_cpu_ms_per_second{thread=\"%s\"} %.3f\n", statsThreads[i].name, statsThreads[i].cpuMsPerSecond);
+  fprintf(handle, "# TYPE fbcp_thread_cpu_ms_per_frame gauge\n");
+  for(int i = 0; i < numThreads; ++i) fprintf(handle, "fbcp_thread_cpu_ms_per_frame{thread=\"%s\"} %.3f\n", statsThreads[i].name, statsThreads[i].cpuMsPerFrame);
+  fprintf(handle, "# TYPE fbcp_thread_voluntary_context_switches_per_second gauge\n");
+  for(int i = 0; i < numThreads; ++i) fprintf(handle, "fbcp_thread_voluntary_context_switches_per_second{thread=\"%s\"} %.1f\n", statsThreads[i].name, statsThreads[i].voluntarySwitchesPerSecond);
+  fprintf(handle, "# TYPE fbcp_thread_involuntary_context_switches_per_second gauge\n");
+  for(int i = 0; i < numThreads; ++i) fprintf(handle, "fbcp_thread_involuntary_context_switches_per_second{thread=\"%s\"} %.1f\n", statsThreads[i].name, statsThreads[i].involuntarySwitchesPerSecond);
+#ifdef SHADOW_PLANNER
+  // Counters, so that the two planners can be compared over any time window, e.g. by rate(fbcp_planner_bytes_total[5m]) / rate(fbcp_planner_frames_total[5m])
+  const PlannerStatistics *planners[2] = { &m.planners[0], &m.planners[1] };
+  const char *plannerNames[2] = { "production", "shadow" };
+  fprintf(handle, "# TYPE fbcp_planner_frames_total counter\n");
+  for(int i = 0; i < 2; ++i) fprintf(handle, "fbcp_planner_frames_total{planner=\"%s\"} %llu\n", plannerNames[i], (unsigned long long)planners[i]->frames);
+  fprintf(handle, "# TYPE fbcp_planner_interlaced_frames_total counter\n");
+  for(int i = 0; i < 2; ++i) fprintf(handle, "fbcp_planner_interlaced_frames_total{planner=\"%s\"} %llu\n", plannerNames[i], (unsigned long long)planners[i]->interlacedFrames);
+  fprintf(handle, "# TYPE fbcp_planner_bytes_total counter\n");
+  for(int i = 0; i < 2; ++i) fprintf(handle, "fbcp_planner_bytes_total{planner=\"%s\"} %llu\n", plannerNames[i], (unsigned long long)planners[i]->bytes);
+  fprintf(handle, "# TYPE fbcp_planner_commands_total counter\n");
+  for(int i = 0; i < 2; ++i) fprintf(handle, "fbcp_planner_commands_total{planner=\"%s\"} %llu\n", plannerNames[i], (unsigned long long)planners[i]->commands);
+  fprintf(handle, "# TYPE fbcp_planner_bus_usecs_total counter\n");
+  for(int i = 0; i < 2; ++i) fprintf(handle, "fbcp_planner_bus_usecs_total{planner=\"%s\"} %.0f\n", plannerNames[i], planners[i]->busUsecs);
+  fprintf(handle, "# TYPE fbcp_planner_cpu_usecs_total counter\n");
+  for(int i = 0; i < 2; ++i) fprintf(handle, "fbcp_planner_cpu_usecs_total{planner=\"%s\"} %llu\n", plannerNames[i], (unsigned long long)planners[i]->cpuUsecs);
+  fprintf(handle, "# TYPE fbcp_shadow_planner_skipped_frames_total counter\nfbcp_shadow_planner_skipped_frames_total %llu\n", (unsigned long long)m.shadowFramesSkipped);
+#endif
+  // Counters, so that the causes can be compared over any time window, and the most recent drops as comments for a closer look
+  fprintf(handle, "# TYPE fbcp_dropped_frames_total counter\n");
+  for(int i = 0; i < NUM_DROP_CAUSES; ++i) fprintf(handle, "fbcp_dropped_frames_total{cause=\"%s\"} %llu\n", dropCauseNames[i], (unsigned long long)m.droppedFrames[i]);
+  fprintf(handle, "# TYPE fbcp_interlaced_updates_total counter\n");
+  for(int i = 0; i < NUM_DROP_CAUSES; ++i) fprintf(handle, "fbcp_interlaced_updates_total{cause=\"%s\"} %llu\n", dropCauseNames[i], (unsigned long long)m.interlacedUpdates[i]);
+  uint64_t now = tick();
+  for(int i = MAX(0, m.numDropExamples - NUM_DROP_EXAMPLES); i < m.numDropExamples; ++i)
+  {
+    const DropExample &e = m.dropExamples[i % NUM_DROP_EXAMPLES];
+    if (e.interlaced) fprintf(handle, "# drop %.3fs ago: interlaced update, cause %s, %.2fms against a budget of %.2fms\n", (now - e.time) / 1000000.0, dropCauseNames[e.cause], e.usecs / 1000.0, e.budgetUsecs / 1000.0);
+    else fprintf(handle, "# drop %.3fs ago: %d frames dropped, cause %s, %.2fms against a budget of %.2fms\n", (now - e.time) / 1000000.0, e.frames, dropCauseNames[e.cause], e.usecs / 1000.0, e.budgetUsecs / 1000.0);
+  }
+#ifdef OSCILLATION_FILTER
+  fprintf(handle, "# TYPE fbcp_oscillation_bytes_saved_per_second gauge\nfbcp_oscillation_bytes_saved_per_second %.0f\n", m.oscillationBytesSavedPerSecond);
+#endif
+  fclose(handle);
+  rename(STATISTICS_METRICS_FILE ".tmp", STATISTICS_METRICS_FILE);
+}
+#endif
+
+static pthread_t pollThread;
+static bool pollThreadRunning = false;
+static volatile int pollThreadQuit = 0;
+
 void *poll_thread(void *unused)
 {
-  for(;;)
+  RegisterStatisticsThread("stats");
+  uint64_t lastSampleTime = tick(), lastSensorsTime = 0;
+  while(!SleepUnlessQuit(&pollThreadQuit, STATISTICS_REFRESH_INTERVAL))
   {
-    usleep(1000000);
-    // SPI bus speed
-    FILE *handle = popen("vcgencmd measure_clock core", "r");
-    char t[64] = {};
-    if (handle)
-    {
-      int ret = fread(t, 1, sizeof(t)-1, handle);
-      pclose(handle);
-    }
-    char *s = t;
-    while(*s && *s != '=') ++s;
-    if (*s == '=') ++s;
-    statsSpiBusSpeed = atoi(s)/1000000;
-
-    // CPU temperature
-    handle = fopen("/sys/class/thermal/thermal_zone0/temp", "r");
-    char t2[32] = {};
-    if (handle)
-    {
-      fread(t2, 1, sizeof(t2)-1, handle);
-      fclose(handle);
-    }
-    statsCpuTemperature = atoi(t2)/1000.0;
+    uint64_t now = tick();
+    SampleThreads(now - lastSampleTime);
+    lastSampleTime = now;
+#ifdef STATISTICS_METRICS_FILE
+    ExportMetrics();
+#endif
 
-    // Raspberry pi main CPU core speed
-    handle = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
-    char t3[32] = {};
-    if (handle)
-    {
-      fread(t3, 1, sizeof(t3)-1, handle);
-      fclose(handle);
-    }
-    statsCpuFrequency = atoi(t3) / 1000;
+    if (now - lastSensorsTime < 1000000) continue; // Sampling the sensors spawns vcgencmd, so only do it once a second
+    lastSensorsTime = now;
+    SoCSensors sensors;
+#ifdef PERFORMANCE_GOVERNOR
+    ReadLatestSoCSensors(&sensors); // The governor thread is sampling them already
+#else
+    ReadSoCSensors(&sensors);
+#endif
+    statsSpiBusSpeed = sensors.coreClock;
+    statsCpuTemperature = sensors.temperature;
+    statsCpuFrequency = sensors.cpuFrequency;
   }
+  return 0;
 }
 
 int InitStatistics()
 {
-  pthread_t thread;
-  int rc = pthread_create(&thread, NULL, poll_thread, NULL);
+  RegisterStatisticsThread("main");
+#ifdef STATISTICS_GRAPH
+  for(int x = 0; x < DISPLAY_WIDTH; ++x) ClearGraphColumn(x);
+#endif
+  pollThreadQuit = 0;
+  int rc = pthread_create(&pollThread, NULL, poll_thread, NULL);
   if (rc != 0) FATAL_ERROR("Failed to create Statistics polling thread!");
+  pollThreadRunning = true;
+  return 0;
+}
+
+void DeinitStatistics()
+{
+  if (pollThreadRunning)
+  {
+    StopThread(pollThread, &pollThreadQuit);
+    pollThreadRunning = false;
+  }
+  // The pipeline threads have all been stopped, and register again when they are restarted
+  pthread_mutex_lock(&statsThreadsLock);
+  numStatsThreads = 0;
+  memset(statsThreads, 0, sizeof(statsThreads));
+  pthread_mutex_unlock(&statsThreadsLock);
 }
 
 void DrawStatisticsOverlay(uint16_t *framebuffer)
@@ -96,6 +397,17 @@ void DrawStatisticsOverlay(uint16_t *framebuffer)
   DrawText(framebuffer, spiSpeedText, 145, 1, RGB565(31,14,20), 0);
   DrawText(framebuffer, cpuTemperatureText, 220, 1, cpuTemperatureColor, 0);
   DrawText(framebuffer, gpuPollingWastedText, 262, 1, gpuPollingWastedColor, 0);
+  DrawText(framebuffer, mispredictedFramesText, 292, 1, RGB565(31,30,11), 0);
+  DrawText(framebuffer, planCacheText, 1, 10, 0xFFFF, 0);
+  DrawText(framebuffer, touchText, 130, 10, 0xFFFF, 0);
+  DrawText(framebuffer, spiThreadCpuText, 250, 10, 0xFFFF, 0);
+  DrawText(framebuffer, governorText, 292, 10, RGB565(31,0,0), 0);
+  DrawText(framebuffer, threadCpuText, 1, 19, RGB565(20,50,31), 0);
+  DrawText(framebuffer, oscillationText, 214, 19, RGB565(31,30,11), 0);
+  DrawText(framebuffer, contextSwitchesText, 262, 19, RGB565(20,50,31), 0);
+#ifdef STATISTICS_GRAPH
+  for(int y = 0; y < STATISTICS_GRAPH_HEIGHT; ++y) memcpy(framebuffer + (STATISTICS_TEXT_HEIGHT + y) * DISPLAY_WIDTH, graphPixels[y], sizeof(graphPixels[y]));
+#endif
 }
 
 void RefreshStatisticsOverlayText()
@@ -115,6 +427,7 @@ void RefreshStatisticsOverlayText()
   spiThreadUtilizationRate = MIN(1.0, MAX(0.0, 1.0 - spiThreadIdleFor / (double)STATISTICS_REFRESH_INTERVAL));
   int spiRate = (int)MIN(100, (spiThreadUtilizationRate*100.0));
   sprintf(spiUsagePercentageText, "%d%%", spiRate);
+
 #endif
   spiBusDataRate = (double)8.0 * statsBytesTransferred * 1000.0 / (elapsed / 1000.0);
 
@@ -151,8 +464,82 @@ void RefreshStatisticsOverlayText()
   }
   else gpuPollingWastedText[0] = '\0';
 
+  // Number of frames that the bus cost model predicted would finish sending in time, but were still in flight when the next frame came in
+  if (statsMispredictedFrames > 0) sprintf(mispredictedFramesText, "!%d", statsMispredictedFrames);
+  else mispredictedFramesText[0] = '\0';
+  statsMispredictedFrames = 0;
+
+#ifdef USE_SPAN_PLAN_CACHE
+  // Span plan cache hit rate, and how much span merging time per second the hits have saved
+  if (statsPlanCacheHits + statsPlanCacheMisses > 0)
+    sprintf(planCacheText, "plan$ %d%% -%.2fms/s", statsPlanCacheHits * 100 / (statsPlanCacheHits + statsPlanCacheMisses), statsPlanningUsecsSaved / (elapsed / 1000.0));
+  else planCacheText[0] = '\0';
+  statsPlanCacheHits = statsPlanCacheMisses = 0;
+  statsPlanningUsecsSaved = 0;
+#endif
+
+#ifdef TOUCH_CONTROLLER_STMPE610
+  // Share of SPI bus time spent polling the touch controller, and the worst delay of a touch poll due to display traffic
+  uint64_t touchBusUsecs = __atomic_load_n(&statsTouchBusUsecs, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&statsTouchBusUsecs, touchBusUsecs, __ATOMIC_RELAXED);
+  sprintf(touchText, "touch %.1f%% <%.1fms", touchBusUsecs * 100.0 / elapsed, statsTouchMaxLatency / 1000.0);
+  statsTouchMaxLatency = 0;
+#endif
+
+  // CPU time actually consumed by each pipeline thread per displayed frame, and the context switches of all of them per second, as
+  // last sampled by the poll thread
+  double framesPerSecond = statsFramesDisplayed * 1000000.0 / elapsed;
+  pthread_mutex_lock(&statsThreadsLock);
+  statsFramesPerSecond = framesPerSecond;
+  int numThreads = numStatsThreads;
+  double totalVoluntarySwitches = 0, totalInvoluntarySwitches = 0;
+  int len = sprintf(threadCpuText, "ms/f");
+  for(int i = 0; i < numThreads; ++i)
+  {
+    const StatisticsThread &t = statsThreads[i];
+    totalVoluntarySwitches += t.voluntarySwitchesPerSecond;
+    totalInvoluntarySwitches += t.involuntarySwitchesPerSecond;
+    if (!strcmp(t.name, "spi"))
+    {
+      spiThreadCpuUsage = t.cpuMsPerSecond / 1000.0;
+      sprintf(spiThreadCpuText, "cpu %d%%", (int)(spiThreadCpuUsage*100.0 + 0.5));
+    }
+    char entry[32];
+    int entryLen = sprintf(entry, " %s %.1f", t.name, t.cpuMsPerFrame);
+    if (len + entryLen <= 34 && t.cpuMsPerFrame >= 0.05) len += sprintf(threadCpuText + len, "%s", entry); // Leave room for the texts to the right
+  }
+  pthread_mutex_unlock(&statsThreadsLock);
+  sprintf(contextSwitchesText, "cs %d/%d", (int)(totalVoluntarySwitches + 0.5), (int)(totalInvoluntarySwitches + 0.5));
+#ifdef OSCILLATION_FILTER
+  // Bus bytes per second saved by holding toggling pixels still
+  double oscillationBytesSavedPerSecond = statsOscillationBytesSaved * 1000000.0 / elapsed;
+  statsOscillationBytesSaved = 0;
+  if (oscillationBytesSavedPerSecond >= 1024) sprintf(oscillationText, "~%dkB", (int)(oscillationBytesSavedPerSecond / 1024));
+  else oscillationText[0] = '\0';
+#endif
+#ifdef STATISTICS_METRICS_FILE
+#ifdef OSCILLATION_FILTER
+  SnapshotMetrics(framesPerSecond, oscillationBytesSavedPerSecond);
+#else
+  SnapshotMetrics(framesPerSecond, 0);
+#endif
+#endif
+  statsFramesDisplayed = 0;
+
+#ifdef PERFORMANCE_GOVERNOR
+  // Shown while the governor is constraining the pipeline due to heat or throttling, with the number of level changes so far
+  if (governorLevel == GOVERNOR_CONSTRAINED) sprintf(governorText, "G%d", statsGovernorTransitions);
+  else governorText[0] = '\0';
+#endif
+
   statsLastPrint = now;
 
+  // The cause letters stay up for as long as the overlay shows skipped frames or the interlacing marker
+  char skipCause = DominantDropCause(dropsSinceRefresh[0]), interlaceCause = DominantDropCause(dropsSinceRefresh[1]);
+  if (skipCause) skipCauseLetter = skipCause;
+  if (interlaceCause) interlaceCauseLetter = interlaceCause;
+  memset(dropsSinceRefresh, 0, sizeof(dropsSinceRefresh));
+
   if (frameTimeHistorySize >= 3)
   {
     bool haveInterlacedFramesInHistory = false;
@@ -171,11 +558,16 @@ void RefreshStatisticsOverlayText()
     sprintf(fpsText, "%d", fps);
     fpsColor = 0xFFFF;
 #else
-    sprintf(fpsText, "%d%c", fps, haveInterlacedFramesInHistory ? 'i' : 'p');
+    if (!haveInterlacedFramesInHistory) interlaceCauseLetter = 0;
+    sprintf(fpsText, "%d%c%.1s", fps, haveInterlacedFramesInHistory ? 'i' : 'p', &interlaceCauseLetter);
     fpsColor = haveInterlacedFramesInHistory ? RGB565(31, 30, 11) : 0xFFFF;
 #endif
-    if (frameSkipTimeHistorySize > 0) sprintf(statsFrameSkipText, "-%d", frameSkipTimeHistorySize);
-    else statsFrameSkipText[0] = '\0';
+    if (frameSkipTimeHistorySize > 0) sprintf(statsFrameSkipText, "-%d%.1s", frameSkipTimeHistorySize, &skipCauseLetter);
+    else
+    {
+      statsFrameSkipText[0] = '\0';
+      skipCauseLetter = 0;
+    }
   }
   else
   {
@@ -185,7 +577,9 @@ void RefreshStatisticsOverlayText()
   }
 }
 #else
-int InitStatistics() {}
+int InitStatistics() { return 0; }
+void DeinitStatistics() {}
+void RegisterStatisticsThread(const char *) {}
 void RefreshStatisticsOverlayText() {}
 void DrawStatisticsOverlay(uint16_t *) {}
 #endif // ~STATISTICS
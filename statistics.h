@@ -2,12 +2,25 @@
 
 #include <inttypes.h>
 
-#include "gpu.h"
+#include "config.h"
+#include "framerate.h"
 
 int InitStatistics(void);
+void DeinitStatistics(void); // Called once all the other pipeline threads have been stopped
 void RefreshStatisticsOverlayText(void);
 void DrawStatisticsOverlay(uint16_t *framebuffer);
 
+// Called at the start of each pipeline thread to name it, and to have its CPU time and context switches accounted for.
+void RegisterStatisticsThread(const char *name);
+
+// Number of scanlines at the top of the screen that the statistics overlay draws over
+#define STATISTICS_TEXT_HEIGHT 28
+#if defined(STATISTICS) && defined(STATISTICS_GRAPH)
+#define STATISTICS_OVERLAY_HEIGHT (STATISTICS_TEXT_HEIGHT + STATISTICS_GRAPH_HEIGHT)
+#else
+#define STATISTICS_OVERLAY_HEIGHT STATISTICS_TEXT_HEIGHT
+#endif
+
 #ifdef STATISTICS
 
 extern volatile uint64_t timeWastedPollingGPU;
@@ -15,13 +28,59 @@ extern volatile int statsSpiBusSpeed;
 extern volatile int statsCpuFrequency;
 extern volatile double statsCpuTemperature;
 extern double spiThreadUtilizationRate;
+extern double spiThreadCpuUsage;
 extern double spiBusDataRate;
 extern int statsGpuPollingWasted;
 extern uint64_t statsBytesTransferred;
+extern int statsMispredictedFrames;
+extern int statsPlanCacheHits;
+extern int statsPlanCacheMisses;
+extern double statsPlanningUsecsSaved;
+extern int statsFramesDisplayed;
+
+#ifdef SHADOW_PLANNER
+// Totals of a span planner over the frames that both the production planner and the shadow planner planned
+struct PlannerStatistics
+{
+  uint64_t frames, interlacedFrames;
+  uint64_t bytes, commands; // Put on the SPI bus by the chosen plans
+  double busUsecs; // Modeled SPI bus time of the chosen plans
+  uint64_t cpuUsecs; // CPU time spent planning
+};
+extern PlannerStatistics statsProductionPlanner, statsShadowPlanner;
+extern uint64_t statsShadowFramesSkipped; // Frames that the shadow planner was still busy for
+#endif
+
+#ifdef STATISTICS_GRAPH
+// Called after each display update that put bytes on the bus, to add a column for it to the graph strip. Only the new column and
+// the gap ahead of it change, so the graph adds just a couple of columns of pixels to the diff of the next frame.
+void AddStatisticsGraphSample(bool interlaced, int skippedFrames, uint32_t bytes);
+#endif
 
 extern int frameSkipTimeHistorySize;
 extern uint64_t frameSkipTimeHistory[FRAME_HISTORY_MAX_SIZE];
 
+// Why source frames were dropped, or an update was degraded to an interlaced field. The letter after each is what the overlay shows
+// after the skipped frame count and the interlacing marker for the most common recent cause.
+enum DropCause
+{
+  DROP_CAPTURE_LATE = 0, // L: the main thread was not kept busy, but the frame came in right after a previous frame that was captured late
+  DROP_PLANNER_OVER_BUDGET = 1, // P: the main thread spent over half a frame interval copying, planning and queueing updates
+  DROP_SPI_QUEUE_FULL = 2, // Q: skipped while the main thread mostly waited on the SPI queue, or interlaced with more work already queued than the progressive update
+  DROP_SPI_BANDWIDTH = 3, // B: interlaced with a progressive update at least as large as the work already queued on the bus
+  DROP_POLLING_MISS = 4, // M: the GPU was not polled while the frame was up, so it was never captured
+  DROP_GOVERNOR = 5, // G: interlaced only because the performance governor tightened the budget while the SoC is hot or throttled
+  NUM_DROP_CAUSES = 6
+};
+
+// Records that the given number of source frames were dropped, or if interlaced, that the update of a new frame was sent as an
+// interlaced field, due to the given cause. usecs is the measurement that the cause was decided on, e.g. the time waited for the SPI
+// queue, and budgetUsecs what it was compared against. These are kept for the most recent drops, and exported as examples.
+void RecordFrameDrop(int cause, bool interlaced, int frames, uint32_t usecs, uint32_t budgetUsecs);
+
+extern uint64_t statsDroppedFrames[NUM_DROP_CAUSES]; // Totals since startup
+extern uint64_t statsInterlacedUpdates[NUM_DROP_CAUSES];
+
 // All overlay statistics are double-buffered: the updated data fields
 // are polled at certain rate, and updated in the first copy below. However
 // it is not desired that any changes in the overlay numbers would trigger
@@ -40,5 +99,13 @@ extern char cpuTemperatureText[32];
 extern uint16_t cpuTemperatureColor;
 extern char gpuPollingWastedText[32];
 extern uint16_t gpuPollingWastedColor;
+extern char mispredictedFramesText[32];
+extern char planCacheText[32];
+extern char touchText[32];
+extern char spiThreadCpuText[32];
+extern char governorText[32];
+extern char threadCpuText[64];
+extern char contextSwitchesText[32];
+extern char oscillationText[32];
 
 #endif
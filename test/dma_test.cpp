@@ -0,0 +1,221 @@
+// Host unit test of the DMA chain builder in dma.cpp. Instead of running the whole pipeline simulator, this drives dma_spi_thread()
+// directly on the calling thread against the simulated DMA controller of dma.cpp, and stubs out the rest of the simulator: the
+// DMA controller runs some control blocks whenever the SPI thread sleeps. The bytes that the TX channel sends are recorded together
+// with the state of the D/C line, and compared to the tasks that were queued. Built with cmake -DSIMULATOR=ON, run with ctest.
+
+#ifndef USE_DMA_TRANSFERS
+#define USE_DMA_TRANSFERS
+#endif
+#include "../dma.cpp"
+
+#include <stdarg.h>
+#include <vector>
+
+SharedMemory *spiTaskMemory = 0;
+volatile GPIORegisterFile *gpio = 0;
+volatile SPIRegisterFile *spi = 0;
+double spiUsecsPerByte = 0.01;
+double spiUsecsPerTask = 0.02;
+pthread_t spiThread;
+volatile int spiThreadQuit = 0;
+volatile int spiThreadExited = 0;
+uint64_t spiBytesCommitted = 0;
+volatile uint64_t spiBytesSent = 0;
+#ifdef SPI_PIXEL_DESCRIPTORS
+uint16_t *pixelFramebuffers[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS] = {};
+volatile uint32_t pixelFramebufferUsers[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS] = {};
+uint16_t pixelFramebufferVersions[SPI_PIXEL_DESCRIPTOR_FRAMEBUFFERS] = {};
+#endif
+#ifdef STATISTICS
+volatile uint64_t spiThreadIdleUsecs = 0;
+volatile uint64_t spiThreadSleepStartTime = 0;
+volatile int spiThreadSleeping = 0;
+#endif
+
+static GPIORegisterFile fakeGpio;
+static SPIRegisterFile fakeSpi;
+
+static std::vector<uint16_t> expectedBus, bus; // (D/C line << 8) | byte
+static uint32_t randomState = 1;
+static bool producing = false; // True while the test itself queues tasks, as opposed to running the SPI thread
+static bool inControlBlock = false;
+static int numFailures = 0;
+static int numAllocTaskWaits = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++numFailures; } } while(0)
+
+static uint32_t Random(uint32_t n)
+{
+  randomState = randomState * 1103515245 + 12345;
+  return (randomState >> 8) % n;
+}
+
+static void RunControlBlocks(int n)
+{
+  while(n-- > 0 && (dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE))
+  {
+    inControlBlock = true;
+    SimRunControlBlock();
+    inControlBlock = false;
+  }
+}
+
+static void RunUntilIdle()
+{
+  RunControlBlocks(0x7FFFFFFF);
+}
+
+uint64_t tick() { static uint64_t t = 0; return ++t; }
+uint64_t SimTime() { return tick(); }
+
+int SimUsleep(useconds_t usecs)
+{
+  if (inControlBlock) return 0;
+  if (producing)
+  {
+    // AllocTask() is waiting for room in the task queue: retire a task like the SPI thread would, and make sure that the wait
+    // does not poke the SPI registers, which belong to the DMA controller now.
+    CHECK(spi->cs == (BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_CLEAR));
+    ++numAllocTaskWaits;
+    SPITask *task = GetTask();
+    if (task) DoneTask(task);
+    return 0;
+  }
+  RunControlBlocks(usecs <= 1 ? 1 : 1 + Random(16));
+  return 0;
+}
+
+long SimSyscall(long number, ...)
+{
+  va_list args;
+  va_start(args, number);
+  void *addr = va_arg(args, void*);
+  int op = va_arg(args, int);
+  va_arg(args, int);
+  const struct timespec *timeout = va_arg(args, const struct timespec*);
+  va_end(args);
+  if (number != SYS_futex || op != FUTEX_WAIT || producing) return 0;
+  CHECK(addr == &spiTaskMemory->queueTail);
+  if (timeout)
+  {
+    // Let the chain run partway, so that new tasks get spliced onto a running chain
+    static int idleWaits = 0;
+    idleWaits = (dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE) ? 0 : idleWaits + 1;
+    if (idleWaits > 1000)
+    {
+      fprintf(stderr, "SPI thread waits for tasks in flight, but the DMA controller is not running!\n");
+      exit(1);
+    }
+    RunControlBlocks(1 + Random(64));
+  }
+  else
+  {
+    // The SPI thread has handed over and retired everything, and sleeps waiting for new tasks: end the round
+    RunUntilIdle();
+    spiThreadQuit = 1;
+  }
+  return 0;
+}
+
+int SimCreateThread(pthread_t *thread, const pthread_attr_t *attr, void *(*startRoutine)(void*), void *arg, const char *name) { return 0; }
+
+// Records the bytes of the transfer that the TX channel was started on, with the D/C line state they are sent with.
+void SimSPITransfer(uint32_t bytes)
+{
+  const DMAControlBlock *tx = SimFetchControlBlock(dmaTx->conblk_ad);
+  const uint8_t *data = (const uint8_t*)SimBusToVirtual(tx->src + 4, bytes);
+  for(uint32_t i = 0; i < bytes; ++i) bus.push_back((uint16_t)((simDCLine << 8) | data[i]));
+}
+
+void RegisterStatisticsThread(const char *name) {}
+void PublishPresentedFrames() {}
+
+SPITask *GetTask()
+{
+  uint32_t head = spiTaskMemory->queueHead;
+  uint32_t tail = spiTaskMemory->queueTail;
+  if (head == tail) return 0;
+  SPITask *task = (SPITask*)(spiTaskMemory->buffer + head);
+  if (task->cmd == 0)
+  {
+    spiTaskMemory->queueHead = 0;
+    if (tail == 0) return 0;
+    task = (SPITask*)spiTaskMemory->buffer;
+  }
+  return task;
+}
+
+void DoneTask(SPITask *task)
+{
+  __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, SPITaskBusBytes(task), __ATOMIC_RELAXED);
+  spiBytesSent += SPITaskBusBytes(task);
+  spiTaskMemory->queueHead = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
+}
+
+// Queues a task of random size and contents, and returns the number of bytes it takes in the task queue.
+static uint32_t QueueRandomTask()
+{
+  uint32_t size = Random(8) == 0 ? Random(MAX_SPI_TASK_SIZE + 1) : Random(64);
+  SPITask *task = AllocTask(size);
+  task->cmd = 0x2A + Random(4);
+  for(uint32_t i = 0; i < size; ++i) task->data[i] = (uint8_t)Random(256);
+  CommitTask(task);
+  expectedBus.push_back(task->cmd);
+  for(uint32_t i = 0; i < size; ++i) expectedBus.push_back((uint16_t)(0x100 | task->data[i]));
+  return sizeof(SPITask) + size;
+}
+
+// Queues tasks until the queue is full, so that AllocTask() has to wait for the consumer.
+static void TestAllocTaskWaitLeavesSPIRegistersAlone()
+{
+  producing = true;
+  for(uint32_t queued = 0; queued < 2*SPI_QUEUE_SIZE; queued += sizeof(SPITask) + MAX_SPI_TASK_SIZE)
+  {
+    SPITask *task = AllocTask(MAX_SPI_TASK_SIZE);
+    task->cmd = 0x2C;
+    CommitTask(task);
+  }
+  CHECK(numAllocTaskWaits > 0);
+  while(spiTaskMemory->queueHead != spiTaskMemory->queueTail) SimUsleep(100);
+  producing = false;
+}
+
+// Runs the SPI thread over rounds of random tasks, which wrap around the task queue and the DMA rings.
+static void TestTasksReachTheBus()
+{
+  for(int round = 0; round < 50; ++round)
+  {
+    producing = true;
+    uint32_t numTasks = 1 + Random(2000);
+    uint32_t bytes = 0;
+    for(uint32_t i = 0; i < numTasks && bytes < SPI_QUEUE_SIZE/2; ++i) bytes += QueueRandomTask();
+    producing = false;
+
+    spiThreadQuit = spiThreadExited = 0;
+    dma_spi_thread(0);
+    CHECK(spiThreadExited);
+    CHECK(spiTaskMemory->queueHead == spiTaskMemory->queueTail);
+    CHECK(numTasksInFlight == 0);
+    CHECK(!(dmaSequencer->cs & BCM2835_DMA_CS_ACTIVE));
+    CHECK(dmaConstants->progress == lastQueuedSequence);
+  }
+  CHECK(bus.size() == expectedBus.size());
+  CHECK(bus == expectedBus);
+}
+
+int main()
+{
+  spiTaskMemory = (SharedMemory*)calloc(1, SHARED_MEMORY_SIZE);
+  gpio = &fakeGpio;
+  spi = &fakeSpi;
+  InitDMA();
+  CHECK(spi->cs == (BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_CLEAR));
+
+  TestAllocTaskWaitLeavesSPIRegistersAlone();
+  CHECK(spi->cs == (BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_CLEAR));
+  TestTasksReachTheBus();
+  CHECK(spi->cs == (BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_CLEAR));
+
+  printf("dma_test: %d bytes sent in %u tasks, %d failures\n", (int)bus.size(), lastQueuedSequence, numFailures);
+  return numFailures ? 1 : 0;
+}
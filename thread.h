@@ -0,0 +1,35 @@
+#pragma once
+
+#include <inttypes.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "tick.h"
+
+// Background threads that poll at an interval sleep on their quit flag instead of in usleep(), so that stopping them does not have
+// to wait out the rest of the interval. Sleeps for the given number of usecs, or until the flag is raised. Returns the flag.
+static inline int SleepUnlessQuit(volatile int *quit, uint64_t usecs)
+{
+  uint64_t wakeTime = tick() + usecs;
+  for(;;)
+  {
+    if (__atomic_load_n(quit, __ATOMIC_ACQUIRE)) return 1;
+    uint64_t now = tick();
+    if (now >= wakeTime) return 0;
+    struct timespec timeout = {};
+    timeout.tv_sec = (time_t)((wakeTime - now) / 1000000);
+    timeout.tv_nsec = (long)((wakeTime - now) % 1000000) * 1000;
+    syscall(SYS_futex, quit, FUTEX_WAIT, 0, &timeout, 0, 0);
+  }
+}
+
+// Raises the quit flag of a thread that sleeps in SleepUnlessQuit(), and waits for it to exit. Threads that block on another futex
+// must be woken on that one as well.
+static inline void StopThread(pthread_t thread, volatile int *quit)
+{
+  __atomic_store_n(quit, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, quit, FUTEX_WAKE, 1, 0, 0, 0);
+  pthread_join(thread, 0);
+}
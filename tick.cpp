@@ -5,6 +5,9 @@
 
 uint64_t tick()
 {
+#ifdef SIMULATOR
+  return SimTime();
+#endif
   struct timespec start;
   clock_gettime(CLOCK_REALTIME, &start);
   return start.tv_sec * 1000000 + start.tv_nsec / 1000;
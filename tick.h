@@ -6,6 +6,8 @@
 
 uint64_t tick(void);
 
+#include "sim.h"
+
 #endif
 
 
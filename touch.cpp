@@ -0,0 +1,174 @@
+#include "config.h"
+#include "touch.h"
+
+#ifdef TOUCH_CONTROLLER_STMPE610
+
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "spi.h"
+#include "log.h"
+#include "tick.h"
+#include "util.h"
+
+uint64_t touchNextPollTime = 0;
+#ifndef SIMULATOR
+static int uinputFd = -1;
+#endif
+static bool touchDown = false;
+
+#ifdef STATISTICS
+volatile uint64_t statsTouchBusUsecs = 0;
+volatile uint64_t statsTouchMaxLatency = 0;
+#endif
+
+// Performs a single transfer with the touch controller: the STMPE610 is rated at 1MHz SPI clock, so this temporarily switches
+// the bus over to chip select CE1 at a lower clock rate, and then restores the display transfer state on CE0.
+static void TouchTransfer(const uint8_t *tx, uint8_t *rx, int bytes)
+{
+#ifdef SIMULATOR
+  SimTouchTransfer(tx, rx, bytes); // No hardware, a model of the touch controller answers instead
+#else
+  // Let any display bytes still in the FIFO finish before deasserting the display chip select
+  uint32_t cs;
+  while(!((cs = spi->cs) & BCM2835_SPI0_CS_DONE)) /*nop*/;
+  spi->cs = BCM2835_SPI0_CS_CLEAR;
+  spi->clk = TOUCH_SPI_CLOCK_DIVISOR;
+  spi->cs = BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_TA | 1/*CE1*/;
+  for(int i = 0; i < bytes; ++i)
+  {
+    spi->fifo = tx[i];
+    while(!(spi->cs & BCM2835_SPI0_CS_RXD)) /*nop*/;
+    rx[i] = spi->fifo;
+  }
+  while(!(spi->cs & BCM2835_SPI0_CS_DONE)) /*nop*/;
+  spi->cs = BCM2835_SPI0_CS_CLEAR;
+  spi->clk = SPI_BUS_CLOCK_DIVISOR;
+  spi->cs = BCM2835_SPI0_CS_CLEAR | (cs & BCM2835_SPI0_CS_TA); // Back to CE0, resuming the display transfer if one was active
+#endif
+}
+
+static void WriteTouchRegister(uint8_t reg, uint8_t value)
+{
+  uint8_t tx[2] = { reg, value }, rx[2];
+  TouchTransfer(tx, rx, 2);
+}
+
+static uint8_t ReadTouchRegister(uint8_t reg)
+{
+  uint8_t tx[2] = { (uint8_t)(STMPE_READ | reg), 0 }, rx[2];
+  TouchTransfer(tx, rx, 2);
+  return rx[1];
+}
+
+static void EmitInputEvent(uint16_t type, uint16_t code, int32_t value)
+{
+#ifdef SIMULATOR
+  SimTouchEvent(type, code, value);
+#else
+  struct input_event ev = {};
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+  if (write(uinputFd, &ev, sizeof(ev)) != sizeof(ev)) { /* Dropping events if the input subsystem does not keep up is fine, next poll will catch up */ }
+#endif
+}
+
+void PollTouch()
+{
+  uint64_t t0 = tick();
+#ifdef STATISTICS
+  if (t0 - touchNextPollTime > statsTouchMaxLatency) statsTouchMaxLatency = t0 - touchNextPollTime;
+#endif
+  ScheduleNextTouchPoll(t0);
+
+  // Read touch detection status and FIFO fill level in one transfer: the STMPE610 returns the value of the previous address byte
+  // while receiving the next.
+  uint8_t tx[5] = { STMPE_READ | STMPE_TSC_CTRL, STMPE_READ | STMPE_FIFO_SIZE, 0 }, rx[5];
+  TouchTransfer(tx, rx, 3);
+  bool touched = (rx[1] & STMPE_TSC_CTRL_TOUCH_DET);
+  int samples = rx[2];
+
+  if (samples > 0)
+  {
+    // Only the most recent sample matters, drop the older ones from the FIFO
+    for(int i = 0; i < 5; ++i) tx[i] = (i < 4) ? (STMPE_READ | STMPE_TSC_DATA_XYZ) : 0;
+    while(samples-- > 0) TouchTransfer(tx, rx, 5);
+    int x = (rx[1] << 4) | (rx[2] >> 4);
+    int y = ((rx[2] & 0x0F) << 8) | rx[3];
+    int z = rx[4];
+    EmitInputEvent(EV_ABS, ABS_X, x);
+    EmitInputEvent(EV_ABS, ABS_Y, y);
+    EmitInputEvent(EV_ABS, ABS_PRESSURE, z);
+    if (!touchDown) EmitInputEvent(EV_KEY, BTN_TOUCH, 1);
+    EmitInputEvent(EV_SYN, SYN_REPORT, 0);
+    touchDown = true;
+    WriteTouchRegister(STMPE_INT_STA, 0xFF);
+  }
+  else if (!touched && touchDown)
+  {
+    EmitInputEvent(EV_ABS, ABS_PRESSURE, 0);
+    EmitInputEvent(EV_KEY, BTN_TOUCH, 0);
+    EmitInputEvent(EV_SYN, SYN_REPORT, 0);
+    touchDown = false;
+  }
+#ifdef STATISTICS
+  __atomic_fetch_add(&statsTouchBusUsecs, tick() - t0, __ATOMIC_RELAXED);
+#endif
+}
+
+int InitTouch()
+{
+  uint16_t chipId = (ReadTouchRegister(STMPE_CHIP_ID) << 8) | ReadTouchRegister(STMPE_CHIP_ID+1);
+  if (chipId != 0x0811)
+  {
+    LogMessage(LOG_INFO, "STMPE610 touch controller not found on SPI0 CE1 (chip id 0x%04X), touch input disabled", chipId);
+    touchNextPollTime = TOUCH_POLL_DISABLED;
+    return -1;
+  }
+
+  // Same configuration as the Adafruit STMPE610 library: 4 sample averaging, 12-bit X/Y and 8-bit Z, FIFO threshold of 1 sample.
+  WriteTouchRegister(STMPE_SYS_CTRL1, STMPE_SYS_CTRL1_RESET);
+  usleep(10000);
+  WriteTouchRegister(STMPE_SYS_CTRL2, 0x00); // Turn on all clocks
+  WriteTouchRegister(STMPE_TSC_CTRL, STMPE_TSC_CTRL_EN_XYZ);
+  WriteTouchRegister(STMPE_ADC_CTRL1, 0x60); // 10-bit ADC, 80 clocks sample time
+  WriteTouchRegister(STMPE_ADC_CTRL2, 0x02); // 6.5MHz ADC clock
+  WriteTouchRegister(STMPE_TSC_CFG, 0xA4); // 4 samples, 1ms touch detect delay, 5ms settling time
+  WriteTouchRegister(STMPE_TSC_FRACTION_Z, 0x06);
+  WriteTouchRegister(STMPE_FIFO_TH, 1);
+  WriteTouchRegister(STMPE_FIFO_STA, STMPE_FIFO_STA_RESET);
+  WriteTouchRegister(STMPE_FIFO_STA, 0);
+  WriteTouchRegister(STMPE_TSC_I_DRIVE, 0x01); // 50mA
+  WriteTouchRegister(STMPE_INT_STA, 0xFF);
+
+#ifndef SIMULATOR // The simulator checks the events that would be published instead
+  // Publish touches as a virtual input device. The coordinates are raw 12-bit ADC values, calibration is left to the consumer (e.g. tslib).
+  uinputFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (uinputFd < 0) FATAL_ERROR("Failed to open /dev/uinput for publishing touch events!");
+  ioctl(uinputFd, UI_SET_EVBIT, EV_KEY);
+  ioctl(uinputFd, UI_SET_KEYBIT, BTN_TOUCH);
+  ioctl(uinputFd, UI_SET_EVBIT, EV_ABS);
+  ioctl(uinputFd, UI_SET_ABSBIT, ABS_X);
+  ioctl(uinputFd, UI_SET_ABSBIT, ABS_Y);
+  ioctl(uinputFd, UI_SET_ABSBIT, ABS_PRESSURE);
+  struct uinput_user_dev dev = {};
+  snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "fbcp-ili9341 STMPE610 Touchscreen");
+  dev.id.bustype = BUS_SPI;
+  dev.absmax[ABS_X] = dev.absmax[ABS_Y] = 4095;
+  dev.absmax[ABS_PRESSURE] = 255;
+  if (write(uinputFd, &dev, sizeof(dev)) != sizeof(dev) || ioctl(uinputFd, UI_DEV_CREATE) < 0) FATAL_ERROR("Failed to create uinput touch device!");
+#endif
+
+  touchNextPollTime = tick();
+  return 0;
+}
+
+#endif
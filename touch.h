@@ -0,0 +1,72 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef TOUCH_CONTROLLER_STMPE610
+
+#ifdef KERNEL_MODULE_CLIENT
+#error TOUCH_CONTROLLER_STMPE610 needs the userland SPI thread to own the bus, it is not supported with KERNEL_MODULE_CLIENT
+#endif
+
+// The STMPE610 touch controller on the PiTFT 2.8" resistive shares the SPI0 bus with the display, on chip select CE1. Since this
+// program owns the bus, the kernel stmpe-ts driver cannot be used, and instead the SPI thread polls the touch controller
+// in between display SPI tasks, and publishes the touch events via uinput. In the simulator, a model of the STMPE610 answers the
+// polls instead (see SimTouchTransfer()).
+
+// STMPE610 registers
+#define STMPE_CHIP_ID 0x00
+#define STMPE_SYS_CTRL1 0x03
+#define STMPE_SYS_CTRL1_RESET 0x02
+#define STMPE_SYS_CTRL2 0x04
+#define STMPE_INT_STA 0x0B
+#define STMPE_ADC_CTRL1 0x20
+#define STMPE_ADC_CTRL2 0x21
+#define STMPE_TSC_CTRL 0x40
+#define STMPE_TSC_CTRL_EN_XYZ 0x01
+#define STMPE_TSC_CTRL_TOUCH_DET 0x80
+#define STMPE_TSC_CFG 0x41
+#define STMPE_FIFO_TH 0x4A
+#define STMPE_FIFO_STA 0x4B
+#define STMPE_FIFO_STA_RESET 0x01
+#define STMPE_FIFO_SIZE 0x4C
+#define STMPE_TSC_FRACTION_Z 0x56
+#define STMPE_TSC_I_DRIVE 0x58
+#define STMPE_TSC_DATA_XYZ 0xD7 // Non-autoincrementing address of the XYZ data FIFO, each read pops one byte
+#define STMPE_READ 0x80
+
+#define TOUCH_POLL_DISABLED UINT64_MAX // Value of touchNextPollTime when no touch controller was found
+
+// Longest time the SPI thread sleeps for before checking up on touch polling again. Keeps the futex timeout small, since time_t is
+// only 32 bits on Raspberry Pi OS.
+#define TOUCH_MAX_SLEEP_USECS 1000000
+
+extern uint64_t touchNextPollTime; // Time when the SPI thread should next poll the touch controller
+
+// Returns true if the touch controller should be polled now. The SPI thread checks this in between display SPI tasks, so a
+// poll is at most delayed by the duration of a single SPI task, i.e. MAX_SPI_TASK_SIZE bytes.
+static inline bool TouchPollDue(uint64_t now) { return now >= touchNextPollTime; }
+
+// Schedules the next poll a TOUCH_POLL_INTERVAL after the previous poll was due, keeping a fixed polling cadence even if
+// individual polls get delayed by display traffic. If polling has fallen behind by more than a full interval, restarts
+// the cadence from the current time instead of trying to catch up with a burst of polls.
+static inline void ScheduleNextTouchPoll(uint64_t now)
+{
+  touchNextPollTime += TOUCH_POLL_INTERVAL;
+  if (touchNextPollTime <= now) touchNextPollTime = now + TOUCH_POLL_INTERVAL;
+}
+
+// Returns how many usecs the SPI thread can sleep while waiting for new display tasks before it needs to poll the touch controller.
+// Only meaningful if touch polling is enabled, i.e. touchNextPollTime != TOUCH_POLL_DISABLED.
+static inline uint64_t TouchPollSleepUsecs(uint64_t now) { return TouchPollDue(now) ? 0 : (touchNextPollTime - now < TOUCH_MAX_SLEEP_USECS ? touchNextPollTime - now : TOUCH_MAX_SLEEP_USECS); }
+
+int InitTouch(void); // Call while the calling thread owns the SPI bus, after display initialization
+void PollTouch(void); // Call on the thread that owns the SPI bus, when TouchPollDue()
+
+#ifdef STATISTICS
+extern volatile uint64_t statsTouchBusUsecs; // Time that touch polling has kept the SPI bus from sending display data
+extern volatile uint64_t statsTouchMaxLatency; // Longest time a touch poll was delayed past its scheduled time
+#endif
+
+#endif
@@ -0,0 +1,386 @@
+#include <linux/futex.h>
+#include <memory.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+#include "display.h"
+#include "statistics.h"
+#include "tick.h"
+#include "util.h"
+
+// LZ77 block format: a sequence of (token, [literal length bytes], literals, match offset, [match length bytes]), where the high
+// nibble of the token is the number of literals and the low nibble the match length minus FRAME_TRACE_MIN_MATCH. A nibble value
+// of 15 means that the length continues in extra bytes, each adding 0-255, until a byte that is not 255. The match offset is two
+// bytes, little endian, and a match may overlap the bytes it produces (e.g. offset 2 repeats a pixel). The last sequence of the
+// block has only literals.
+#define FRAME_TRACE_MIN_MATCH 4
+#define FRAME_TRACE_HASH_BITS 12
+#define FRAME_TRACE_MAX_OFFSET 65535
+
+static inline uint32_t FrameTraceHash(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - FRAME_TRACE_HASH_BITS);
+}
+
+static uint8_t *WriteLength(uint8_t *dst, uint32_t length)
+{
+  while(length >= 255)
+  {
+    *dst++ = 255;
+    length -= 255;
+  }
+  *dst++ = (uint8_t)length;
+  return dst;
+}
+
+static uint8_t *WriteSequence(uint8_t *dst, const uint8_t *literals, uint32_t numLiterals, uint32_t offset, uint32_t matchLength)
+{
+  uint32_t extraMatch = matchLength ? matchLength - FRAME_TRACE_MIN_MATCH : 0;
+  *dst++ = (uint8_t)((MIN(numLiterals, 15) << 4) | MIN(extraMatch, 15));
+  if (numLiterals >= 15) dst = WriteLength(dst, numLiterals - 15);
+  memcpy(dst, literals, numLiterals);
+  dst += numLiterals;
+  if (matchLength)
+  {
+    *dst++ = (uint8_t)offset;
+    *dst++ = (uint8_t)(offset >> 8);
+    if (extraMatch >= 15) dst = WriteLength(dst, extraMatch - 15);
+  }
+  return dst;
+}
+
+uint32_t FrameTraceCompress(const uint8_t *src, uint32_t srcSize, uint8_t *dst)
+{
+  uint32_t table[1 << FRAME_TRACE_HASH_BITS]; // Most recent position of each hashed 4-byte sequence, plus one (0 = none)
+  memset(table, 0, sizeof(table));
+  uint8_t *out = dst;
+  uint32_t anchor = 0; // Start of the literals not yet written out
+  uint32_t i = 0;
+  while(i + FRAME_TRACE_MIN_MATCH <= srcSize)
+  {
+    uint32_t h = FrameTraceHash(src + i);
+    uint32_t candidate = table[h];
+    table[h] = i + 1;
+    if (!candidate || i + 1 - candidate > FRAME_TRACE_MAX_OFFSET || memcmp(src + candidate - 1, src + i, FRAME_TRACE_MIN_MATCH))
+    {
+      ++i;
+      continue;
+    }
+    --candidate;
+    uint32_t matchLength = FRAME_TRACE_MIN_MATCH;
+    while(i + matchLength < srcSize && src[candidate + matchLength] == src[i + matchLength]) ++matchLength;
+    out = WriteSequence(out, src + anchor, i - anchor, i - candidate, matchLength);
+    i += matchLength;
+    anchor = i;
+  }
+  out = WriteSequence(out, src + anchor, srcSize - anchor, 0, 0);
+  return (uint32_t)(out - dst);
+}
+
+static bool ReadLength(const uint8_t *&in, const uint8_t *end, uint32_t &length)
+{
+  uint8_t b;
+  do
+  {
+    if (in >= end) return false;
+    b = *in++;
+    length += b;
+  } while(b == 255);
+  return true;
+}
+
+int FrameTraceDecompress(const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstCapacity)
+{
+  const uint8_t *in = src, *end = src + srcSize;
+  uint32_t o = 0;
+  while(in < end)
+  {
+    uint8_t token = *in++;
+    uint32_t numLiterals = token >> 4;
+    if (numLiterals == 15 && !ReadLength(in, end, numLiterals)) return -1;
+    if (numLiterals > (uint32_t)(end - in) || numLiterals > dstCapacity - o) return -1;
+    memcpy(dst + o, in, numLiterals);
+    in += numLiterals;
+    o += numLiterals;
+    if (in == end) break; // The last sequence has no match
+
+    if (end - in < 2) return -1;
+    uint32_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    uint32_t matchLength = token & 15;
+    if (matchLength == 15 && !ReadLength(in, end, matchLength)) return -1;
+    matchLength += FRAME_TRACE_MIN_MATCH;
+    if (offset == 0 || offset > o || matchLength > dstCapacity - o) return -1;
+    for(uint32_t j = 0; j < matchLength; ++j, ++o) dst[o] = dst[o - offset]; // Byte by byte, since the match may overlap its output
+  }
+  return (int)o;
+}
+
+#define TILES_X(header) (((header).width + (header).tileSize - 1) / (header).tileSize)
+#define TILES_Y(header) (((header).height + (header).tileSize - 1) / (header).tileSize)
+#define TILE_MASK_SIZE(header) ((TILES_X(header) * TILES_Y(header) + 7) / 8)
+#define MAX_PAYLOAD_SIZE(header) (TILE_MASK_SIZE(header) + (header).width * (header).height * 2)
+
+FrameTrace *OpenFrameTrace(const char *filename)
+{
+  FILE *handle = fopen(filename, "rb");
+  if (!handle) return 0;
+  FrameTrace *trace = (FrameTrace *)calloc(1, sizeof(FrameTrace));
+  trace->handle = handle;
+  trace->currentFrame = -1;
+  FrameTraceHeader &header = trace->header;
+  if (fread(&header, sizeof(header), 1, handle) != 1 || memcmp(header.magic, FRAME_TRACE_MAGIC, sizeof(FRAME_TRACE_MAGIC))
+    || header.version != FRAME_TRACE_VERSION || header.tileSize == 0 || header.width == 0 || header.height == 0)
+  {
+    CloseFrameTrace(trace);
+    return 0;
+  }
+
+  fseek(handle, 0, SEEK_END);
+  long fileSize = ftell(handle);
+  fseek(handle, sizeof(header), SEEK_SET);
+
+  // Hop from record header to record header to index the frames
+  int maxFrames = 0;
+  FrameTraceRecord record;
+  while(fread(&record, sizeof(record), 1, handle) == 1 && record.sync == FRAME_TRACE_RECORD_SYNC)
+  {
+    long offset = ftell(handle);
+    if (record.compressedSize > fileSize - offset) break; // Truncated by the recorder getting killed mid-write
+    if (trace->numFrames == maxFrames)
+    {
+      maxFrames = MAX(1024, maxFrames*2);
+      trace->frames = (FrameTraceIndexEntry *)realloc(trace->frames, maxFrames * sizeof(FrameTraceIndexEntry));
+      if (!trace->frames) FATAL_ERROR("Out of memory indexing frame trace!");
+    }
+    FrameTraceIndexEntry &e = trace->frames[trace->numFrames++];
+    e.captureTime = record.captureTime;
+    e.offset = offset;
+    e.compressedSize = record.compressedSize;
+    e.keyframe = record.keyframe != 0;
+    fseek(handle, record.compressedSize, SEEK_CUR);
+  }
+
+  trace->framebuffer = (uint16_t *)calloc(header.width * header.height, 2);
+  trace->payload = (uint8_t *)malloc(MAX_PAYLOAD_SIZE(header));
+  trace->compressed = (uint8_t *)malloc(FRAME_TRACE_MAX_COMPRESSED_SIZE(MAX_PAYLOAD_SIZE(header)));
+  if (!trace->framebuffer || !trace->payload || !trace->compressed) FATAL_ERROR("Out of memory opening frame trace!");
+  return trace;
+}
+
+void CloseFrameTrace(FrameTrace *trace)
+{
+  if (!trace) return;
+  if (trace->handle) fclose(trace->handle);
+  free(trace->frames);
+  free(trace->framebuffer);
+  free(trace->payload);
+  free(trace->compressed);
+  free(trace);
+}
+
+// Applies the dirty tiles of the given frame on top of the framebuffer of the trace.
+static bool ApplyFrameTraceRecord(FrameTrace *trace, int frame)
+{
+  const FrameTraceHeader &header = trace->header;
+  const FrameTraceIndexEntry &e = trace->frames[frame];
+  if (e.compressedSize > (uint32_t)FRAME_TRACE_MAX_COMPRESSED_SIZE(MAX_PAYLOAD_SIZE(header))) return false;
+  if (fseek(trace->handle, e.offset, SEEK_SET) || fread(trace->compressed, 1, e.compressedSize, trace->handle) != e.compressedSize) return false;
+  int size = FrameTraceDecompress(trace->compressed, e.compressedSize, trace->payload, MAX_PAYLOAD_SIZE(header));
+  if (size < TILE_MASK_SIZE(header)) return false;
+
+  const uint8_t *mask = trace->payload;
+  const uint8_t *pixels = trace->payload + TILE_MASK_SIZE(header), *end = trace->payload + size;
+  const int ts = header.tileSize;
+  for(int ty = 0, tile = 0; ty < TILES_Y(header); ++ty)
+    for(int tx = 0; tx < TILES_X(header); ++tx, ++tile)
+    {
+      if (!(mask[tile >> 3] & (1 << (tile & 7)))) continue;
+      int x0 = tx * ts, y0 = ty * ts;
+      int w = MIN(ts, header.width - x0), h = MIN(ts, header.height - y0);
+      if (end - pixels < w*h*2) return false;
+      for(int y = y0; y < y0 + h; ++y, pixels += w*2)
+        memcpy(trace->framebuffer + y*header.width + x0, pixels, w*2);
+    }
+  return true;
+}
+
+const uint16_t *DecodeFrameTraceFrame(FrameTrace *trace, int frame)
+{
+  if (frame < 0 || frame >= trace->numFrames) return 0;
+  int start = frame;
+  while(start > 0 && !trace->frames[start].keyframe) --start;
+  if (trace->currentFrame >= start && trace->currentFrame <= frame) start = trace->currentFrame + 1; // Continue from where we are
+  for(int i = start; i <= frame; ++i)
+    if (!ApplyFrameTraceRecord(trace, i))
+    {
+      trace->currentFrame = -1;
+      return 0;
+    }
+  trace->currentFrame = frame;
+  return trace->framebuffer;
+}
+
+#ifdef FRAME_TRACE_FILE
+
+// Frames handed over from the GPU polling thread to the recorder thread. Single producer, single consumer.
+#define FRAME_TRACE_QUEUE_SIZE 4
+static uint16_t *traceQueue[FRAME_TRACE_QUEUE_SIZE] = {};
+static uint64_t traceQueueCaptureTimes[FRAME_TRACE_QUEUE_SIZE] = {};
+static uint32_t traceQueueFrameNumbers[FRAME_TRACE_QUEUE_SIZE] = {};
+static uint8_t traceQueueDroppedFrames[FRAME_TRACE_QUEUE_SIZE] = {};
+static volatile int traceQueueHead = 0, traceQueueTail = 0; // Running counts of frames consumed and produced
+static uint32_t traceFrameNumber = 0; // Only accessed by the GPU polling thread
+static int traceDroppedFrames = 0; // Only accessed by the GPU polling thread
+static FILE *traceFile = 0;
+static pthread_t traceThread;
+static bool traceThreadRunning = false;
+static volatile int traceThreadQuit = 0;
+static volatile int traceThreadExited = 0;
+
+void RecordFrameTrace(const uint16_t *framebuffer, uint64_t captureTime)
+{
+  if (!traceThreadRunning) return;
+  uint32_t frameNumber = traceFrameNumber++;
+  int tail = traceQueueTail;
+  if (tail - __atomic_load_n(&traceQueueHead, __ATOMIC_ACQUIRE) >= FRAME_TRACE_QUEUE_SIZE)
+  {
+    ++traceDroppedFrames; // The recorder is falling behind, e.g. the SD card is stalling. Drop the frame rather than stall the capture.
+    return;
+  }
+  int slot = tail % FRAME_TRACE_QUEUE_SIZE;
+  memcpy(traceQueue[slot], framebuffer, FRAMEBUFFER_SIZE);
+  traceQueueCaptureTimes[slot] = captureTime;
+  traceQueueFrameNumbers[slot] = frameNumber;
+  traceQueueDroppedFrames[slot] = (uint8_t)MIN(255, traceDroppedFrames);
+  traceDroppedFrames = 0;
+  __atomic_store_n(&traceQueueTail, tail + 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &traceQueueTail, FUTEX_WAKE, 1, 0, 0, 0);
+}
+
+static bool TileDiffers(const uint16_t *a, const uint16_t *b, int x0, int y0, int w, int h)
+{
+  for(int y = y0; y < y0 + h; ++y)
+    if (memcmp(a + y*DISPLAY_WIDTH + x0, b + y*DISPLAY_WIDTH + x0, w*2)) return true;
+  return false;
+}
+
+void *frame_trace_thread(void *unused)
+{
+  RegisterStatisticsThread("trace");
+  const FrameTraceHeader header = { FRAME_TRACE_MAGIC, FRAME_TRACE_VERSION, DISPLAY_WIDTH, DISPLAY_HEIGHT, FRAME_TRACE_TILE_SIZE, FRAME_TRACE_KEYFRAME_INTERVAL };
+  uint16_t *prevFrame = (uint16_t *)calloc(1, FRAMEBUFFER_SIZE);
+  uint8_t *payload = (uint8_t *)malloc(MAX_PAYLOAD_SIZE(header));
+  uint8_t *compressed = (uint8_t *)malloc(FRAME_TRACE_MAX_COMPRESSED_SIZE(MAX_PAYLOAD_SIZE(header)));
+  if (!prevFrame || !payload || !compressed) FATAL_ERROR("Out of memory allocating frame trace buffers!");
+  int recordsSinceKeyframe = FRAME_TRACE_KEYFRAME_INTERVAL; // The first record is always a keyframe
+  const int ts = FRAME_TRACE_TILE_SIZE;
+
+  for(;;)
+  {
+    int head = traceQueueHead;
+    while(__atomic_load_n(&traceQueueTail, __ATOMIC_ACQUIRE) == head)
+    {
+      if (__atomic_load_n(&traceThreadQuit, __ATOMIC_ACQUIRE)) goto done; // Stop only once the queue has been written out
+      syscall(SYS_futex, &traceQueueTail, FUTEX_WAIT, head, 0, 0, 0);
+    }
+    int slot = head % FRAME_TRACE_QUEUE_SIZE;
+    const uint16_t *frame = traceQueue[slot];
+
+    FrameTraceRecord record = {};
+    record.sync = FRAME_TRACE_RECORD_SYNC;
+    record.captureTime = traceQueueCaptureTimes[slot];
+    record.frameNumber = traceQueueFrameNumbers[slot];
+    record.droppedFrames = traceQueueDroppedFrames[slot];
+    record.keyframe = (recordsSinceKeyframe >= FRAME_TRACE_KEYFRAME_INTERVAL);
+    recordsSinceKeyframe = record.keyframe ? 1 : recordsSinceKeyframe + 1;
+
+    uint8_t *mask = payload;
+    uint8_t *pixels = payload + TILE_MASK_SIZE(header);
+    memset(mask, 0, TILE_MASK_SIZE(header));
+    for(int ty = 0, tile = 0; ty < TILES_Y(header); ++ty)
+      for(int tx = 0; tx < TILES_X(header); ++tx, ++tile)
+      {
+        int x0 = tx * ts, y0 = ty * ts;
+        int w = MIN(ts, DISPLAY_WIDTH - x0), h = MIN(ts, DISPLAY_HEIGHT - y0);
+        if (!record.keyframe && !TileDiffers(frame, prevFrame, x0, y0, w, h)) continue;
+        mask[tile >> 3] |= 1 << (tile & 7);
+        ++record.numDirtyTiles;
+        for(int y = y0; y < y0 + h; ++y, pixels += w*2)
+          memcpy(pixels, frame + y*DISPLAY_WIDTH + x0, w*2);
+      }
+    memcpy(prevFrame, frame, FRAMEBUFFER_SIZE);
+    __atomic_store_n(&traceQueueHead, head + 1, __ATOMIC_RELEASE); // Done with the queued frame, the polling thread can reuse the slot
+
+    record.compressedSize = FrameTraceCompress(payload, (uint32_t)(pixels - payload), compressed);
+    if (fwrite(&record, sizeof(record), 1, traceFile) != 1 || fwrite(compressed, 1, record.compressedSize, traceFile) != record.compressedSize)
+    {
+      syslog(LOG_ERR, "Failed to write frame trace to " FRAME_TRACE_FILE ", stopping recording");
+      fclose(traceFile);
+      traceFile = 0;
+      break; // Nothing consumes the queue from here on, so once the polling thread has filled it up, it drops all further frames
+    }
+    // Hand each record to the kernel right away, so that the trace is readable up to the last frame if the driver gets killed. This
+    // costs one write() per frame, on this thread rather than on the capture path.
+    fflush(traceFile);
+  }
+done:
+  free(prevFrame);
+  free(payload);
+  free(compressed);
+  __atomic_store_n(&traceThreadExited, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+void InitFrameTraceRecorder()
+{
+  traceFile = fopen(FRAME_TRACE_FILE, "wb");
+  if (!traceFile) FATAL_ERROR("Failed to open " FRAME_TRACE_FILE " for recording a frame trace!");
+  const FrameTraceHeader header = { FRAME_TRACE_MAGIC, FRAME_TRACE_VERSION, DISPLAY_WIDTH, DISPLAY_HEIGHT, FRAME_TRACE_TILE_SIZE, FRAME_TRACE_KEYFRAME_INTERVAL };
+  if (fwrite(&header, sizeof(header), 1, traceFile) != 1) FATAL_ERROR("Failed to write frame trace header!");
+
+  for(int i = 0; i < FRAME_TRACE_QUEUE_SIZE; ++i)
+  {
+    traceQueue[i] = (uint16_t *)malloc(FRAMEBUFFER_SIZE);
+    if (!traceQueue[i]) FATAL_ERROR("Out of memory allocating frame trace queue!");
+  }
+
+  traceQueueHead = traceQueueTail = 0;
+  traceThreadQuit = traceThreadExited = 0;
+  int rc = pthread_create(&traceThread, NULL, frame_trace_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create frame trace recorder thread!");
+  traceThreadRunning = true;
+  printf("Recording a frame trace to " FRAME_TRACE_FILE "\n");
+}
+
+void DeinitFrameTraceRecorder()
+{
+  if (!traceThreadRunning) return;
+  traceThreadRunning = false;
+  // The thread checks the quit flag before it sleeps on traceQueueTail, so a single wake can land in between and be lost: keep waking
+  // it until it has exited.
+  __atomic_store_n(&traceThreadQuit, 1, __ATOMIC_SEQ_CST);
+  while(!__atomic_load_n(&traceThreadExited, __ATOMIC_SEQ_CST))
+  {
+    syscall(SYS_futex, &traceQueueTail, FUTEX_WAKE, 1, 0, 0, 0);
+    usleep(1000);
+  }
+  pthread_join(traceThread, 0);
+  if (traceFile) fclose(traceFile);
+  traceFile = 0;
+  for(int i = 0; i < FRAME_TRACE_QUEUE_SIZE; ++i)
+  {
+    free(traceQueue[i]);
+    traceQueue[i] = 0;
+  }
+}
+
+#endif
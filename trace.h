@@ -0,0 +1,92 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "config.h"
+
+// Frame trace file format. A trace records the frames that the GPU polling thread captured and when it captured them, so that
+// performance problems seen on a device can be reproduced offline, e.g. by replaying the trace as the frame source of the simulator.
+//
+// The file starts with a FrameTraceHeader, followed by one FrameTraceRecord per captured frame, each immediately followed by its
+// compressed payload. The payload of a record is a bitmask of the dirty tiles of the frame (one bit per tile, in scanline order of
+// tiles), followed by the pixels of each dirty tile (tile scanlines top to bottom, tiles on the right and bottom edges clipped to
+// the frame), compressed as a single block with FrameTraceCompress(). A delta record has as dirty the tiles that differ from the
+// previous recorded frame, and a keyframe record has all tiles dirty, so that decoding can start from it.
+//
+// There is no index at the end of the file, since the driver is normally stopped by killing it. Instead, each record header has a
+// sync word and the size of its payload, so a reader can build an index of all frames by hopping from header to header without
+// decompressing anything, and seek to any frame by decoding forward from the closest preceding keyframe. A truncated last record
+// is ignored.
+
+#define FRAME_TRACE_MAGIC "FBCPTRC"
+#define FRAME_TRACE_VERSION 1
+#define FRAME_TRACE_RECORD_SYNC 0x43525446 // "FTRC"
+#define FRAME_TRACE_TILE_SIZE 16
+
+struct FrameTraceHeader
+{
+  char magic[8]; // FRAME_TRACE_MAGIC, null terminated
+  uint32_t version;
+  uint16_t width, height; // Frame size in pixels, 16 bits per pixel
+  uint16_t tileSize; // Width and height of a tile in pixels
+  uint16_t keyframeInterval; // Maximum number of records from one keyframe to the next
+};
+
+struct FrameTraceRecord
+{
+  uint32_t sync; // FRAME_TRACE_RECORD_SYNC
+  uint32_t compressedSize; // Size of the compressed payload that follows this header
+  uint64_t captureTime; // tick() time at which the GPU polling thread grabbed the frame, in usecs
+  uint32_t frameNumber; // Running number of the captured frame, counting also frames that were dropped from the trace
+  uint16_t numDirtyTiles;
+  uint8_t keyframe;
+  uint8_t droppedFrames; // Number of captured frames right before this one that the recorder could not keep up with (saturates at 255)
+};
+
+// Compresses srcSize bytes with a byte oriented LZ77 scheme that is fast enough to keep up with the capture rate on the Pi.
+// dst must have room for FRAME_TRACE_MAX_COMPRESSED_SIZE(srcSize) bytes. Returns the compressed size.
+#define FRAME_TRACE_MAX_COMPRESSED_SIZE(srcSize) ((srcSize) + (srcSize)/255 + 16)
+uint32_t FrameTraceCompress(const uint8_t *src, uint32_t srcSize, uint8_t *dst);
+
+// Decompresses a block produced by FrameTraceCompress(). Returns the decompressed size, or -1 if the block is corrupt or would
+// not fit in dstCapacity bytes.
+int FrameTraceDecompress(const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstCapacity);
+
+// Reading traces
+struct FrameTraceIndexEntry
+{
+  uint64_t captureTime;
+  long offset; // File offset of the compressed payload
+  uint32_t compressedSize;
+  bool keyframe;
+};
+
+struct FrameTrace
+{
+  FILE *handle;
+  FrameTraceHeader header;
+  int numFrames;
+  FrameTraceIndexEntry *frames;
+  int currentFrame; // Frame that framebuffer currently holds, or -1 if none
+  uint16_t *framebuffer; // width*height pixels
+  uint8_t *compressed, *payload; // Scratch buffers for decoding
+};
+
+// Opens a trace file and indexes its frames, or returns 0 if the file could not be read or is not a frame trace.
+FrameTrace *OpenFrameTrace(const char *filename);
+void CloseFrameTrace(FrameTrace *trace);
+
+// Decodes the given frame, and returns the framebuffer of the trace holding it, or 0 if the trace is corrupt.
+// Decoding frames in increasing order is cheapest, other frames are reached by decoding forward from the preceding keyframe.
+const uint16_t *DecodeFrameTraceFrame(FrameTrace *trace, int frame);
+
+#ifdef FRAME_TRACE_FILE
+
+// Recording traces: the GPU polling thread hands each new frame to the recorder, which copies it to a queue and returns. A recorder
+// thread then diffs, compresses and writes the frames out, so that the polling thread is never held up by the SD card.
+void InitFrameTraceRecorder(void);
+void DeinitFrameTraceRecorder(void); // Writes out the frames still in the queue, and closes the trace
+void RecordFrameTrace(const uint16_t *framebuffer, uint64_t captureTime);
+
+#endif